@@ -0,0 +1,153 @@
+// bench_dispatch.cpp – 入站命令解析的微基准：nlohmann DOM vs json_scan.hpp
+// 编译：g++ -std=c++17 -O2 -o bench_dispatch bench_dispatch.cpp -I<nlohmann 头文件目录>
+// 运行：./bench_dispatch [每种消息的迭代次数，默认 200000]
+// 全局 operator new 计数，报告每条消息的平均分配次数与耗时
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+#include "json_scan.hpp"
+
+// GCC 内联标准库的 deallocate 后会把替换过的 operator new/delete 误判为不配对
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+static std::atomic<unsigned long long> g_allocs{0};
+
+void *operator new(std::size_t n) {
+    ++g_allocs;
+    if (void *p = std::malloc(n ? n : 1))
+        return p;
+    throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+// 与 chat.js 实际发出的命令一致
+static const std::vector<std::string> SAMPLES = {
+    R"({"type":"group_message","group_id":12,"content":"晚上八点开会，记得带电脑"})",
+    R"({"type":"get_history","before_id":123456})",
+    R"({"type":"get_group_messages","group_id":3,"before_id":9001})",
+    R"({"type":"add_group_member","group_id":7,"username":"alice"})",
+    R"({"type":"create_group","group_name":"COMP3003 小组"})",
+    R"({"type":"group_message","group_id":12,"content":"line1\nline2 \"quoted\" 你好"})",
+    R"({"type":"search_messages","query":"开会","limit":20})", // chat.js 还没有搜索入口，按服务端协议
+    R"({"type":"group_message","group_id":12,"content":"emoji \ud83d\ude00 ok"})",
+};
+
+// 必须被拒绝的输入（两种实现都不该放行）
+static const std::vector<std::string> REJECTED = {
+    R"({"type":"group_message","group_id":12,"content":"a\udc00b"})", // 落单的低代理
+    R"({"type":"group_message","group_id":12,"content":"a\ud83db"})", // 落单的高代理
+};
+
+// 防止编译器把结果优化掉
+static volatile long long g_sink;
+
+// 旧实现：parse 成 DOM，type 拷成 string 后走 if/else 比较
+static void via_dom(std::string const &s) {
+    auto j = nlohmann::json::parse(s);
+    std::string type = j.value("type", "");
+    long long v = 0;
+    if (type == "create_group")
+        v = j.value("group_name", "").size();
+    else if (type == "add_group_member" || type == "remove_group_member")
+        v = j.value("group_id", -1) + j.value("username", "").size();
+    else if (type == "get_group_members")
+        v = j.value("group_id", -1);
+    else if (type == "get_group_messages")
+        v = j.value("group_id", -1) + j.value("before_id", cmd::NO_CURSOR);
+    else if (type == "group_message")
+        v = j.value("group_id", -1) + j.value("content", "").size();
+    else if (type == "get_history")
+        v = j.value("before_id", cmd::NO_CURSOR);
+    else if (type == "search_messages")
+        v = j.value("query", "").size() + j.value("cursor", "").size() + j.value("limit", 0);
+    g_sink = v;
+}
+
+// 新实现：扫描 + 完美哈希查表
+static void via_scan(std::string const &s, std::string &scratch) {
+    cmd::Command c;
+    if (!cmd::parse(s, scratch, c))
+        std::abort();
+    long long v = 0;
+    switch (c.type) {
+    case cmd::Type::CreateGroup:
+        v = c.group_name.size();
+        break;
+    case cmd::Type::AddMember:
+    case cmd::Type::RemoveMember:
+        v = c.group_id + c.username.size();
+        break;
+    case cmd::Type::GetMembers:
+        v = c.group_id;
+        break;
+    case cmd::Type::GetGroupMsgs:
+        v = c.group_id + c.before_id;
+        break;
+    case cmd::Type::GroupMessage:
+        v = c.group_id + c.content.size();
+        break;
+    case cmd::Type::GetHistory:
+        v = c.before_id;
+        break;
+    case cmd::Type::SearchMessages:
+        v = c.query.size() + c.cursor.size() + c.limit;
+        break;
+    case cmd::Type::Unknown:
+        std::abort();
+    }
+    g_sink = v;
+}
+
+template <class F>
+static void run(char const *label, int iters, F f) {
+    using clk = std::chrono::steady_clock;
+    for (int i = 0; i < 1000; ++i) // 预热：scratch 等容量到位
+        for (auto const &s : SAMPLES)
+            f(s);
+    auto a0 = g_allocs.load();
+    auto t0 = clk::now();
+    for (int i = 0; i < iters; ++i)
+        for (auto const &s : SAMPLES)
+            f(s);
+    double ns = std::chrono::duration<double, std::nano>(clk::now() - t0).count();
+    double n = double(iters) * SAMPLES.size();
+    std::printf("%-10s %8.1f ns/msg  %6.2f allocs/msg\n", label, ns / n, (g_allocs.load() - a0) / n);
+}
+
+int main(int argc, char **argv) {
+    int iters = argc > 1 ? std::atoi(argv[1]) : 200000;
+
+    // 两种实现先对一遍结果
+    std::string scratch;
+    for (auto const &s : SAMPLES) {
+        via_dom(s);
+        long long a = g_sink;
+        via_scan(s, scratch);
+        if (a != g_sink) {
+            std::printf("结果不一致: %s\n", s.c_str());
+            return 1;
+        }
+    }
+    for (auto const &s : REJECTED) {
+        cmd::Command c;
+        if (cmd::parse(s, scratch, c) || nlohmann::json::accept(s)) {
+            std::printf("应被拒绝: %s\n", s.c_str());
+            return 1;
+        }
+    }
+
+    std::printf("%zu 种消息 × %d 次\n", SAMPLES.size(), iters);
+    run("dom", iters, via_dom);
+    run("scan", iters, [&](std::string const &s) { via_scan(s, scratch); });
+    return 0;
+}
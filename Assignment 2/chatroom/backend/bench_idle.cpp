@@ -0,0 +1,282 @@
+// bench_idle.cpp – 空闲连接的内存占用：分阶段建满 N 条连接，读服务端 RSS 算每连接字节数
+// 编译：g++ -std=c++17 -O2 -o bench_idle bench_idle.cpp -I<boost 头文件目录> -lboost_system -pthread
+// 运行：./chatserver --kdf-iter=1000 &  ./bench_idle --pid=$! --conns=10000,100000
+//
+// 客户端只用裸 socket 手写握手与帧（每连接几百字节），免得压测端先撑不住；
+// 默认以同一账号登录（多标签页），连上后只回 pong、其余数据读完丢弃。
+// 10 万连接需要：两端 ulimit -n ≥ 100100；本机连接按 5 万个一组绑到 127.0.0.1/2/3...
+// 以绕开单个源地址的临时端口上限。
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using tcp = boost::asio::ip::tcp;
+
+struct Options {
+    std::string host = "127.0.0.1";
+    unsigned short port = 9002;
+    int pid = 0;                                  // 服务端进程号，读它的 RSS
+    std::vector<size_t> stages = {10000, 100000}; // 累计连接数
+    std::string login = "idle,pw";                // 空串：只握手不登录（注意服务端 --login-timeout-ms）
+    size_t parallel = 256;                        // 同时在握手 / 登录中的连接数
+    double settle = 3;                            // 每阶段建满后等多久再采样（秒）
+    bool deflate = false; // 像浏览器一样请求 permessage-deflate（服务端要为每连接留压缩状态）
+};
+Options g_opt;
+
+bool parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        auto eq = a.find('=');
+        std::string key = a.substr(0, eq), val = eq == std::string::npos ? "" : a.substr(eq + 1);
+        try {
+            if (key == "--host")
+                g_opt.host = val;
+            else if (key == "--port")
+                g_opt.port = (unsigned short)std::stoul(val);
+            else if (key == "--pid")
+                g_opt.pid = std::stoi(val);
+            else if (key == "--conns") { // 10000,100000
+                g_opt.stages.clear();
+                std::stringstream ss(val);
+                std::string item;
+                while (std::getline(ss, item, ','))
+                    g_opt.stages.push_back(std::stoul(item));
+                std::sort(g_opt.stages.begin(), g_opt.stages.end());
+            }
+            else if (key == "--login")
+                g_opt.login = val;
+            else if (key == "--parallel")
+                g_opt.parallel = std::max(1ul, std::stoul(val));
+            else if (key == "--settle")
+                g_opt.settle = std::stod(val);
+            else if (key == "--deflate")
+                g_opt.deflate = val != "0";
+            else
+                throw std::invalid_argument(a);
+        } catch (std::exception const &) {
+            std::fprintf(stderr, "用法: bench_idle --pid=<chatserver 进程号> [--host=127.0.0.1] [--port=9002]\n"
+                                 "                  [--conns=10000,100000] [--login=idle,pw] [--parallel=256] [--settle=3]\n"
+                                 "                  [--deflate=0]\n");
+            return false;
+        }
+    }
+    if (!g_opt.pid || g_opt.stages.empty()) {
+        std::fprintf(stderr, "必须给出 --pid\n");
+        return false;
+    }
+    return true;
+}
+
+// 服务端常驻内存（KiB）；ps 在 Linux / macOS 上都可用
+long rss_kib(int pid) {
+    std::string cmd = "ps -o rss= -p " + std::to_string(pid);
+    FILE *f = popen(cmd.c_str(), "r");
+    if (!f)
+        return -1;
+    long kib = -1;
+    if (std::fscanf(f, "%ld", &kib) != 1)
+        kib = -1;
+    pclose(f);
+    return kib;
+}
+
+// 客户端帧必须带掩码
+std::string client_frame(unsigned char opcode, std::string const &payload) {
+    static std::mt19937 rng{std::random_device{}()};
+    std::string f;
+    f += char(0x80 | opcode);
+    if (payload.size() < 126)
+        f += char(0x80 | payload.size());
+    else {
+        f += char(0x80 | 126);
+        f += char(payload.size() >> 8);
+        f += char(payload.size() & 0xff);
+    }
+    unsigned char mask[4];
+    for (auto &m : mask)
+        m = (unsigned char)rng();
+    f.append((char *)mask, 4);
+    for (size_t i = 0; i < payload.size(); ++i)
+        f += char(payload[i] ^ mask[i % 4]);
+    return f;
+}
+
+struct Stats {
+    size_t ready = 0, failed = 0, inflight = 0;
+};
+Stats g_stats;
+
+class Conn : public std::enable_shared_from_this<Conn> {
+    tcp::socket s_;
+    std::array<char, 4096> rd_;
+    std::string in_; // 未解析完的入站字节
+    bool upgraded_ = false;
+    enum { Pending, Ready, Failed } state_ = Pending; // Ready：握手完成，需要登录时收到欢迎语
+
+  public:
+    explicit Conn(boost::asio::io_context &ioc) : s_(ioc) {}
+
+    void start(tcp::endpoint server, boost::asio::ip::address local) {
+        ++g_stats.inflight;
+        boost::system::error_code ec;
+        s_.open(tcp::v4(), ec);
+        if (!ec && !local.is_unspecified())
+            s_.bind({local, 0}, ec);
+        if (ec)
+            return fail();
+        s_.async_connect(server, [self = shared_from_this()](boost::system::error_code ec) {
+            if (ec)
+                return self->fail();
+            self->send("GET /?batch=1 HTTP/1.1\r\nHost: " + g_opt.host +
+                       "\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                       "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n" +
+                       (g_opt.deflate ? "Sec-WebSocket-Extensions: permessage-deflate\r\n\r\n" : "\r\n"));
+            self->read();
+        });
+    }
+
+  private:
+    void fail() {
+        if (state_ == Failed)
+            return;
+        --(state_ == Ready ? g_stats.ready : g_stats.inflight);
+        ++g_stats.failed;
+        state_ = Failed;
+        boost::system::error_code ec;
+        s_.close(ec);
+    }
+    void mark_ready() {
+        if (state_ != Pending)
+            return;
+        state_ = Ready;
+        --g_stats.inflight;
+        ++g_stats.ready;
+    }
+    void send(std::string data) {
+        auto buf = std::make_shared<std::string>(std::move(data));
+        boost::asio::async_write(s_, boost::asio::buffer(*buf), [buf](boost::system::error_code, std::size_t) {});
+    }
+    void read() {
+        s_.async_read_some(boost::asio::buffer(rd_), [self = shared_from_this()](boost::system::error_code ec,
+                                                                                   std::size_t n) {
+            if (ec || self->state_ == Failed)
+                return self->fail();
+            self->in_.append(self->rd_.data(), n);
+            self->parse();
+            self->read();
+        });
+    }
+    void parse() {
+        if (!upgraded_) {
+            auto end = in_.find("\r\n\r\n");
+            if (end == std::string::npos)
+                return;
+            if (in_.compare(0, 12, "HTTP/1.1 101") != 0)
+                return fail();
+            in_.erase(0, end + 4);
+            upgraded_ = true;
+            if (!g_opt.login.empty())
+                send(client_frame(0x1, g_opt.login));
+            // 压缩后的数据帧看不出登录结果，发出登录行即算就绪
+            if (g_opt.login.empty() || g_opt.deflate)
+                mark_ready();
+        }
+        // 服务端帧不带掩码；只关心 ping 与登录结果
+        for (;;) {
+            if (in_.size() < 2)
+                return;
+            unsigned char op = in_[0] & 0x0f;
+            size_t len = in_[1] & 0x7f, off = 2;
+            if (len == 126) {
+                if (in_.size() < 4)
+                    return;
+                len = (size_t(uint8_t(in_[2])) << 8) | uint8_t(in_[3]);
+                off = 4;
+            } else if (len == 127) {
+                if (in_.size() < 10)
+                    return;
+                len = 0;
+                for (int i = 2; i < 10; ++i)
+                    len = (len << 8) | uint8_t(in_[i]);
+                off = 10;
+            }
+            if (in_.size() < off + len)
+                return;
+            std::string payload = in_.substr(off, len);
+            in_.erase(0, off + len);
+            if (op == 0x9)
+                send(client_frame(0xA, payload));
+            else if (op == 0x1 && state_ == Pending && payload.find("登录成功") != std::string::npos)
+                mark_ready();
+            else if (op == 0x1 && state_ == Pending && payload.find("登录失败") != std::string::npos)
+                return fail();
+        }
+    }
+};
+
+int main(int argc, char **argv) {
+    if (!parse_args(argc, argv))
+        return 1;
+    boost::asio::io_context ioc;
+    tcp::endpoint server{boost::asio::ip::make_address(g_opt.host), g_opt.port};
+    bool loopback = server.address().is_loopback();
+
+    // 先确保账号存在：注册失败（已存在）也无妨
+    auto ensure_account = [&] {
+        tcp::socket s(ioc);
+        s.connect(server);
+        std::string hs = "GET / HTTP/1.1\r\nHost: " + g_opt.host +
+                         "\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                         "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+        boost::asio::write(s, boost::asio::buffer(hs));
+        boost::asio::write(s, boost::asio::buffer(client_frame(0x1, "register " + g_opt.login)));
+        std::this_thread::sleep_for(std::chrono::seconds(1)); // 等哈希算完
+        boost::system::error_code ec;
+        s.close(ec);
+    };
+    if (!g_opt.login.empty())
+        ensure_account();
+
+    long base = rss_kib(g_opt.pid);
+    if (base < 0) {
+        std::fprintf(stderr, "读不到进程 %d 的 RSS\n", g_opt.pid);
+        return 1;
+    }
+    std::printf("baseline RSS %.1f MiB\n", base / 1024.0);
+    std::printf("%10s %10s %12s %14s\n", "conns", "failed", "RSS MiB", "bytes/conn");
+
+    size_t opened = 0;
+    auto local_for = [&](size_t i) {
+        if (!loopback)
+            return boost::asio::ip::address{};
+        return boost::asio::ip::address(boost::asio::ip::address_v4(0x7f000001 + unsigned(i / 50000)));
+    };
+    for (size_t target : g_opt.stages) {
+        // 控制并发：握手 / 登录中的连接不超过 parallel 个
+        while (g_stats.ready + g_stats.failed < target) {
+            while (opened < target && g_stats.inflight < g_opt.parallel) {
+                std::make_shared<Conn>(ioc)->start(server, local_for(opened));
+                ++opened;
+            }
+            ioc.run_for(std::chrono::milliseconds(10));
+        }
+        auto until = std::chrono::steady_clock::now() + std::chrono::duration<double>(g_opt.settle);
+        while (std::chrono::steady_clock::now() < until)
+            ioc.run_for(std::chrono::milliseconds(50));
+        long rss = rss_kib(g_opt.pid);
+        double per = g_stats.ready ? (rss - base) * 1024.0 / g_stats.ready : 0;
+        std::printf("%10zu %10zu %12.1f %14.0f\n", g_stats.ready, g_stats.failed, rss / 1024.0, per);
+        std::fflush(stdout);
+    }
+    return 0;
+}
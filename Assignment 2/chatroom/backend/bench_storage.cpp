@@ -0,0 +1,325 @@
+// bench_storage.cpp – 消息存储两种后端的对比：SQLite（chat_messages）vs 分段日志（segment_log.hpp）
+// 编译：g++ -std=c++17 -O2 -o bench_storage bench_storage.cpp -I<sqlite 头文件目录> -L<sqlite 库目录> -lsqlite3
+// 运行：./bench_storage [--rows=500000] [--convs=1000] [--body=80] [--batch=256] [--reads=50000] [--page=20]
+//                      [--segment-bytes=4194304] [--open-segments=256] [--dir=bench_storage.tmp]
+//                      [--durability=sync,group,async] [--durable-rows=5000] [--batch-ms=5]
+//
+// 写：单线程连续 append，SQLite 按服务端写线程的方式每 batch 条一个事务（synchronous=NORMAL，
+//     含 FTS 触发器），日志按 append 逐条 pwrite；消息随机落在 convs 个会话里。
+// 读：随机会话、随机 before_id 取一页，与服务端翻历史的访问方式相同；两边用同一组随机数。
+// 读阶段数据刚写完，都在页缓存里：比的是查找与解码开销，不是磁盘。
+// 落盘策略：按服务端写线程（--durability）的提交 / fsync 节奏各写 durable-rows 条，只计写入速度：
+//   sync   FULL，每条一个事务；日志每条 fsync
+//   group  FULL，每 batch 条或 batch-ms 毫秒一个事务；日志随之 fsync
+//   async  NORMAL，每条一个事务（队列即刻排空的最坏情况），每 batch 条或 batch-ms 毫秒
+//          fsync 一次 WAL / 日志
+// 这一段真的落盘，结果取决于磁盘的 fsync 延迟；--durability= 留空则跳过。
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sqlite3.h>
+#include <unistd.h>
+
+#include "schema.hpp"
+#include "segment_log.hpp"
+#include "storage.hpp"
+
+struct Options {
+    size_t rows = 500000;
+    size_t convs = 1000;
+    size_t body = 80;  // 每条正文字节数
+    size_t batch = 256; // SQLite 每个事务的条数（服务端 --db-batch-rows）
+    size_t reads = 50000;
+    size_t page = 20;
+    size_t segment_bytes = 4 << 20;
+    size_t open_segments = 256; // 日志同时打开的段数（服务端 --log-open-segments）
+    std::string dir = "bench_storage.tmp";
+    std::vector<std::string> durability = {"sync", "group", "async"};
+    size_t durable_rows = 5000;
+    unsigned batch_ms = 5; // 服务端 --db-batch-ms
+};
+Options g_opt;
+
+bool parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        auto eq = a.find('=');
+        std::string key = a.substr(0, eq), val = eq == std::string::npos ? "" : a.substr(eq + 1);
+        try {
+            if (key == "--rows")
+                g_opt.rows = std::stoul(val);
+            else if (key == "--convs")
+                g_opt.convs = std::max(1ul, std::stoul(val));
+            else if (key == "--body")
+                g_opt.body = std::stoul(val);
+            else if (key == "--batch")
+                g_opt.batch = std::max(1ul, std::stoul(val));
+            else if (key == "--reads")
+                g_opt.reads = std::stoul(val);
+            else if (key == "--page")
+                g_opt.page = std::max(1ul, std::stoul(val));
+            else if (key == "--segment-bytes")
+                g_opt.segment_bytes = std::max(4096ul, std::stoul(val));
+            else if (key == "--open-segments")
+                g_opt.open_segments = std::max(1ul, std::stoul(val));
+            else if (key == "--dir")
+                g_opt.dir = val;
+            else if (key == "--durability") {
+                g_opt.durability.clear();
+                for (size_t b = 0; b < val.size();) {
+                    size_t e = std::min(val.find(',', b), val.size());
+                    std::string m = val.substr(b, e - b);
+                    if (m != "sync" && m != "group" && m != "async")
+                        throw std::invalid_argument(m);
+                    g_opt.durability.push_back(m);
+                    b = e + 1;
+                }
+            } else if (key == "--durable-rows")
+                g_opt.durable_rows = std::max(1ul, std::stoul(val));
+            else if (key == "--batch-ms")
+                g_opt.batch_ms = unsigned(std::stoul(val));
+            else
+                throw std::invalid_argument(a);
+        } catch (std::exception const &) {
+            std::fprintf(stderr, "用法: bench_storage [--rows=500000] [--convs=1000] [--body=80] [--batch=256]\n"
+                                 "                     [--reads=50000] [--page=20] [--segment-bytes=4194304]\n"
+                                 "                     [--open-segments=256] [--dir=bench_storage.tmp]\n"
+                                 "                     [--durability=sync,group,async]\n"
+                                 "                     [--durable-rows=5000] [--batch-ms=5]\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+using Clock = std::chrono::steady_clock;
+double seconds_since(Clock::time_point t0) { return std::chrono::duration<double>(Clock::now() - t0).count(); }
+
+// 目录下所有文件的实际占用（稀疏文件按已分配的块算）
+double disk_mib(std::string const &dir) {
+    namespace fs = std::filesystem;
+    double bytes = 0;
+    for (auto const &f : fs::recursive_directory_iterator(dir))
+        if (f.is_regular_file()) {
+            struct stat st {};
+            if (::stat(f.path().c_str(), &st) == 0)
+                bytes += double(st.st_blocks) * 512;
+        }
+    return bytes / (1 << 20);
+}
+
+struct Result {
+    double insert_s = 0, read_s = 0;
+    size_t rows_read = 0;
+};
+
+// begin / commit 给 SQLite 开关事务，日志传空
+template <class Begin, class Commit>
+Result run(MessageStore &store, std::vector<long long> const &convs, Begin begin, Commit commit) {
+    Result r;
+    std::mt19937_64 rng(42);
+    std::string body(g_opt.body, 'x');
+    std::string const sender = "u1";
+    std::time_t t = std::time(nullptr);
+    long long last = 0;
+
+    auto t0 = Clock::now();
+    begin();
+    for (size_t i = 0; i < g_opt.rows; ++i) {
+        if (i && i % g_opt.batch == 0) {
+            commit();
+            begin();
+        }
+        body[i % body.size()] = char('a' + i % 26); // 正文各不相同，FTS 不会只索引同一个串
+        last = store.append(convs[rng() % convs.size()], 1, sender, body, t);
+        if (!last) {
+            std::fprintf(stderr, "append 失败（第 %zu 条）\n", i);
+            std::exit(1);
+        }
+    }
+    commit();
+    r.insert_s = seconds_since(t0);
+
+    std::vector<StoredMsg> out;
+    t0 = Clock::now();
+    for (size_t i = 0; i < g_opt.reads; ++i) {
+        out.clear();
+        long long before = (long long)(rng() % (unsigned long long)last) + 2;
+        store.page(convs[rng() % convs.size()], before, g_opt.page, out);
+        r.rows_read += out.size();
+    }
+    r.read_s = seconds_since(t0);
+    return r;
+}
+
+// 按服务端写线程在 mode 下的节奏写 durable_rows 条，返回每秒条数；db 为空时 store 是日志
+double run_durable(MessageStore &store, sqlite3 *db, std::string const &wal, std::vector<long long> const &convs,
+                   std::string const &mode) {
+    bool sync = mode == "sync", async = mode == "async";
+    std::mt19937_64 rng(7);
+    std::string body(g_opt.body, 'x');
+    std::time_t t = std::time(nullptr);
+    size_t in_txn = 0, unsynced = 0; // 当前事务的条数 / 已提交未 fsync 的条数
+    auto window = Clock::now();      // group：当前批；async：第一条未 fsync 的写入
+    auto fsync_all = [&] {
+        if (db) {
+            int fd = ::open(wal.c_str(), O_RDONLY);
+            if (fd >= 0) {
+                ::fsync(fd);
+                ::close(fd);
+            }
+        }
+        store.sync();
+        unsynced = 0;
+    };
+
+    auto t0 = Clock::now();
+    for (size_t i = 0; i < g_opt.durable_rows; ++i) {
+        if (!in_txn && db)
+            schema::exec(db, "BEGIN IMMEDIATE;");
+        if (!in_txn && !unsynced)
+            window = Clock::now();
+        body[i % body.size()] = char('a' + i % 26);
+        if (!store.append(convs[rng() % convs.size()], 1, "u1", body, t)) {
+            std::fprintf(stderr, "append 失败（第 %zu 条）\n", i);
+            std::exit(1);
+        }
+        ++in_txn;
+        bool due = seconds_since(window) * 1000 >= g_opt.batch_ms;
+        if (!sync && !async && in_txn < g_opt.batch && !due)
+            continue;
+        if (db)
+            schema::exec(db, "COMMIT;"); // FULL 下即一次 fsync
+        in_txn = 0;
+        if (!async)
+            store.sync();
+        else if (++unsynced >= g_opt.batch || due)
+            fsync_all();
+    }
+    if (in_txn) {
+        if (db)
+            schema::exec(db, "COMMIT;");
+        store.sync();
+    }
+    if (unsynced)
+        fsync_all();
+    return g_opt.durable_rows / seconds_since(t0);
+}
+
+// 与服务端相同的表结构与 PRAGMA，再建 convs 个会话（大厅之外是群会话）
+sqlite3 *open_sqlite(std::string const &file, char const *synchronous, std::vector<long long> &convs) {
+    sqlite3 *db = nullptr;
+    if (sqlite3_open(file.c_str(), &db) != SQLITE_OK) {
+        std::fprintf(stderr, "无法打开 %s\n", file.c_str());
+        sqlite3_close(db);
+        return nullptr;
+    }
+    schema::exec(db, "PRAGMA journal_mode=WAL;");
+    schema::exec(db, std::string("PRAGMA synchronous=") + synchronous + ";");
+    schema::exec(db, "BEGIN;");
+    bool ok = schema::ensure_users(db) && schema::ensure_messages(db) &&
+              schema::exec(db, "INSERT INTO users(id,username,salt,hash) VALUES(1,'u1',x'00',x'00');");
+    convs = {schema::LOBBY_CONV};
+    for (size_t i = 1; ok && i < g_opt.convs; ++i) {
+        ok = schema::exec(db, "INSERT INTO conversations(kind,group_id) VALUES(2," + std::to_string(i) + ");");
+        convs.push_back((long long)sqlite3_last_insert_rowid(db));
+    }
+    if (!ok || !schema::exec(db, "COMMIT;")) {
+        sqlite3_close(db);
+        return nullptr;
+    }
+    return db;
+}
+
+void report(char const *name, Result const &r, double mib) {
+    std::printf("%-8s %14.0f %14.0f %14.0f %12.1f\n", name, g_opt.rows / r.insert_s, g_opt.reads / r.read_s,
+                r.rows_read / r.read_s, mib);
+}
+
+int main(int argc, char **argv) {
+    if (!parse_args(argc, argv))
+        return 1;
+    namespace fs = std::filesystem;
+    fs::remove_all(g_opt.dir);
+    fs::create_directories(g_opt.dir + "/sqlite");
+
+    // SQLite：写、读各一个连接
+    std::string db_file = g_opt.dir + "/sqlite/chatserver.db";
+    std::vector<long long> convs;
+    sqlite3 *writer = open_sqlite(db_file, "NORMAL", convs), *reader = nullptr;
+    if (!writer || sqlite3_open(db_file.c_str(), &reader) != SQLITE_OK)
+        return 1;
+
+    std::printf("%zu 条 × %zu 字节正文，%zu 个会话，SQLite 每 %zu 条一个事务；%zu 次翻页 × %zu 条\n", g_opt.rows,
+                g_opt.body, convs.size(), g_opt.batch, g_opt.reads, g_opt.page);
+    std::printf("%-8s %14s %14s %14s %12s\n", "backend", "insert rows/s", "pages/s", "read rows/s", "disk MiB");
+
+    Result sq;
+    {
+        PlainStmts ws(writer), rs(reader);
+        SqliteStore<PlainStmts> store(ws);
+        SqliteStore<PlainStmts>::attach_reader(&rs);
+        sq = run(store, convs, [&] { schema::exec(writer, "BEGIN;"); }, [&] { schema::exec(writer, "COMMIT;"); });
+        SqliteStore<PlainStmts>::detach_reader();
+    }
+    schema::exec(writer, "PRAGMA wal_checkpoint(TRUNCATE);");
+    sqlite3_close(reader);
+    sqlite3_close(writer);
+    report("sqlite", sq, disk_mib(g_opt.dir + "/sqlite"));
+
+    Result lg;
+    {
+        seglog::LogStore store(g_opt.dir + "/log", g_opt.segment_bytes, g_opt.open_segments);
+        std::string err;
+        if (!store.open(err)) {
+            std::fprintf(stderr, "%s\n", err.c_str());
+            return 1;
+        }
+        lg = run(store, convs, [] {}, [] {});
+    }
+    report("log", lg, disk_mib(g_opt.dir + "/log"));
+
+    // 落盘策略：每种模式各用一个新库 / 新日志目录
+    if (!g_opt.durability.empty()) {
+        std::printf("\n落盘策略：每种 %zu 条，batch %zu 条 / %u ms\n", g_opt.durable_rows, g_opt.batch,
+                    g_opt.batch_ms);
+        std::printf("%-8s %14s %14s\n", "mode", "sqlite rows/s", "log rows/s");
+    }
+    for (auto const &mode : g_opt.durability) {
+        std::string dir = g_opt.dir + "/" + mode;
+        fs::create_directories(dir);
+        std::string file = dir + "/chatserver.db";
+        sqlite3 *db = open_sqlite(file, mode == "async" ? "NORMAL" : "FULL", convs);
+        if (!db)
+            return 1;
+        double sq_rate;
+        {
+            PlainStmts ws(db);
+            SqliteStore<PlainStmts> store(ws);
+            sq_rate = run_durable(store, db, file + "-wal", convs, mode);
+        }
+        sqlite3_close(db);
+        double log_rate;
+        {
+            seglog::LogStore store(dir + "/log", g_opt.segment_bytes, g_opt.open_segments);
+            std::string err;
+            if (!store.open(err)) {
+                std::fprintf(stderr, "%s\n", err.c_str());
+                return 1;
+            }
+            log_rate = run_durable(store, nullptr, "", convs, mode);
+        }
+        std::printf("%-8s %14.0f %14.0f\n", mode.c_str(), sq_rate, log_rate);
+        fs::remove_all(dir);
+    }
+
+    fs::remove_all(g_opt.dir);
+    return 0;
+}
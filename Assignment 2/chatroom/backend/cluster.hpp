@@ -0,0 +1,426 @@
+// cluster.hpp – 多进程集群：节点间的轻量发布 / 订阅总线（无外部 broker）
+// 全网状拓扑：
+//   - 每个节点向 --peers 里的每个地址主动建一条 TCP 出链（Link），只用来发
+//   - 对端连进来的入链（Inbound）只用来收；入链断开即视为该节点下线
+//   - 帧格式：4 字节大端长度 + MessagePack 编码的 JSON 对象
+//   - 握手：出链先发 {"type":"hello","node":N,"secret":S}，入链核对口令后回同样一帧报出自己的编号；
+//     出链同样核对对端的口令。口令不对的连接直接关掉，一帧也不交给上层
+//   - 默认只在回环地址上监听；没有口令时入链也只接受回环地址来的连接
+// 尽力而为：出链未就绪或积压超限时消息直接丢弃并计数；
+// 出链（重新）建立后先发 snapshot() 给出的全量状态，对端据此纠正。
+// 所有节点可以用同一份 --peers 列表：连到自己时对方回的 hello 编号等于本节点，该出链直接作废。
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <nlohmann/json.hpp>
+
+namespace cluster {
+
+using tcp = boost::asio::ip::tcp;
+using Message = nlohmann::json;
+using Buffer = std::shared_ptr<std::string const>; // 编码好的一帧，广播时所有出链共享
+
+constexpr size_t MAX_FRAME = 16 << 20;
+
+struct Endpoint {
+    std::string host, port;
+};
+
+// "127.0.0.1:9201,10.0.0.2:9201"
+inline std::vector<Endpoint> parse_peers(std::string const &s) {
+    std::vector<Endpoint> out;
+    for (size_t pos = 0; pos < s.size();) {
+        size_t comma = std::min(s.find(',', pos), s.size());
+        std::string item = s.substr(pos, comma - pos);
+        pos = comma + 1;
+        if (item.empty())
+            continue;
+        auto colon = item.rfind(':');
+        if (colon == std::string::npos || colon == 0 || colon + 1 == item.size())
+            throw std::invalid_argument(item);
+        out.push_back({item.substr(0, colon), item.substr(colon + 1)});
+    }
+    return out;
+}
+
+inline Buffer encode(Message const &m) {
+    auto body = Message::to_msgpack(m);
+    auto s = std::make_shared<std::string>(4 + body.size(), '\0');
+    uint32_t n = uint32_t(body.size());
+    for (int i = 0; i < 4; ++i)
+        (*s)[i] = char(n >> (24 - 8 * i));
+    std::copy(body.begin(), body.end(), s->begin() + 4);
+    return s;
+}
+
+// 读一帧到 body：先 4 字节长度再正文；h(ec) 在 socket 的 executor 上回调
+template <class Handler>
+void async_read_frame(tcp::socket &s, std::array<unsigned char, 4> &hdr, std::string &body, Handler h) {
+    boost::asio::async_read(s, boost::asio::buffer(hdr),
+                            [&s, &hdr, &body, h = std::move(h)](boost::system::error_code ec, size_t) mutable {
+                                if (ec)
+                                    return h(ec);
+                                size_t n = size_t(hdr[0]) << 24 | size_t(hdr[1]) << 16 | size_t(hdr[2]) << 8 | hdr[3];
+                                if (n > MAX_FRAME)
+                                    return h(make_error_code(boost::asio::error::message_size));
+                                body.resize(n);
+                                boost::asio::async_read(s, boost::asio::buffer(body),
+                                                        [h = std::move(h)](boost::system::error_code ec, size_t) mutable {
+                                                            h(ec);
+                                                        });
+                            });
+}
+
+inline Message decode(std::string const &body) {
+    auto p = reinterpret_cast<unsigned char const *>(body.data());
+    return Message::from_msgpack(p, p + body.size(), true, /*allow_exceptions=*/false);
+}
+
+// 合格的 hello：对象，带整数 node，secret 与本节点的口令相同（逐字节比较，耗时与内容无关）。
+// 合格时返回对端编号，否则 -1
+inline int check_hello(Message const &m, std::string const &secret) {
+    if (!m.is_object())
+        return -1;
+    auto node = m.find("node"), got = m.find("secret");
+    if (node == m.end() || !node->is_number_integer() || node->get<int>() < 0)
+        return -1;
+    std::string const *s = got != m.end() ? got->get_ptr<std::string const *>() : nullptr;
+    if (!s)
+        return secret.empty() ? node->get<int>() : -1;
+    unsigned char diff = s->size() != secret.size();
+    for (size_t i = 0; i < secret.size(); ++i)
+        diff |= uint8_t(secret[i] ^ (i < s->size() ? (*s)[i] : 0));
+    return diff ? -1 : node->get<int>();
+}
+
+struct Stats {
+    std::atomic<uint64_t> out_msgs{0}, out_bytes{0}; // 出链实际写出（含帧头）
+    std::atomic<uint64_t> in_msgs{0}, in_bytes{0};
+    std::atomic<uint64_t> dropped{0}; // 出链未就绪 / 积压超限丢弃的消息
+    std::atomic<uint64_t> resets{0};  // 出链断开重连次数
+    std::atomic<uint64_t> rejected{0}; // 握手不合格（口令不对 / 非回环来源）被关掉的连接
+};
+
+class Bus {
+  public:
+    using OnMessage = std::function<void(int node, Message const &)>; // 入链收到一条（在该入链的 strand 上）
+    using OnPeer = std::function<void(int node, bool up)>;            // 入链握手完成 / 断开
+    using Snapshot = std::function<std::vector<Message>()>;           // 出链就绪时最先发送的全量状态
+
+    // bind 为监听地址；secret 为空时只接受回环地址来的入链
+    Bus(boost::asio::io_context &ioc, int self, boost::asio::ip::address const &bind, unsigned short port,
+        std::vector<Endpoint> peers, size_t max_queue, std::string secret)
+        : ioc_(ioc), self_(self), max_queue_(max_queue), secret_(std::move(secret)), acceptor_(ioc, {bind, port}) {
+        for (auto &ep : peers)
+            links_.push_back(std::make_shared<Link>(*this, std::move(ep)));
+    }
+
+    void start(OnMessage on_msg, OnPeer on_peer, Snapshot snapshot) {
+        on_msg_ = std::move(on_msg);
+        on_peer_ = std::move(on_peer);
+        snapshot_ = std::move(snapshot);
+        accept();
+        for (auto &l : links_)
+            l->start();
+    }
+
+    // 发给所有已就绪的出链；只编码一次
+    void publish(Message const &m) {
+        auto b = encode(m);
+        for (auto &l : links_)
+            l->send(b);
+    }
+    // 只发给指定节点（找不到就绪的出链则丢弃）
+    void send_to(int node, Message const &m) {
+        for (auto &l : links_)
+            if (l->node() == node)
+                return l->send(encode(m));
+        ++stats_.dropped;
+    }
+
+    int self() const { return self_; }
+    size_t links_up() const {
+        size_t n = 0;
+        for (auto &l : links_)
+            n += l->node() >= 0;
+        return n;
+    }
+    Stats const &stats() const { return stats_; }
+
+  private:
+    // ── 出链：断开后按退避重连；发送队列在 strand 上串行
+    class Link : public std::enable_shared_from_this<Link> {
+        Bus &bus_;
+        Endpoint ep_;
+        boost::asio::strand<boost::asio::io_context::executor_type> strand_;
+        tcp::socket sock_;
+        tcp::resolver resolver_;
+        boost::asio::steady_timer retry_;
+        std::atomic<int> node_{-1}; // 对端编号；-1 表示未就绪
+        bool up_ = false, self_loop_ = false;
+        unsigned epoch_ = 0; // 每次重连 +1，旧连接迟到的回调据此作废
+        unsigned backoff_ms_ = 100;
+        std::deque<Buffer> q_;
+        size_t q_bytes_ = 0;
+        std::vector<Buffer> inflight_;
+        std::vector<boost::asio::const_buffer> gather_;
+        std::array<unsigned char, 4> hdr_{};
+        std::string body_;
+        char eof_probe_ = 0;
+
+      public:
+        Link(Bus &bus, Endpoint ep)
+            : bus_(bus), ep_(std::move(ep)), strand_(boost::asio::make_strand(bus.ioc_)), sock_(strand_),
+              resolver_(strand_), retry_(strand_) {}
+
+        int node() const { return node_.load(std::memory_order_relaxed); }
+        void start() {
+            boost::asio::post(strand_, [self = shared_from_this()] { self->connect(); });
+        }
+        void send(Buffer b) {
+            boost::asio::post(strand_, [self = shared_from_this(), b = std::move(b)]() mutable {
+                self->enqueue(std::move(b));
+            });
+        }
+
+      private:
+        void connect() {
+            unsigned ep = epoch_;
+            resolver_.async_resolve(ep_.host, ep_.port, [self = shared_from_this(), ep](auto ec, auto results) {
+                if (ep != self->epoch_)
+                    return;
+                if (ec)
+                    return self->reset();
+                boost::asio::async_connect(self->sock_, results, [self, ep](auto ec, auto const &) {
+                    if (ep != self->epoch_)
+                        return;
+                    if (ec)
+                        return self->reset();
+                    self->sock_.set_option(tcp::no_delay(true));
+                    self->handshake();
+                });
+            });
+        }
+        void handshake() {
+            unsigned ep = epoch_;
+            auto hello = bus_.hello();
+            boost::asio::async_write(sock_, boost::asio::buffer(*hello),
+                                     [self = shared_from_this(), ep, hello](boost::system::error_code ec, size_t) {
+                                         if (ep != self->epoch_)
+                                             return;
+                                         if (ec)
+                                             return self->reset();
+                                         async_read_frame(self->sock_, self->hdr_, self->body_, [self, ep](auto ec) {
+                                             if (ep != self->epoch_)
+                                                 return;
+                                             if (ec)
+                                                 return self->reset();
+                                             self->on_hello(decode(self->body_));
+                                         });
+                                     });
+        }
+        void on_hello(Message const &m) {
+            int node = check_hello(m, bus_.secret_);
+            if (node < 0) {
+                ++bus_.stats_.rejected;
+                return reset();
+            }
+            if (node == bus_.self_) { // --peers 里列了自己
+                self_loop_ = true;
+                boost::system::error_code ignored;
+                sock_.close(ignored);
+                return;
+            }
+            up_ = true;
+            backoff_ms_ = 100;
+            for (auto &s : bus_.snapshot_())
+                push(encode(s));
+            node_ = node;
+            write();
+            // 对端从不在出链上发数据：这个读只在断开时完成
+            unsigned ep = epoch_;
+            boost::asio::async_read(sock_, boost::asio::buffer(&eof_probe_, 1),
+                                    [self = shared_from_this(), ep](boost::system::error_code, size_t) {
+                                        if (ep == self->epoch_)
+                                            self->reset();
+                                    });
+        }
+        void push(Buffer b) {
+            q_bytes_ += b->size();
+            q_.push_back(std::move(b));
+        }
+        void enqueue(Buffer b) {
+            if (!up_) {
+                if (!self_loop_)
+                    ++bus_.stats_.dropped;
+                return;
+            }
+            if (q_bytes_ + b->size() > bus_.max_queue_) { // 对端跟不上：断开重连，由快照纠正状态
+                bus_.stats_.dropped += q_.size() + 1;
+                return reset();
+            }
+            push(std::move(b));
+            if (inflight_.empty())
+                write();
+        }
+        // 队列里现有的帧一次聚合写出
+        void write() {
+            if (q_.empty())
+                return;
+            inflight_.assign(std::make_move_iterator(q_.begin()), std::make_move_iterator(q_.end()));
+            q_.clear();
+            q_bytes_ = 0;
+            gather_.clear();
+            for (auto &b : inflight_)
+                gather_.push_back(boost::asio::buffer(*b));
+            unsigned ep = epoch_;
+            boost::asio::async_write(sock_, gather_, [self = shared_from_this(), ep](boost::system::error_code ec, size_t n) {
+                if (ep != self->epoch_)
+                    return;
+                if (ec)
+                    return self->reset();
+                self->bus_.stats_.out_msgs += self->inflight_.size();
+                self->bus_.stats_.out_bytes += n;
+                self->inflight_.clear();
+                self->write();
+            });
+        }
+        void reset() {
+            if (up_)
+                ++bus_.stats_.resets;
+            ++epoch_;
+            up_ = false;
+            node_ = -1;
+            bus_.stats_.dropped += q_.size();
+            q_.clear();
+            q_bytes_ = 0;
+            inflight_.clear();
+            boost::system::error_code ignored;
+            sock_.close(ignored);
+            if (self_loop_)
+                return;
+            retry_.expires_after(std::chrono::milliseconds(backoff_ms_));
+            backoff_ms_ = std::min(backoff_ms_ * 2, 2000u);
+            unsigned ep = epoch_;
+            retry_.async_wait([self = shared_from_this(), ep](boost::system::error_code ec) {
+                if (!ec && ep == self->epoch_)
+                    self->connect();
+            });
+        }
+    };
+
+    // ── 入链：握手后循环读帧，交给 on_msg_
+    class Inbound : public std::enable_shared_from_this<Inbound> {
+        Bus &bus_;
+        tcp::socket sock_; // executor 是独立 strand
+        std::array<unsigned char, 4> hdr_{};
+        std::string body_;
+        int node_ = -1;
+        uint64_t gen_;
+
+      public:
+        Inbound(Bus &bus, tcp::socket sock, uint64_t gen) : bus_(bus), sock_(std::move(sock)), gen_(gen) {}
+
+        void start() {
+            boost::system::error_code ec;
+            auto from = sock_.remote_endpoint(ec);
+            if (bus_.secret_.empty() && (ec || !from.address().is_loopback())) {
+                ++bus_.stats_.rejected;
+                return;
+            }
+            sock_.set_option(tcp::no_delay(true), ec);
+            async_read_frame(sock_, hdr_, body_, [self = shared_from_this()](auto ec) {
+                if (ec)
+                    return;
+                self->node_ = check_hello(decode(self->body_), self->bus_.secret_);
+                if (self->node_ < 0) { // 关掉连接，不回 hello
+                    ++self->bus_.stats_.rejected;
+                    return;
+                }
+                auto hello = self->bus_.hello();
+                boost::asio::async_write(self->sock_, boost::asio::buffer(*hello),
+                                         [self, hello](boost::system::error_code ec, size_t) {
+                                             if (ec || self->node_ == self->bus_.self_)
+                                                 return;
+                                             self->bus_.inbound_up(self->node_, self->gen_);
+                                             self->read();
+                                         });
+            });
+        }
+
+      private:
+        void read() {
+            async_read_frame(sock_, hdr_, body_, [self = shared_from_this()](auto ec) {
+                if (ec)
+                    return self->bus_.inbound_down(self->node_, self->gen_);
+                self->bus_.stats_.in_msgs++;
+                self->bus_.stats_.in_bytes += 4 + self->body_.size();
+                auto m = decode(self->body_);
+                if (m.is_object())
+                    self->bus_.on_msg_(self->node_, m);
+                self->read();
+            });
+        }
+    };
+
+    Buffer hello() const {
+        Message m{{"type", "hello"}, {"node", self_}};
+        if (!secret_.empty())
+            m["secret"] = secret_;
+        return encode(m);
+    }
+
+    void accept() {
+        acceptor_.async_accept(boost::asio::make_strand(ioc_), [this](boost::system::error_code ec, tcp::socket s) {
+            if (!ec)
+                std::make_shared<Inbound>(*this, std::move(s), ++next_gen_)->start();
+            if (acceptor_.is_open())
+                accept();
+        });
+    }
+    // 同一节点重连时新入链顶替旧的；旧入链迟到的断开不算下线
+    void inbound_up(int node, uint64_t gen) {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            current_[node] = gen;
+        }
+        on_peer_(node, true);
+    }
+    void inbound_down(int node, uint64_t gen) {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            auto it = current_.find(node);
+            if (it == current_.end() || it->second != gen)
+                return;
+            current_.erase(it);
+        }
+        on_peer_(node, false);
+    }
+
+    boost::asio::io_context &ioc_;
+    int self_;
+    size_t max_queue_;
+    std::string secret_;
+    tcp::acceptor acceptor_;
+    std::vector<std::shared_ptr<Link>> links_;
+    OnMessage on_msg_;
+    OnPeer on_peer_;
+    Snapshot snapshot_;
+    Stats stats_;
+    std::mutex mu_;
+    std::unordered_map<int, uint64_t> current_; // 节点 → 当前入链代号
+    std::atomic<uint64_t> next_gen_{0};
+};
+
+} // namespace cluster
@@ -0,0 +1,31 @@
+#!/bin/bash
+
+# 在本机启动 N 个 chatserver 节点组成集群（默认 3 个），共用当前目录下的 chatserver.db
+#   节点 i：websocket 端口 9002+i，/metrics 端口 9102+i，总线端口 9202+i
+#   其余参数原样传给每个节点，例如 ./cluster.sh 3 --kdf-iter=1000 --threads=2
+# Ctrl-C 结束全部节点；各节点日志在 node<i>.log
+
+N=${1:-3}
+shift
+
+if [ ! -x ./chatserver ]; then
+  echo "找不到 ./chatserver，请先运行 ./compile.sh"
+  exit 1
+fi
+
+PEERS=""
+for ((i = 0; i < N; i++)); do
+  PEERS="$PEERS${PEERS:+,}127.0.0.1:$((9202 + i))"
+done
+
+PIDS=()
+for ((i = 0; i < N; i++)); do
+  ./chatserver --node-id=$i --port=$((9002 + i)) --metrics-port=$((9102 + i)) \
+    --cluster-port=$((9202 + i)) --peers=$PEERS "$@" > node$i.log 2>&1 &
+  PIDS+=($!)
+  echo "节点 $i：ws://localhost:$((9002 + i))  日志 node$i.log"
+done
+
+trap 'kill ${PIDS[@]} 2>/dev/null' INT TERM
+echo "压测：./loadgen --port=$(seq -s, 9002 $((9001 + N)))"
+wait
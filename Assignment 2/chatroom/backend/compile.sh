@@ -35,9 +35,15 @@ if [ $? -eq 0 ]; then
   echo "编译成功！"
   echo ""
   echo "使用方法："
-  echo "1. 运行 ./chatserver 启动聊天服务器"
+  echo "1. 运行 ./chatserver 启动聊天服务器（可选参数 --port=9002 --threads=N --durability=sync|group|async --db-batch-ms=5 --db-batch-rows=256 --presence-tick-ms=200 --history-ring=200 --wq-max-bytes=1048576 --wq-max-msgs=1024 --presence-policy=coalesce --chat-policy=drop-oldest|coalesce|disconnect --stats-interval=0 --batch-max-bytes=65536 --batch-max-items=64 --deflate=1 --deflate-threshold=256 --deflate-window-bits=15 --deflate-mem-level=4 --deflate-level=6 --deflate-no-context=0 --auth-threads=2 --auth-queue=256 --read-threads=4 --kdf-iter=100000 --metrics-port=9102（0 关闭）--node-id=0 --cluster-port=0 --peers=host:port,... --cluster-bind=127.0.0.1 --cluster-secret=口令（监听非回环地址时必填） --cluster-queue-bytes=67108864 --resume-grace-ms=30000 --resume-msgs=512 --resume-bytes=1048576 --login-timeout-ms=60000 --ping-interval-ms=30000 --idle-timeout-ms=90000 --max-msg-bytes=65536 --search-window=256 --storage=sqlite|log --log-dir=chatlog --log-segment-bytes=4194304 --log-open-segments=256（log 为单进程分段日志，不支持搜索）；指标见 http://localhost:9102/metrics）"
   echo "2. 在另一个终端窗口，进入前端目录并运行 python3 -m http.server 8000"
   echo "3. 在浏览器访问 http://localhost:8000"
+  echo "（可选）压测：g++ -std=c++17 -O2 -o loadgen loadgen.cpp -I$BOOST_INCLUDE -I/opt/homebrew/include/ -L$BOOST_LIB -lboost_system -pthread && ./loadgen --conns=1000 --duration=10（服务端建议加 --kdf-iter=1000）"
+  echo "（可选）本机多进程集群：./cluster.sh 3 --kdf-iter=1000（节点 i 监听 9002+i，共用 chatserver.db）"
+  echo "（可选）命令解析微基准：g++ -std=c++17 -O2 -o bench_dispatch bench_dispatch.cpp -I/opt/homebrew/include/ && ./bench_dispatch"
+  echo "（可选）存储后端对比：g++ -std=c++17 -O2 -o bench_storage bench_storage.cpp -I$SQLITE_INCLUDE -L$SQLITE_LIB -lsqlite3 && ./bench_storage --rows=500000 --convs=1000 --durability=sync,group,async（后者按各落盘策略真实 fsync）"
+  echo "（旧库升级）g++ -std=c++17 -O2 -o migrate migrate.cpp -I$SQLITE_INCLUDE -L$SQLITE_LIB -lsqlite3 && ./migrate --drop-legacy（可在服务端运行时执行，断点续搬）"
+  echo "（可选）空闲连接内存：g++ -std=c++17 -O2 -o bench_idle bench_idle.cpp -I$BOOST_INCLUDE -L$BOOST_LIB -lboost_system -pthread && ./bench_idle --pid=<chatserver 进程号> --conns=10000,100000（需 ulimit -n 足够大）"
 else
   echo "编译失败，请检查错误信息"
 fi
\ No newline at end of file
@@ -0,0 +1,327 @@
+// json_scan.hpp – 入站 JSON 命令的扁平扫描与分发表
+// 前端发来的命令都是一层的小对象，只需要其中几个字段：
+// 直接在读缓冲上扫描，字段以 string_view 指回原文，不建 DOM、不分配内存。
+// 只有带转义的字符串才解码进调用方提供的 scratch（容量复用，稳定后同样不分配）。
+#pragma once
+
+#include <charconv>
+#include <climits>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+namespace cmd {
+
+enum class Type : unsigned char {
+    Unknown,
+    CreateGroup,
+    AddMember,
+    RemoveMember,
+    GetMembers,
+    GetGroupMsgs,
+    GroupMessage,
+    GetHistory,
+    SearchMessages,
+};
+
+constexpr long long NO_CURSOR = LLONG_MAX;
+
+// 严格的 UTF-8 校验：拒绝截断、超长编码、代理区（U+D800..DFFF）与 U+10FFFF 以上的码点。
+// 文本帧由 Beast 校验；MessagePack 的 str 不保证是 UTF-8，入站时用它查
+inline bool valid_utf8(std::string_view s) {
+    auto p = reinterpret_cast<unsigned char const *>(s.data()), end = p + s.size();
+    while (p < end) {
+        unsigned c = *p++;
+        if (c < 0x80)
+            continue;
+        int n = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc2 ? 1 : -1;
+        if (n < 0 || c > 0xf4 || end - p < n)
+            return false;
+        unsigned cp = c & (0x3f >> n);
+        for (int i = 0; i < n; ++i, ++p) {
+            if ((*p & 0xc0) != 0x80)
+                return false;
+            cp = cp << 6 | (*p & 0x3f);
+        }
+        if ((n == 2 && (cp < 0x800 || (cp >= 0xd800 && cp < 0xe000))) || (n == 3 && (cp < 0x10000 || cp > 0x10ffff)))
+            return false;
+    }
+    return true;
+}
+
+// 各命令用到的字段的并集；缺省值与原先 j.value(...) 的默认一致
+struct Command {
+    Type type = Type::Unknown;
+    long long group_id = -1;
+    long long before_id = NO_CURSOR;
+    long long limit = 0; // search_messages 的每页条数；0 取服务端默认
+    std::string_view group_name, username, content;
+    std::string_view query, cursor; // search_messages
+};
+
+// ────────── type → Type 的完美哈希 ──────────
+// 现有 8 个命令名长度两两不同，长度本身就是无冲突的哈希；
+// 命中槽位后再比一次全文。新增命令若与已有长度冲突，下面的 static_assert 会报错
+struct Entry {
+    std::string_view name;
+    Type type;
+};
+constexpr Entry COMMANDS[] = {
+    {"create_group", Type::CreateGroup},         {"add_group_member", Type::AddMember},
+    {"remove_group_member", Type::RemoveMember}, {"get_group_members", Type::GetMembers},
+    {"get_group_messages", Type::GetGroupMsgs},  {"group_message", Type::GroupMessage},
+    {"get_history", Type::GetHistory},           {"search_messages", Type::SearchMessages},
+};
+constexpr size_t MIN_LEN = 11, SLOTS = 9; // 长度 11..19
+
+struct Table {
+    Entry slot[SLOTS]{};
+    bool ok = true;
+    constexpr Table() {
+        for (auto const &e : COMMANDS) {
+            size_t h = e.name.size() - MIN_LEN;
+            if (e.name.size() < MIN_LEN || h >= SLOTS || slot[h].type != Type::Unknown)
+                ok = false;
+            else
+                slot[h] = e;
+        }
+    }
+};
+constexpr Table TABLE{};
+static_assert(TABLE.ok, "命令名长度冲突：请换一个哈希");
+
+inline Type lookup(std::string_view name) {
+    size_t h = name.size() - MIN_LEN; // 过短时回绕成很大的数
+    if (h >= SLOTS)
+        return Type::Unknown;
+    auto const &e = TABLE.slot[h];
+    return e.name == name ? e.type : Type::Unknown;
+}
+
+// ────────── 扫描器 ──────────
+class Scanner {
+    char const *p_, *end_;
+    std::string &scratch_;
+
+    void ws() {
+        while (p_ < end_ && (*p_ == ' ' || *p_ == '\t' || *p_ == '\n' || *p_ == '\r'))
+            ++p_;
+    }
+    bool eat(char c) {
+        ws();
+        if (p_ < end_ && *p_ == c) {
+            ++p_;
+            return true;
+        }
+        return false;
+    }
+    static int hex(char c) {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+        c |= 0x20;
+        return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+    }
+    bool hex4(unsigned &cp) {
+        if (end_ - p_ < 4)
+            return false;
+        cp = 0;
+        for (int i = 0; i < 4; ++i) {
+            int v = hex(*p_++);
+            if (v < 0)
+                return false;
+            cp = cp << 4 | v;
+        }
+        return true;
+    }
+    void utf8(unsigned cp) {
+        if (cp < 0x80)
+            scratch_ += char(cp);
+        else if (cp < 0x800)
+            scratch_ += {char(0xc0 | cp >> 6), char(0x80 | (cp & 0x3f))};
+        else if (cp < 0x10000)
+            scratch_ += {char(0xe0 | cp >> 12), char(0x80 | (cp >> 6 & 0x3f)), char(0x80 | (cp & 0x3f))};
+        else
+            scratch_ += {char(0xf0 | cp >> 18), char(0x80 | (cp >> 12 & 0x3f)), char(0x80 | (cp >> 6 & 0x3f)),
+                         char(0x80 | (cp & 0x3f))};
+    }
+    // 已吃掉开头的引号；无转义时直接返回原文视图
+    bool string(std::string_view &out) {
+        char const *begin = p_;
+        while (p_ < end_ && *p_ != '"' && *p_ != '\\')
+            ++p_;
+        if (p_ == end_)
+            return false;
+        if (*p_ == '"') {
+            out = {begin, size_t(p_++ - begin)};
+            return true;
+        }
+        // 有转义：解码追加到 scratch 末尾（容量已预留，之前给出的视图不会失效）
+        size_t start = scratch_.size();
+        scratch_.append(begin, p_);
+        while (p_ < end_ && *p_ != '"') {
+            if (*p_ != '\\') {
+                scratch_ += *p_++;
+                continue;
+            }
+            if (++p_ == end_)
+                return false;
+            switch (char c = *p_++) {
+            case '"':
+            case '\\':
+            case '/':
+                scratch_ += c;
+                break;
+            case 'b':
+                scratch_ += '\b';
+                break;
+            case 'f':
+                scratch_ += '\f';
+                break;
+            case 'n':
+                scratch_ += '\n';
+                break;
+            case 'r':
+                scratch_ += '\r';
+                break;
+            case 't':
+                scratch_ += '\t';
+                break;
+            case 'u': {
+                unsigned cp, lo;
+                if (!hex4(cp))
+                    return false;
+                if (cp >= 0xd800 && cp < 0xdc00) { // 代理对
+                    if (end_ - p_ < 2 || p_[0] != '\\' || p_[1] != 'u')
+                        return false;
+                    p_ += 2;
+                    if (!hex4(lo) || lo < 0xdc00 || lo >= 0xe000)
+                        return false;
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                } else if (cp >= 0xdc00 && cp < 0xe000) // 落单的低代理：编出来不是合法 UTF-8
+                    return false;
+                utf8(cp);
+                break;
+            }
+            default:
+                return false;
+            }
+        }
+        if (p_ == end_)
+            return false;
+        ++p_;
+        out = {scratch_.data() + start, scratch_.size() - start};
+        return true;
+    }
+    bool number(long long &out) {
+        char const *begin = p_;
+        while (p_ < end_ && (std::strchr("+-.eE", *p_) || (*p_ >= '0' && *p_ <= '9')))
+            ++p_;
+        // 只取整数部分；浮点写法的 id 按截断处理
+        auto r = std::from_chars(begin, p_, out);
+        return r.ec == std::errc{};
+    }
+    // 已吃掉开头的引号，跳到结尾引号之后；没有结尾引号（含末尾落单的反斜杠）返回 false
+    bool skip_string() {
+        while (p_ < end_) {
+            if (*p_ == '"') {
+                ++p_;
+                return true;
+            }
+            if (*p_ == '\\' && end_ - p_ < 2)
+                return false;
+            p_ += *p_ == '\\' ? 2 : 1;
+        }
+        return false;
+    }
+    // 跳过不关心的值（嵌套对象 / 数组 / 字面量）
+    bool skip() {
+        ws();
+        if (p_ == end_)
+            return false;
+        if (*p_ == '"') {
+            ++p_;
+            return skip_string();
+        }
+        if (*p_ == '{' || *p_ == '[') {
+            int depth = 0;
+            while (p_ < end_) {
+                char c = *p_++;
+                if (c == '"') {
+                    if (!skip_string())
+                        return false;
+                } else if (c == '{' || c == '[')
+                    ++depth;
+                else if ((c == '}' || c == ']') && --depth == 0)
+                    return true;
+            }
+            return false;
+        }
+        char const *begin = p_;
+        while (p_ < end_ && *p_ != ',' && *p_ != '}' && *p_ != ' ' && *p_ != '\n' && *p_ != '\r' && *p_ != '\t')
+            ++p_;
+        return p_ > begin;
+    }
+    bool str_field(std::string_view &out) {
+        ws();
+        if (p_ < end_ && *p_ == '"') {
+            ++p_;
+            return string(out);
+        }
+        return skip(); // 类型不符按缺省处理
+    }
+    bool int_field(long long &out) {
+        ws();
+        if (p_ < end_ && (*p_ == '-' || (*p_ >= '0' && *p_ <= '9')))
+            return number(out);
+        return skip();
+    }
+
+  public:
+    Scanner(std::string_view in, std::string &scratch) : p_(in.data()), end_(in.data() + in.size()), scratch_(scratch) {
+        scratch_.clear();
+        scratch_.reserve(in.size()); // 解码结果不会比原文长
+    }
+
+    // 解析失败返回 false；未知字段跳过
+    bool parse(Command &c) {
+        if (!eat('{'))
+            return false;
+        if (eat('}'))
+            return true;
+        do {
+            std::string_view key;
+            if (!eat('"') || !string(key) || !eat(':'))
+                return false;
+            bool ok;
+            if (key == "type") {
+                std::string_view t;
+                ok = str_field(t);
+                c.type = lookup(t);
+            } else if (key == "group_id")
+                ok = int_field(c.group_id);
+            else if (key == "before_id")
+                ok = int_field(c.before_id);
+            else if (key == "group_name")
+                ok = str_field(c.group_name);
+            else if (key == "username")
+                ok = str_field(c.username);
+            else if (key == "content")
+                ok = str_field(c.content);
+            else if (key == "query")
+                ok = str_field(c.query);
+            else if (key == "cursor")
+                ok = str_field(c.cursor);
+            else if (key == "limit")
+                ok = int_field(c.limit);
+            else
+                ok = skip();
+            if (!ok)
+                return false;
+        } while (eat(','));
+        return eat('}');
+    }
+};
+
+inline bool parse(std::string_view in, std::string &scratch, Command &c) { return Scanner(in, scratch).parse(c); }
+
+} // namespace cmd
@@ -0,0 +1,452 @@
+// loadgen.cpp – 聊天服务器压测客户端（Boost.Beast，仅连 localhost）
+// 编译：g++ -std=c++17 -O2 -o loadgen loadgen.cpp -I<boost/nlohmann 头文件目录> -lboost_system -pthread
+// 运行：./loadgen --conns=1000 --duration=10 --rate=1 --mix=lobby:10,dm:60,group:30
+//       集群：--port=9002,9003,9004 把连接轮流分到各节点，跨节点的扇出同样计入延迟
+//
+// 流程：全部连接注册 + 登录 → 每组第一个连接建群并拉人 → 按比例发大厅 / 私聊 / 群消息 → 汇总。
+// 每条消息正文里带发送时刻（steady_clock，同一进程内可比），接收端据此算端到端扇出延迟；
+// 发给自己的回显（大厅广播、私聊回显）不计入。
+// 注意：服务端默认 --kdf-iter=100000，几千个账号注册会很慢，压测时建议服务端加 --kdf-iter=1000。
+#include <boost/asio.hpp>
+#include <boost/beast.hpp>
+#include <boost/beast/websocket.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include <nlohmann/json.hpp>
+
+using tcp = boost::asio::ip::tcp;
+namespace ws = boost::beast::websocket;
+using json = nlohmann::json;
+using clk = std::chrono::steady_clock;
+
+// ────────── 参数 ──────────
+struct Options {
+    std::vector<std::string> ports = {"9002"}; // 多个端口时连接轮流分配（集群模式）
+    unsigned conns = 100;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    double duration = 10;  // 秒，发消息阶段时长
+    double rate = 1;       // 每个连接每秒发几条
+    unsigned size = 64;    // 消息正文字节数（含时间戳标记）
+    unsigned group_size = 10; // 每个群的人数
+    unsigned mix[3] = {10, 60, 30}; // lobby / dm / group 权重
+    std::string prefix = "lg";      // 用户名前缀：lg0, lg1, ...
+    std::string password = "pw";
+    bool do_register = true;
+    bool batch = true; // 握手带 ?batch=1
+};
+Options g_opt;
+
+bool parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        auto eq = a.find('=');
+        std::string key = a.substr(0, eq), val = eq == std::string::npos ? "" : a.substr(eq + 1);
+        try {
+            if (key == "--port") { // 9002 或 9002,9003,9004
+                g_opt.ports.clear();
+                std::stringstream ss(val);
+                std::string item;
+                while (std::getline(ss, item, ','))
+                    if (!item.empty())
+                        g_opt.ports.push_back(item);
+                if (g_opt.ports.empty())
+                    throw std::invalid_argument(val);
+            }
+            else if (key == "--conns")
+                g_opt.conns = std::max(2ul, std::stoul(val));
+            else if (key == "--threads")
+                g_opt.threads = std::max(1ul, std::stoul(val));
+            else if (key == "--duration")
+                g_opt.duration = std::stod(val);
+            else if (key == "--rate")
+                g_opt.rate = std::stod(val);
+            else if (key == "--size")
+                g_opt.size = std::stoul(val);
+            else if (key == "--group-size")
+                g_opt.group_size = std::max(2ul, std::stoul(val));
+            else if (key == "--prefix")
+                g_opt.prefix = val;
+            else if (key == "--password")
+                g_opt.password = val;
+            else if (key == "--register")
+                g_opt.do_register = std::stoi(val) != 0;
+            else if (key == "--batch")
+                g_opt.batch = std::stoi(val) != 0;
+            else if (key == "--mix") { // lobby:10,dm:60,group:30
+                std::fill(std::begin(g_opt.mix), std::end(g_opt.mix), 0);
+                std::stringstream ss(val);
+                std::string item;
+                while (std::getline(ss, item, ',')) {
+                    auto c = item.find(':');
+                    std::string k = item.substr(0, c);
+                    unsigned w = std::stoul(item.substr(c + 1));
+                    if (k == "lobby")
+                        g_opt.mix[0] = w;
+                    else if (k == "dm")
+                        g_opt.mix[1] = w;
+                    else if (k == "group")
+                        g_opt.mix[2] = w;
+                    else
+                        throw std::invalid_argument(k);
+                }
+            } else
+                throw std::invalid_argument(key);
+        } catch (std::exception const &) {
+            std::cerr << "无法识别的参数: " << a << "\n"
+                      << "用法: loadgen [--port=9002[,9003...]] [--conns=100] [--threads=N] [--duration=10] [--rate=1]\n"
+                         "               [--size=64] [--group-size=10] [--mix=lobby:10,dm:60,group:30]\n"
+                         "               [--prefix=lg] [--password=pw] [--register=1] [--batch=1]\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// ────────── 全局统计 ──────────
+std::atomic<unsigned> g_ready{0}, g_failed{0}, g_groups_ready{0};
+std::atomic<bool> g_sending{false}, g_measuring{false};
+std::atomic<unsigned long long> g_sent[3]{}, g_recv_frames{0}, g_recv_bytes{0};
+std::vector<std::atomic<int>> *g_group_ids; // 每个群的 id，0 = 尚未建好
+
+// 各线程自己攒延迟样本，结束后合并
+struct Samples {
+    std::mutex mu;
+    std::vector<std::vector<uint32_t>> per_thread; // 微秒
+} g_samples;
+
+long long now_ns() { return std::chrono::duration_cast<std::chrono::nanoseconds>(clk::now().time_since_epoch()).count(); }
+
+// ────────── 单个连接 ──────────
+class Client : public std::enable_shared_from_this<Client> {
+    enum class State { Connecting, Registering, LoggingIn, Ready, Closed };
+
+    ws::stream<tcp::socket> ws_;
+    tcp::resolver resolver_;
+    boost::asio::steady_timer timer_;
+    boost::beast::flat_buffer buf_;
+    std::deque<std::string> out_;
+    unsigned idx_;
+    std::string name_;
+    State state_ = State::Connecting;
+    std::vector<uint32_t> &lat_; // 本线程的样本
+    std::mt19937 rng_;
+    unsigned group_;                  // 所属群下标
+    bool owner_ = false;              // 本群第一个连接负责建群拉人
+    unsigned pending_adds_ = 0;
+
+  public:
+    Client(boost::asio::io_context &ioc, unsigned idx, std::vector<uint32_t> &lat)
+        : ws_(ioc), resolver_(ioc), timer_(ioc), idx_(idx), name_(g_opt.prefix + std::to_string(idx)), lat_(lat),
+          rng_(idx * 7919 + 17), group_(idx / g_opt.group_size), owner_(idx % g_opt.group_size == 0) {}
+
+    void start() {
+        auto const &port = g_opt.ports[idx_ % g_opt.ports.size()];
+        resolver_.async_resolve("127.0.0.1", port, [self = shared_from_this()](auto ec, auto results) {
+            if (ec)
+                return self->fail("resolve", ec);
+            boost::asio::async_connect(self->ws_.next_layer(), results, [self](auto ec, auto) {
+                if (ec)
+                    return self->fail("connect", ec);
+                self->ws_.async_handshake("localhost", g_opt.batch ? "/?batch=1" : "/", [self](auto ec) {
+                    if (ec)
+                        return self->fail("handshake", ec);
+                    self->ws_.text(true);
+                    self->read();
+                    self->begin_auth();
+                });
+            });
+        });
+    }
+    void stop() {
+        boost::asio::post(ws_.get_executor(), [self = shared_from_this()] {
+            self->timer_.cancel();
+            if (self->state_ == State::Closed)
+                return;
+            self->state_ = State::Closed;
+            boost::system::error_code ec;
+            self->ws_.next_layer().close(ec);
+        });
+    }
+
+  private:
+    void fail(char const *what, boost::system::error_code ec) {
+        if (state_ != State::Ready && state_ != State::Closed) {
+            if (++g_failed <= 5)
+                std::cerr << name_ << ": " << what << ": " << ec.message() << '\n';
+        }
+        state_ = State::Closed;
+    }
+    void begin_auth() {
+        if (g_opt.do_register) {
+            state_ = State::Registering;
+            send("register " + name_ + "," + g_opt.password);
+        } else {
+            state_ = State::LoggingIn;
+            send(name_ + "," + g_opt.password);
+        }
+    }
+    void send(std::string s) {
+        out_.push_back(std::move(s));
+        if (out_.size() == 1)
+            write();
+    }
+    void write() {
+        ws_.async_write(boost::asio::buffer(out_.front()), [self = shared_from_this()](auto ec, std::size_t) {
+            if (ec)
+                return self->fail("write", ec);
+            self->out_.pop_front();
+            if (!self->out_.empty())
+                self->write();
+        });
+    }
+    void read() {
+        ws_.async_read(buf_, [self = shared_from_this()](auto ec, std::size_t) {
+            if (ec)
+                return self->fail("read", ec);
+            auto data = self->buf_.data();
+            std::string_view frame{static_cast<char const *>(data.data()), data.size()};
+            self->on_frame(frame);
+            self->buf_.consume(self->buf_.size());
+            self->read();
+        });
+    }
+    // 服务端繁忙（认证队列满）时稍后重试
+    void retry_later(std::string line) {
+        timer_.expires_after(std::chrono::milliseconds(200 + rng_() % 300));
+        timer_.async_wait([self = shared_from_this(), line](auto ec) {
+            if (!ec)
+                self->send(line);
+        });
+    }
+
+    void on_frame(std::string_view f) {
+        if (state_ == State::Ready) {
+            ++g_recv_frames;
+            g_recv_bytes += f.size();
+            scan_markers(f);
+            if (owner_ && f.find("_response") != std::string_view::npos)
+                on_setup_response(f);
+            return;
+        }
+        if (f.find("请输入") != std::string_view::npos)
+            return; // 登录提示
+        if (state_ == State::Registering) {
+            if (f.find("繁忙") != std::string_view::npos)
+                return retry_later("register " + name_ + "," + g_opt.password);
+            // 注册失败 = 账号已存在，照样登录
+            state_ = State::LoggingIn;
+            send(name_ + "," + g_opt.password);
+        } else if (state_ == State::LoggingIn) {
+            if (f.find("繁忙") != std::string_view::npos)
+                return retry_later(name_ + "," + g_opt.password);
+            if (f.find("登录成功") == std::string_view::npos) {
+                fail("login", {});
+                return;
+            }
+            state_ = State::Ready;
+            ++g_ready;
+            if (owner_)
+                create_group();
+            schedule();
+        }
+    }
+
+    // ── 建群：群名带进程号，重复压测同一个库也不会重名
+    void create_group() {
+        json j = {{"type", "create_group"},
+                  {"group_name", g_opt.prefix + "-g" + std::to_string(group_) + "-" + std::to_string(::getpid())}};
+        send(j.dump());
+    }
+    void on_setup_response(std::string_view f) {
+        json j = json::parse(f, nullptr, false);
+        if (j.is_discarded())
+            return;
+        auto visit = [&](json const &e) {
+            auto type = e.value("type", "");
+            if (type == "create_group_response" && e.contains("group")) {
+                int gid = e["group"].value("id", 0);
+                unsigned first = group_ * g_opt.group_size,
+                         last = std::min(g_opt.conns, first + g_opt.group_size);
+                for (unsigned m = first + 1; m < last; ++m) {
+                    ++pending_adds_;
+                    send(json{{"type", "add_group_member"}, {"group_id", gid}, {"username", g_opt.prefix + std::to_string(m)}}
+                             .dump());
+                }
+                (*g_group_ids)[group_].store(gid);
+                if (!pending_adds_)
+                    ++g_groups_ready;
+            } else if (type == "add_member_response" && pending_adds_ && --pending_adds_ == 0)
+                ++g_groups_ready;
+        };
+        if (j.value("type", "") == "batch")
+            for (auto const &e : j["items"])
+                e.is_object() ? visit(e) : void();
+        else
+            visit(j);
+    }
+
+    // ── 发送：定时器按 rate 触发，类型按权重随机
+    void schedule() {
+        double mean_ms = 1000.0 / std::max(g_opt.rate, 1e-3);
+        std::exponential_distribution<double> gap(1.0 / mean_ms); // 泊松到达，避免所有连接同步
+        timer_.expires_after(std::chrono::microseconds((long long)(gap(rng_) * 1000)));
+        timer_.async_wait([self = shared_from_this()](auto ec) {
+            if (ec || self->state_ != State::Ready)
+                return;
+            if (g_sending)
+                self->send_one();
+            self->schedule();
+        });
+    }
+    std::string payload() {
+        std::string s = "LG#" + std::to_string(idx_) + "#" + std::to_string(now_ns()) + "#";
+        if (s.size() < g_opt.size)
+            s.append(g_opt.size - s.size(), 'x');
+        return s;
+    }
+    void send_one() {
+        unsigned total = g_opt.mix[0] + g_opt.mix[1] + g_opt.mix[2];
+        if (!total)
+            return;
+        unsigned r = rng_() % total;
+        int kind = r < g_opt.mix[0] ? 0 : r < g_opt.mix[0] + g_opt.mix[1] ? 1 : 2;
+        if (kind == 2) {
+            int gid = (*g_group_ids)[group_].load();
+            if (!gid)
+                return;
+            send(json{{"type", "group_message"}, {"group_id", gid}, {"content", payload()}}.dump());
+        } else if (kind == 1) {
+            unsigned peer = rng_() % (g_opt.conns - 1);
+            if (peer >= idx_)
+                ++peer;
+            send("@" + g_opt.prefix + std::to_string(peer) + " " + payload());
+        } else
+            send(payload());
+        ++g_sent[kind];
+    }
+    // 一帧里可能有多条（batch），逐个找 LG#发送者#时间戳#
+    void scan_markers(std::string_view f) {
+        if (!g_measuring)
+            return;
+        long long now = now_ns();
+        for (size_t p = f.find("LG#"); p != std::string_view::npos; p = f.find("LG#", p + 3)) {
+            char const *s = f.data() + p + 3, *end = f.data() + f.size();
+            unsigned sender = 0;
+            while (s < end && *s >= '0' && *s <= '9')
+                sender = sender * 10 + (*s++ - '0');
+            if (s == end || *s++ != '#')
+                continue;
+            long long ts = 0;
+            while (s < end && *s >= '0' && *s <= '9')
+                ts = ts * 10 + (*s++ - '0');
+            if (sender == idx_ || ts <= 0)
+                continue; // 自己的回显
+            lat_.push_back((uint32_t)std::min<long long>((now - ts) / 1000, UINT32_MAX));
+        }
+    }
+};
+
+// ────────── main ──────────
+double pct(std::vector<uint32_t> const &v, double p) {
+    if (v.empty())
+        return 0;
+    size_t i = std::min(v.size() - 1, (size_t)(p * v.size()));
+    return v[i] / 1000.0;
+}
+
+int main(int argc, char **argv) {
+    if (!parse_args(argc, argv))
+        return 1;
+    unsigned ngroups = (g_opt.conns + g_opt.group_size - 1) / g_opt.group_size;
+    std::vector<std::atomic<int>> group_ids(ngroups);
+    g_group_ids = &group_ids;
+
+    // 每线程一个 io_context：同一连接的回调天然串行，样本 vector 也不用加锁
+    std::vector<std::unique_ptr<boost::asio::io_context>> iocs;
+    std::vector<boost::asio::executor_work_guard<boost::asio::io_context::executor_type>> guards;
+    g_samples.per_thread.resize(g_opt.threads);
+    for (unsigned t = 0; t < g_opt.threads; ++t) {
+        iocs.push_back(std::make_unique<boost::asio::io_context>(1));
+        guards.push_back(boost::asio::make_work_guard(*iocs.back()));
+    }
+    std::vector<std::shared_ptr<Client>> clients;
+    for (unsigned i = 0; i < g_opt.conns; ++i) {
+        unsigned t = i % g_opt.threads;
+        clients.push_back(std::make_shared<Client>(*iocs[t], i, g_samples.per_thread[t]));
+        clients.back()->start();
+    }
+    std::vector<std::thread> pool;
+    for (auto &ioc : iocs)
+        pool.emplace_back([&ioc] { ioc->run(); });
+
+    auto wait_for = [](char const *what, auto done, double timeout_s) {
+        auto t0 = clk::now();
+        while (!done()) {
+            if (std::chrono::duration<double>(clk::now() - t0).count() > timeout_s) {
+                std::cout << what << "超时\n";
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+        return true;
+    };
+
+    // 1. 登录
+    auto t0 = clk::now();
+    wait_for("登录", [&] { return g_ready + g_failed >= g_opt.conns; }, 120);
+    std::printf("登录: %u 成功, %u 失败, 用时 %.2f s\n", g_ready.load(), g_failed.load(),
+                std::chrono::duration<double>(clk::now() - t0).count());
+
+    // 2. 建群（只在需要群消息时等）
+    if (g_opt.mix[2]) {
+        t0 = clk::now();
+        wait_for("建群", [&] { return g_groups_ready >= ngroups; }, 60);
+        std::printf("建群: %u/%u 个群就绪, 用时 %.2f s\n", g_groups_ready.load(), ngroups,
+                    std::chrono::duration<double>(clk::now() - t0).count());
+    }
+
+    // 3. 发消息
+    auto recv0 = g_recv_frames.load(), bytes0 = g_recv_bytes.load();
+    g_measuring = true;
+    g_sending = true;
+    t0 = clk::now();
+    std::this_thread::sleep_for(std::chrono::duration<double>(g_opt.duration));
+    g_sending = false;
+    double elapsed = std::chrono::duration<double>(clk::now() - t0).count();
+    std::this_thread::sleep_for(std::chrono::seconds(2)); // 等在途消息到达
+    g_measuring = false;
+
+    for (auto &c : clients)
+        c->stop();
+    guards.clear();
+    for (auto &t : pool)
+        t.join();
+
+    // 4. 汇总
+    std::vector<uint32_t> all;
+    for (auto &v : g_samples.per_thread)
+        all.insert(all.end(), v.begin(), v.end());
+    std::sort(all.begin(), all.end());
+    unsigned long long sent = g_sent[0] + g_sent[1] + g_sent[2];
+    std::printf("发送: %llu 条 (lobby %llu, dm %llu, group %llu), %.0f msg/s\n", sent, g_sent[0].load(),
+                g_sent[1].load(), g_sent[2].load(), sent / elapsed);
+    std::printf("接收: %llu 帧, %.1f MB, 送达 %zu 条, %.0f deliveries/s\n", g_recv_frames.load() - recv0,
+                (g_recv_bytes.load() - bytes0) / 1e6, all.size(), all.size() / elapsed);
+    std::printf("扇出延迟 (ms): p50 %.2f  p99 %.2f  p999 %.2f  max %.2f\n", pct(all, 0.5), pct(all, 0.99),
+                pct(all, 0.999), all.empty() ? 0.0 : all.back() / 1000.0);
+    return g_failed ? 2 : 0;
+}
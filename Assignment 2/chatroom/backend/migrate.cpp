@@ -0,0 +1,267 @@
+// migrate.cpp – 把旧库的 messages / group_messages 分批搬进按会话归档的 chat_messages（见 schema.hpp）
+// 编译：g++ -std=c++17 -O2 -o migrate migrate.cpp -I<sqlite 头文件目录> -L<sqlite 库目录> -lsqlite3
+// 运行：./migrate [--db=chatserver.db] [--batch=2000] [--pause-ms=20] [--drop-legacy]
+//
+// 可以在 chatserver 运行时执行：每批一个短事务，批间歇一会儿把写锁让给服务端。
+//   - 两张旧表各按 id 顺序读，按时间归并后依次取新 id（1 起，不超过新表建出时预留的上界），
+//     所以搬进来的旧消息在新表里仍按时间排在所有新消息之前
+//   - 进度记在 migration_state，中断后重跑从断点继续
+//   - 旧的大厅 / 私聊正文是带 "[时间] 谁 : " 之类前缀的显示行，搬时去掉前缀只留原文
+//   - 发送者或私聊对象已不在 users 里的行跳过并计数
+// 全部搬完记下 done；服务端下次启动时不再提示，历史环缓存恢复使用。
+// --drop-legacy 在搬完后删掉旧表与它们的全文索引。
+#include <sqlite3.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include "schema.hpp"
+
+struct Options {
+    std::string db = "chatserver.db";
+    int batch = 2000;
+    int pause_ms = 20;
+    bool drop_legacy = false;
+};
+Options g_opt;
+
+bool parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        auto eq = a.find('=');
+        std::string key = a.substr(0, eq), val = eq == std::string::npos ? "" : a.substr(eq + 1);
+        try {
+            if (key == "--db")
+                g_opt.db = val;
+            else if (key == "--batch")
+                g_opt.batch = std::max(1, std::stoi(val));
+            else if (key == "--pause-ms")
+                g_opt.pause_ms = std::max(0, std::stoi(val));
+            else if (key == "--drop-legacy")
+                g_opt.drop_legacy = val != "0";
+            else
+                throw std::invalid_argument(a);
+        } catch (std::exception const &) {
+            std::fprintf(stderr, "用法: migrate [--db=chatserver.db] [--batch=2000] [--pause-ms=20] [--drop-legacy]\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+// 一条 prepared statement；用完析构即 finalize
+class Stmt {
+  public:
+    Stmt(sqlite3 *db, char const *sql) {
+        if (sqlite3_prepare_v2(db, sql, -1, &st_, nullptr) != SQLITE_OK)
+            std::fprintf(stderr, "SQL error: %s\n", sqlite3_errmsg(db));
+    }
+    ~Stmt() { sqlite3_finalize(st_); }
+    Stmt(Stmt const &) = delete;
+    operator sqlite3_stmt *() const { return st_; }
+    int step() { return sqlite3_step(st_); }
+    void reset() {
+        sqlite3_reset(st_);
+        sqlite3_clear_bindings(st_);
+    }
+    std::string text(int i) const {
+        auto p = reinterpret_cast<char const *>(sqlite3_column_text(st_, i));
+        return p ? p : "";
+    }
+
+  private:
+    sqlite3_stmt *st_ = nullptr;
+};
+
+// 旧表的一行
+struct Legacy {
+    long long id, created_at;
+    bool group;
+    long long gid;
+    std::string sender, receiver, body;
+};
+
+// 去掉旧显示行的 "[时间] " 与发送者前缀；对不上就原样保留
+std::string strip_prefix(std::string const &body, Legacy const &r) {
+    auto close = body.find("] ");
+    if (body.empty() || body[0] != '[' || close == std::string::npos)
+        return body;
+    std::string rest = body.substr(close + 2);
+    std::string head = r.receiver == "all" ? r.sender + " : " : r.sender + " (私) 对 " + r.receiver + " 说: ";
+    return rest.compare(0, head.size(), head) == 0 ? rest.substr(head.size()) : body;
+}
+
+class Migrator {
+  public:
+    explicit Migrator(sqlite3 *db) : db_(db) {}
+
+    long long state(char const *key, long long dflt = 0) {
+        Stmt st(db_, "SELECT value FROM migration_state WHERE key = ?;");
+        sqlite3_bind_text(st, 1, key, -1, SQLITE_STATIC);
+        return st.step() == SQLITE_ROW ? sqlite3_column_int64(st, 0) : dflt;
+    }
+    void set_state(char const *key, long long v) {
+        Stmt st(db_, "INSERT OR REPLACE INTO migration_state(key, value) VALUES(?, ?);");
+        sqlite3_bind_text(st, 1, key, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(st, 2, v);
+        st.step();
+    }
+
+    // 搬一批；返回搬了（含跳过）多少行，出错返回 -1
+    long long batch() {
+        long long msg_pos = state("msg_pos"), grp_pos = state("grp_pos"), next_id = state("next_id", 1);
+        long long reserved = state("reserved");
+        auto msgs = read(false, msg_pos), grps = read(true, grp_pos);
+        size_t i = 0, j = 0;
+        long long moved = 0;
+        // 两路都按 id 有序；每路最多读了 batch 行、总共只取 batch 行，所以不会越过没读到的行
+        while (moved < g_opt.batch && (i < msgs.size() || j < grps.size())) {
+            bool take_msg = j == grps.size() || (i < msgs.size() && msgs[i].created_at <= grps[j].created_at);
+            Legacy &r = take_msg ? msgs[i++] : grps[j++];
+            (take_msg ? msg_pos : grp_pos) = r.id;
+            ++moved;
+            long long from = user_id(r.sender), conv = 0;
+            if (from && r.group)
+                conv = conversation(schema::Group, 0, 0, r.gid);
+            else if (from && r.receiver == "all")
+                conv = schema::LOBBY_CONV;
+            else if (long long to = from ? user_id(r.receiver) : 0)
+                conv = conversation(schema::Dm, std::min(from, to), std::max(from, to), 0);
+            if (!from || !conv) {
+                ++skipped_;
+                continue;
+            }
+            if (next_id > reserved) {
+                std::fprintf(stderr, "旧消息比预留的 id 多（%lld）：新表不是由本工具或新版服务端建出的？\n", reserved);
+                return -1;
+            }
+            insert_.reset();
+            sqlite3_bind_int64(insert_, 1, next_id++);
+            sqlite3_bind_int64(insert_, 2, conv);
+            sqlite3_bind_int64(insert_, 3, from);
+            std::string body = r.group ? r.body : strip_prefix(r.body, r);
+            sqlite3_bind_text(insert_, 4, body.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int64(insert_, 5, r.created_at);
+            if (insert_.step() != SQLITE_DONE) {
+                std::fprintf(stderr, "写入失败: %s\n", sqlite3_errmsg(db_));
+                return -1;
+            }
+        }
+        set_state("msg_pos", msg_pos);
+        set_state("grp_pos", grp_pos);
+        set_state("next_id", next_id);
+        set_state("skipped", state("skipped") + skipped_);
+        skipped_ = 0;
+        return moved;
+    }
+
+  private:
+    std::vector<Legacy> read(bool group, long long after) {
+        std::vector<Legacy> out;
+        if (!schema::can_select(db_, group ? "group_messages" : "messages", "id"))
+            return out;
+        Stmt st(db_, group ? "SELECT id, IFNULL(CAST(strftime('%s', timestamp) AS INTEGER), 0), group_id, sender, '',"
+                             " message FROM group_messages WHERE id > ? ORDER BY id LIMIT ?;"
+                           : "SELECT id, IFNULL(CAST(strftime('%s', timestamp) AS INTEGER), 0), 0, sender, receiver,"
+                             " message FROM messages WHERE id > ? ORDER BY id LIMIT ?;");
+        sqlite3_bind_int64(st, 1, after);
+        sqlite3_bind_int(st, 2, g_opt.batch);
+        while (st.step() == SQLITE_ROW)
+            out.push_back({sqlite3_column_int64(st, 0), sqlite3_column_int64(st, 1), group, sqlite3_column_int64(st, 2),
+                           st.text(3), st.text(4), st.text(5)});
+        return out;
+    }
+    long long user_id(std::string const &name) {
+        auto it = users_.find(name);
+        if (it != users_.end())
+            return it->second;
+        Stmt st(db_, "SELECT id FROM users WHERE username = ?;");
+        sqlite3_bind_text(st, 1, name.c_str(), -1, SQLITE_STATIC);
+        return users_[name] = st.step() == SQLITE_ROW ? sqlite3_column_int64(st, 0) : 0;
+    }
+    long long conversation(schema::ConvKind kind, long long a, long long b, long long gid) {
+        auto key = std::make_tuple(int(kind), a, b, gid);
+        auto it = convs_.find(key);
+        if (it != convs_.end())
+            return it->second;
+        Stmt ins(db_, "INSERT OR IGNORE INTO conversations(kind,user_a,user_b,group_id) VALUES(?,?,?,?);");
+        Stmt sel(db_, "SELECT id FROM conversations WHERE kind=? AND user_a=? AND user_b=? AND group_id=?;");
+        for (sqlite3_stmt *st : {(sqlite3_stmt *)ins, (sqlite3_stmt *)sel}) {
+            sqlite3_bind_int(st, 1, kind);
+            sqlite3_bind_int64(st, 2, a);
+            sqlite3_bind_int64(st, 3, b);
+            sqlite3_bind_int64(st, 4, gid);
+        }
+        ins.step();
+        return convs_[key] = sel.step() == SQLITE_ROW ? sqlite3_column_int64(sel, 0) : 0;
+    }
+
+    sqlite3 *db_;
+    Stmt insert_{db_, "INSERT INTO chat_messages(id,conversation_id,sender_id,body,created_at) VALUES(?,?,?,?,?);"};
+    std::map<std::string, long long> users_; // 账号不会删除，缓存整个迁移期间有效
+    std::map<std::tuple<int, long long, long long, long long>, long long> convs_;
+    long long skipped_ = 0;
+};
+
+int main(int argc, char **argv) {
+    if (!parse_args(argc, argv))
+        return 1;
+    sqlite3 *db = nullptr;
+    if (sqlite3_open_v2(g_opt.db.c_str(), &db, SQLITE_OPEN_READWRITE, nullptr) != SQLITE_OK) {
+        std::fprintf(stderr, "无法打开数据库 %s\n", g_opt.db.c_str());
+        return 1;
+    }
+    schema::exec(db, "PRAGMA busy_timeout=5000;");
+    schema::exec(db, "PRAGMA journal_mode=WAL;");
+
+    // 服务端没用新版启动过也能迁：建表与预留 id 同 db_init
+    if (!schema::exec(db, "BEGIN IMMEDIATE;") || !schema::ensure_users(db) || !schema::ensure_messages(db) ||
+        !schema::exec(db, "COMMIT;"))
+        return 1;
+    if (!schema::legacy_pending(db)) {
+        std::printf("没有需要迁移的旧消息\n");
+    } else {
+        Migrator m(db);
+        long long reserved = m.state("reserved"), total = 0;
+        auto t0 = std::chrono::steady_clock::now();
+        for (;;) {
+            if (!schema::exec(db, "BEGIN IMMEDIATE;"))
+                return 1;
+            long long n = m.batch();
+            if (n < 0) {
+                schema::exec(db, "ROLLBACK;");
+                return 1;
+            }
+            if (n == 0)
+                m.set_state("done", 1);
+            if (!schema::exec(db, "COMMIT;"))
+                return 1;
+            if (n == 0)
+                break;
+            total += n;
+            double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+            std::printf("\r已搬 %lld 行（新 id 到 %lld / %lld），%.0f 行/秒", total, m.state("next_id") - 1, reserved,
+                        total / std::max(secs, 1e-3));
+            std::fflush(stdout);
+            std::this_thread::sleep_for(std::chrono::milliseconds(g_opt.pause_ms));
+        }
+        std::printf("\n迁移完成，跳过 %lld 行（发送者或私聊对象已不存在）\n", m.state("skipped"));
+    }
+    if (g_opt.drop_legacy && !schema::legacy_pending(db)) {
+        std::printf("删除旧表...\n");
+        bool ok = schema::exec(db, "BEGIN IMMEDIATE;");
+        for (char const *t : {"messages_fts", "group_messages_fts", "messages", "group_messages"})
+            ok = ok && schema::exec(db, std::string("DROP TABLE IF EXISTS ") + t + ";");
+        if (!ok || !schema::exec(db, "COMMIT;"))
+            return 1;
+    }
+    sqlite3_close(db);
+    return 0;
+}
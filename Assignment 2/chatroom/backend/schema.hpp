@@ -0,0 +1,179 @@
+// schema.hpp – 账号与消息表的结构（chatserver 的 db_init 与迁移工具 migrate 共用）
+// 消息按“会话”归档：大厅是 1 号会话，每对私聊、每个群各一个会话。
+//   - chat_messages 只存原文、发送者 id 与 unix 秒，显示用的 "[时间] 谁 : 内容" 读出时再拼
+//   - (conversation_id, id) 索引让任何一页历史都是一次索引区间读，与总行数无关
+//   - 旧库的 messages / group_messages 不再写入，由 migrate 分批搬进来；
+//     新表第一次建出来时把自增序号抬到两张旧表的 id 之和之上，
+//     搬进来的旧消息取其下的 id，始终排在新消息之前
+// 所有函数都可以重复调用；须在同一个 BEGIN IMMEDIATE 事务里执行（集群的多个节点会同时启动）。
+#pragma once
+
+#include <cstdio>
+#include <string>
+
+#include <sqlite3.h>
+
+namespace schema {
+
+enum ConvKind { Lobby = 0, Dm = 1, Group = 2 };
+constexpr long long LOBBY_CONV = 1;
+
+inline bool exec(sqlite3 *db, std::string const &sql) {
+    char *err = nullptr;
+    if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &err) != SQLITE_OK) {
+        std::fprintf(stderr, "SQL error: %s\n", err);
+        sqlite3_free(err);
+        return false;
+    }
+    return true;
+}
+// 能否从 table 里选出 expr（列不存在、表不存在都算否）
+inline bool can_select(sqlite3 *db, std::string const &table, std::string const &expr) {
+    sqlite3_stmt *probe = nullptr;
+    bool ok = sqlite3_prepare_v2(db, ("SELECT " + expr + " FROM " + table + " LIMIT 0;").c_str(), -1, &probe,
+                                 nullptr) == SQLITE_OK;
+    sqlite3_finalize(probe);
+    return ok;
+}
+
+// 账号表带整数主键；旧库以 username 为主键，原样重建一次，id 沿用原来的 rowid
+inline bool ensure_users(sqlite3 *db) {
+    bool ok = exec(db, "CREATE TABLE IF NOT EXISTS users ("
+                       " id       INTEGER PRIMARY KEY,"
+                       " username TEXT NOT NULL UNIQUE,"
+                       " salt     BLOB NOT NULL,"    // 16 bytes
+                       " hash     BLOB NOT NULL,"    // 32 bytes
+                       " iter     INTEGER NOT NULL DEFAULT 0);"); // PBKDF2 迭代次数，0 = 旧版 SHA-256
+    // 更旧的库没有 iter 列：补上，已有账号按旧算法校验
+    if (ok && !can_select(db, "users", "iter"))
+        ok = exec(db, "ALTER TABLE users ADD COLUMN iter INTEGER NOT NULL DEFAULT 0;");
+    if (ok && !can_select(db, "users", "id")) {
+        std::printf("升级 users 表：加整数 id\n");
+        ok = exec(db, "CREATE TABLE users_v2 ("
+                      " id       INTEGER PRIMARY KEY,"
+                      " username TEXT NOT NULL UNIQUE,"
+                      " salt     BLOB NOT NULL,"
+                      " hash     BLOB NOT NULL,"
+                      " iter     INTEGER NOT NULL DEFAULT 0);") &&
+             exec(db, "INSERT INTO users_v2(id,username,salt,hash,iter)"
+                      " SELECT rowid,username,salt,hash,iter FROM users ORDER BY rowid;") &&
+             exec(db, "DROP TABLE users;") && exec(db, "ALTER TABLE users_v2 RENAME TO users;");
+    }
+    return ok;
+}
+
+// 全文索引 conv 列里的会话标记：会话 id 按 6400 进制拆成 3 个私用区字符（U+E000 起），
+// trigram 分词后恰好是一个词、每个会话各不相同，正文里也不会出现。
+// 搜索时在 MATCH 里写 conv:("标记" OR ...)，FTS 只走这些会话的命中。SQL 与 C++ 两种写法须一致
+inline std::string conv_token_sql(std::string const &col) {
+    return "char(57344 + " + col + " / 40960000 % 6400, 57344 + " + col + " / 6400 % 6400, 57344 + " + col +
+           " % 6400)";
+}
+inline std::string conv_token(long long conv) {
+    std::string s;
+    for (long long d : {conv / 40960000 % 6400, conv / 6400 % 6400, conv % 6400}) {
+        unsigned cp = 0xe000 + unsigned(d); // 私用区都是 3 字节 UTF-8
+        s += char(0xe0 | cp >> 12);
+        s += char(0x80 | (cp >> 6 & 0x3f));
+        s += char(0x80 | (cp & 0x3f));
+    }
+    return s;
+}
+
+inline bool ensure_messages(sqlite3 *db) {
+    bool fresh = !can_select(db, "chat_messages", "id");
+    bool ok = exec(db, "CREATE TABLE IF NOT EXISTS conversations ("
+                       " id       INTEGER PRIMARY KEY,"
+                       " kind     INTEGER NOT NULL,"           // ConvKind
+                       " user_a   INTEGER NOT NULL DEFAULT 0," // 私聊双方的 users.id，user_a <= user_b
+                       " user_b   INTEGER NOT NULL DEFAULT 0,"
+                       " group_id INTEGER NOT NULL DEFAULT 0," // 群会话的 groups.id
+                       " UNIQUE(kind,user_a,user_b,group_id));") &&
+              // 唯一约束的索引按 user_a 查私聊；这个按 user_b 查，带上 user_a 使之覆盖
+              exec(db, "CREATE INDEX IF NOT EXISTS idx_conv_user_b ON conversations(kind,user_b,user_a);") &&
+              exec(db, "INSERT OR IGNORE INTO conversations(id,kind) VALUES(1,0);") &&
+              exec(db, "CREATE TABLE IF NOT EXISTS chat_messages ("
+                       " id              INTEGER PRIMARY KEY AUTOINCREMENT,"
+                       " conversation_id INTEGER NOT NULL REFERENCES conversations(id),"
+                       " sender_id       INTEGER NOT NULL REFERENCES users(id),"
+                       " body            TEXT NOT NULL," // 用户输入的原文
+                       " created_at      INTEGER NOT NULL);") && // unix 秒
+              exec(db, "CREATE INDEX IF NOT EXISTS idx_chat_conv_id ON chat_messages(conversation_id,id);");
+    if (!ok)
+        return false;
+
+    // 全文索引（FTS5 外部内容表，正文不重复存储）：trigram 分词，中英文任意 ≥3 个字的子串都能命中，
+    // 不需要分词词典；另有 conv 列放会话标记（见 conv_token），内容取自视图 chat_messages_fts_src。
+    // 触发器随插入 / 删除维护，迁移搬进来的旧消息同样经过触发器。
+    // 旧版索引没有 conv 列：连同触发器删掉、按新结构整表重建一次（百万行十几秒）
+    bool rebuild = can_select(db, "chat_messages_fts", "rowid") && !can_select(db, "chat_messages_fts", "conv");
+    if (rebuild) {
+        std::fprintf(stderr, "全文索引升级：加会话列，重建中…\n");
+        ok = exec(db, "DROP TRIGGER IF EXISTS chat_messages_fts_ai;") &&
+             exec(db, "DROP TRIGGER IF EXISTS chat_messages_fts_ad;") &&
+             exec(db, "DROP TRIGGER IF EXISTS chat_messages_fts_au;") && exec(db, "DROP TABLE chat_messages_fts;");
+    }
+    auto tok = [](char const *row) { return conv_token_sql(std::string(row) + ".conversation_id"); };
+    ok = ok &&
+         exec(db, "CREATE VIEW IF NOT EXISTS chat_messages_fts_src AS SELECT id, body, " +
+                      conv_token_sql("conversation_id") + " AS conv FROM chat_messages;") &&
+         exec(db, "CREATE VIRTUAL TABLE IF NOT EXISTS chat_messages_fts USING fts5("
+                  " body, conv, content='chat_messages_fts_src', content_rowid='id', tokenize='trigram');") &&
+         exec(db, "CREATE TRIGGER IF NOT EXISTS chat_messages_fts_ai AFTER INSERT ON chat_messages BEGIN"
+                  " INSERT INTO chat_messages_fts(rowid, body, conv) VALUES (new.id, new.body, " + tok("new") +
+                      "); END;") &&
+         exec(db, "CREATE TRIGGER IF NOT EXISTS chat_messages_fts_ad AFTER DELETE ON chat_messages BEGIN"
+                  " INSERT INTO chat_messages_fts(chat_messages_fts, rowid, body, conv) VALUES ('delete', old.id,"
+                  " old.body, " + tok("old") + "); END;") &&
+         exec(db, "CREATE TRIGGER IF NOT EXISTS chat_messages_fts_au AFTER UPDATE OF body, conversation_id"
+                  " ON chat_messages BEGIN"
+                  " INSERT INTO chat_messages_fts(chat_messages_fts, rowid, body, conv) VALUES ('delete', old.id,"
+                  " old.body, " + tok("old") + ");"
+                  " INSERT INTO chat_messages_fts(rowid, body, conv) VALUES (new.id, new.body, " + tok("new") +
+                      "); END;");
+    if (ok && rebuild)
+        ok = exec(db, "INSERT INTO chat_messages_fts(chat_messages_fts) VALUES ('rebuild');");
+    if (!ok || !fresh)
+        return ok;
+
+    // 新表刚建出来而旧表还在：给旧消息留出 id
+    std::string reserve = "0";
+    for (char const *t : {"messages", "group_messages"})
+        if (can_select(db, t, "id"))
+            reserve += std::string(" + IFNULL((SELECT MAX(id) FROM ") + t + "), 0)";
+    if (reserve == "0")
+        return true;
+    return exec(db, "CREATE TABLE IF NOT EXISTS migration_state (key TEXT PRIMARY KEY, value INTEGER);") &&
+           exec(db, "INSERT INTO sqlite_sequence(name, seq) VALUES('chat_messages', " + reserve + ");") &&
+           exec(db, "INSERT OR REPLACE INTO migration_state(key, value) VALUES('reserved', " + reserve + ");");
+}
+
+// 消息日志（--storage=log）的提交水位：写线程在每个事务里记下日志已 append 的最大 id，
+// 与同一事务里新建的会话一起提交。进程在事务提交前崩溃时，日志里超过水位的记录没有对应的提交，
+// 启动时截掉（LogStore::truncate_after）；否则回滚掉的会话 id 被重用后会读到它们
+inline bool ensure_store_state(sqlite3 *db) {
+    return exec(db, "CREATE TABLE IF NOT EXISTS store_state (key TEXT PRIMARY KEY, value INTEGER);");
+}
+// 没记过（日志还没写过，或库早于水位）返回 -1
+inline long long log_committed(sqlite3 *db) {
+    sqlite3_stmt *st = nullptr;
+    sqlite3_prepare_v2(db, "SELECT value FROM store_state WHERE key = 'log_committed';", -1, &st, nullptr);
+    long long v = sqlite3_step(st) == SQLITE_ROW ? sqlite3_column_int64(st, 0) : -1;
+    sqlite3_finalize(st);
+    return v;
+}
+
+// 旧消息表还有没搬完的：库里有旧表且 migrate 没有记下完成
+inline bool legacy_pending(sqlite3 *db) {
+    if (!can_select(db, "messages", "id") && !can_select(db, "group_messages", "id"))
+        return false;
+    if (!can_select(db, "migration_state", "value"))
+        return true;
+    sqlite3_stmt *st = nullptr;
+    sqlite3_prepare_v2(db, "SELECT 1 FROM migration_state WHERE key = 'done';", -1, &st, nullptr);
+    bool done = sqlite3_step(st) == SQLITE_ROW;
+    sqlite3_finalize(st);
+    return !done;
+}
+
+} // namespace schema
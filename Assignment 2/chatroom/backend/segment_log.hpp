@@ -0,0 +1,470 @@
+// segment_log.hpp – 按会话分目录、只追加的分段消息日志（--storage=log）
+// 目录结构：<dir>/<会话 id>/<段内第一条的 id，20 位补零>.seg
+//   - 记录：u32 长度 | u32 校验 | i64 id | i64 时间 | u16 发送者长度 | 发送者 | 正文 | u32 长度
+//     尾部再放一次长度，翻历史时从某个位置往前一条条倒着读
+//   - 段写满 segment_bytes 换下一段。新段先 ftruncate 到满长（稀疏文件，不占盘）并整段 mmap，
+//     写用 pwrite，读直接在映射上解码；写满的段截到实际长度后重新映射
+//   - 每段一个稀疏 id 索引：每隔 INDEX_STRIDE 字节记一条 (id, 偏移)，
+//     按 before_id 定位时二分索引，再顺扫不超过一个间隔
+//   - 启动时只扫描每个会话的最后一段（找写入位置与最大 id），更早的段第一次被读到时才映射、建索引
+//   - 同时打开（fd + 映射）的段不超过 max_open 个，按 LRU 换出；换出只关文件、解映射，
+//     索引与结尾留在内存里，再读到时重新打开映射即可。写过还没 sync 的段不换出
+//   - 进程崩溃后最后一段的尾部可能是半条记录：长度、校验、id 递增任一不符就当作结尾，之后从那里接着写
+//   - append 只 pwrite 进页缓存，sync() 才 fsync 写过的段与新建段所在的目录
+//   - 跟着写线程的 SQLite 事务走：begin 之后写的记录只推进写入位置（wend），commit 才推进读者看到的 end；
+//     rollback 把写过的区间清零、id 退回去。进程在提交前崩溃留下的记录由 truncate_after 按提交水位截掉
+// 目录由单个进程独占：集群模式请用 SQLite。
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "storage.hpp"
+
+namespace seglog {
+
+constexpr size_t HEADER = 8, TRAILER = 4;   // u32 长度 + u32 校验；u32 长度
+constexpr size_t FIXED = 8 + 8 + 2;         // id + 时间 + 发送者长度
+constexpr size_t INDEX_STRIDE = 4096;       // 稀疏索引的间隔（字节）
+
+// FNV-1a：只用来识别写了一半的尾部记录
+inline uint32_t checksum(char const *p, size_t n) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; ++i)
+        h = (h ^ uint8_t(p[i])) * 16777619u;
+    return h;
+}
+template <class T>
+T load_le(char const *p) {
+    T v;
+    std::memcpy(&v, p, sizeof v); // 按本机字节序：日志不跨机器搬
+    return v;
+}
+
+struct Segment {
+    long long first_id = 0;
+    std::string path;
+    int fd = -1;
+    char *map = nullptr;
+    size_t cap = 0;       // 文件长度，打开时整段映射
+    size_t end = 0;       // 有效记录的结尾
+    long long last_id = 0;
+    size_t wend = 0;        // 写线程的写入位置，事务没提交时超过 end（只在写线程上推进）
+    long long wlast_id = 0; // wend 之前最后一条的 id
+    bool loaded = false;  // 已扫描：end、last_id、index 可用
+    bool sealed = false;  // 已写满并截断，不再追加
+    bool dirty = false;   // 上次 sync 之后写过，不换出
+    std::vector<std::pair<long long, size_t>> index; // (id, 偏移)，id 递增
+    std::list<Segment *>::iterator lru; // fd >= 0 时在 LogStore::open_ 里的位置
+
+    ~Segment() { close(); }
+    void close() {
+        if (map)
+            munmap(map, cap);
+        if (fd >= 0)
+            ::close(fd);
+        map = nullptr;
+        fd = -1;
+    }
+    // 解码 off 处的记录；调用方保证 off 是记录起点且在 end 之内
+    StoredMsg decode(size_t off) const {
+        char const *p = map + off + HEADER;
+        uint32_t len = load_le<uint32_t>(map + off);
+        uint16_t slen = load_le<uint16_t>(p + 16);
+        return {load_le<int64_t>(p), std::string(p + FIXED, slen),
+                std::string(p + FIXED + slen, len - FIXED - slen), std::time_t(load_le<int64_t>(p + 8))};
+    }
+    long long id_at(size_t off) const { return load_le<int64_t>(map + off + HEADER); }
+    size_t size_at(size_t off) const { return HEADER + load_le<uint32_t>(map + off) + TRAILER; }
+};
+
+class LogStore : public MessageStore {
+  public:
+    LogStore(std::string dir, size_t segment_bytes, size_t max_open = 256)
+        : dir_(std::move(dir)), segment_bytes_(segment_bytes), max_open_(std::max<size_t>(1, max_open)) {}
+
+    // 扫描目录；失败时 err 给出原因
+    bool open(std::string &err) {
+        namespace fs = std::filesystem;
+        std::error_code ec;
+        fs::create_directories(dir_, ec);
+        if (ec) {
+            err = dir_ + ": " + ec.message();
+            return false;
+        }
+        for (auto const &d : fs::directory_iterator(dir_, ec)) {
+            long long conv = std::atoll(d.path().filename().c_str());
+            if (!d.is_directory() || conv <= 0)
+                continue;
+            auto &segs = convs_[conv];
+            for (auto const &f : fs::directory_iterator(d.path())) {
+                if (f.path().extension() != ".seg")
+                    continue;
+                auto s = std::make_unique<Segment>();
+                s->first_id = std::atoll(f.path().stem().c_str());
+                s->path = f.path().string();
+                s->sealed = true;
+                segs.push_back(std::move(s));
+            }
+            std::sort(segs.begin(), segs.end(), [](auto &a, auto &b) { return a->first_id < b->first_id; });
+            if (segs.empty())
+                continue;
+            // 只有最后一段可能还在写
+            Segment &tail = *segs.back();
+            tail.sealed = false;
+            if (!acquire(tail)) {
+                err = tail.path + ": " + std::strerror(errno);
+                return false;
+            }
+            next_id_ = std::max({next_id_, tail.last_id + 1, tail.first_id});
+        }
+        if (ec) {
+            err = dir_ + ": " + ec.message();
+            return false;
+        }
+        return true;
+    }
+
+    long long append(long long conv, long long, std::string const &sender, std::string const &body,
+                     std::time_t t) override {
+        long long id = next_id_;
+        uint16_t slen = uint16_t(std::min<size_t>(sender.size(), UINT16_MAX));
+        uint32_t len = uint32_t(FIXED + slen + body.size());
+        size_t need = HEADER + len + TRAILER;
+        buf_.resize(need);
+        char *p = buf_.data();
+        int64_t id64 = id, t64 = t;
+        std::memcpy(p + HEADER, &id64, 8);
+        std::memcpy(p + HEADER + 8, &t64, 8);
+        std::memcpy(p + HEADER + 16, &slen, 2);
+        std::memcpy(p + HEADER + FIXED, sender.data(), slen);
+        std::memcpy(p + HEADER + FIXED + slen, body.data(), body.size());
+        uint32_t sum = checksum(p + HEADER, len);
+        std::memcpy(p, &len, 4);
+        std::memcpy(p + 4, &sum, 4);
+        std::memcpy(p + HEADER + len, &len, 4);
+
+        Segment *tail = writable_tail(conv, id, need);
+        if (!tail)
+            return 0;
+        // 写在 end 之后，读者看不到；写完再在锁内推进 wend，不在事务里就连 end 一起推进
+        // writable_tail 已把它标成 dirty，fd 不会被读线程换出
+        if (::pwrite(tail->fd, p, need, off_t(tail->wend)) != ssize_t(need)) {
+            std::fprintf(stderr, "写消息日志失败 %s: %s\n", tail->path.c_str(), std::strerror(errno));
+            return 0;
+        }
+        std::lock_guard<std::mutex> lk(mu_);
+        // 索引里可能有还没提交的条目：page 只对 before <= last_id 的段查索引，用不到它们
+        if (tail->index.empty() || tail->wend >= tail->index.back().second + INDEX_STRIDE)
+            tail->index.emplace_back(id, tail->wend);
+        tail->wend += need;
+        tail->wlast_id = id;
+        if (!in_txn_) {
+            tail->end = tail->wend;
+            tail->last_id = id;
+        } else if (std::find(touched_.begin(), touched_.end(), std::make_pair(conv, tail)) == touched_.end())
+            touched_.emplace_back(conv, tail);
+        ++next_id_;
+        return id;
+    }
+
+    void begin() override {
+        in_txn_ = true;
+        txn_next_id_ = next_id_;
+    }
+    void commit() override {
+        std::lock_guard<std::mutex> lk(mu_);
+        for (auto [conv, g] : touched_) {
+            g->end = g->wend;
+            g->last_id = g->wlast_id;
+        }
+        touched_.clear();
+        in_txn_ = false;
+    }
+    // 读者从没看到过这些记录。本事务新开的段整个删掉（id 退回去后文件名不再是段内第一条），
+    // 其余的把写过的区间清零，下次启动扫描时不会当成有效记录
+    void rollback() override {
+        std::lock_guard<std::mutex> lk(mu_);
+        for (auto [conv, g] : touched_) {
+            auto &segs = convs_[conv];
+            if (g->first_id >= txn_next_id_) {
+                dirty_.erase(std::remove(dirty_.begin(), dirty_.end(), g), dirty_.end());
+                drop(segs, g);
+                continue;
+            }
+            if (acquire(*g)) // 提交前的 sync 可能已让它被换出
+                zero(*g, g->end, g->wend);
+            g->wend = g->end;
+            g->wlast_id = g->last_id;
+            while (!g->index.empty() && g->index.back().first > g->last_id)
+                g->index.pop_back();
+        }
+        for (auto [conv, g] : touched_) // 被本事务封上的段重新成为写入段
+            if (auto &segs = convs_[conv]; !segs.empty())
+                segs.back()->sealed = false;
+        touched_.clear();
+        next_id_ = txn_next_id_;
+        in_txn_ = false;
+    }
+    long long high_water() const override { return next_id_ - 1; }
+
+    // 启动时、open 之后调用：丢掉 id > hw 的记录（上次进程崩溃时没提交的事务），下一条从 hw + 1 起。
+    // 返回截掉记录的会话数
+    size_t truncate_after(long long hw) {
+        size_t convs = 0;
+        for (auto &kv : convs_) {
+            auto &segs = kv.second;
+            bool cut = false;
+            while (!segs.empty() && segs.back()->first_id > hw) {
+                drop(segs, segs.back().get());
+                cut = true;
+            }
+            if (!segs.empty() && acquire(*segs.back()) && segs.back()->last_id > hw) {
+                Segment &g = *segs.back();
+                zero(g, locate(g, hw + 1), g.end);
+                g.index.clear();
+                scan(g);
+                cut = true;
+            }
+            convs += cut;
+        }
+        next_id_ = hw + 1;
+        return convs;
+    }
+
+    void page(long long conv, long long before, size_t limit, std::vector<StoredMsg> &out) override {
+        std::lock_guard<std::mutex> lk(mu_);
+        auto it = convs_.find(conv);
+        if (it == convs_.end())
+            return;
+        auto &segs = it->second;
+        // 从 first_id < before 的最后一段开始往前
+        auto k = std::lower_bound(segs.begin(), segs.end(), before,
+                                  [](auto const &s, long long b) { return s->first_id < b; }) -
+                 segs.begin();
+        size_t got = 0;
+        for (auto s = k - 1; s >= 0 && got < limit; --s) {
+            Segment &g = *segs[size_t(s)];
+            if (!acquire(g))
+                continue;
+            size_t pos = before > g.last_id ? g.end : locate(g, before);
+            for (; pos > 0 && got < limit; ++got) {
+                size_t start = pos - TRAILER - load_le<uint32_t>(g.map + pos - TRAILER) - HEADER;
+                out.push_back(g.decode(start));
+                pos = start;
+            }
+        }
+    }
+
+    void sync() override {
+        if (dirty_.empty() && new_dirs_.empty())
+            return;
+        // dirty 段不会被换出，解锁 fsync 时 fd 仍然有效
+        for (Segment *g : dirty_)
+            ::fsync(g->fd);
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            for (Segment *g : dirty_)
+                g->dirty = false;
+            evict(nullptr);
+        }
+        dirty_.clear();
+        for (auto const &dir : new_dirs_) // 新段的目录项
+            if (int fd = ::open(dir.c_str(), O_RDONLY); fd >= 0) {
+                ::fsync(fd);
+                ::close(fd);
+            }
+        new_dirs_.clear();
+    }
+
+  private:
+    // 第一条 id >= before 的记录的偏移：二分稀疏索引，再顺扫
+    static size_t locate(Segment const &g, long long before) {
+        auto it = std::lower_bound(g.index.begin(), g.index.end(), before,
+                                   [](auto const &e, long long b) { return e.first < b; });
+        size_t off = it == g.index.begin() ? 0 : std::prev(it)->second;
+        while (off < g.end && g.id_at(off) < before)
+            off += g.size_at(off);
+        return off;
+    }
+
+    // 确保 g 已打开、映射并扫描过，放到 LRU 最前，超出 max_open 的换出。
+    // 调用方持有 mu_（open 时尚无并发）
+    bool acquire(Segment &g) {
+        if (g.fd >= 0) {
+            open_.splice(open_.begin(), open_, g.lru);
+            return true;
+        }
+        g.fd = ::open(g.path.c_str(), O_RDWR);
+        struct stat st {};
+        if (g.fd < 0 || fstat(g.fd, &st) != 0) {
+            g.close();
+            return false;
+        }
+        g.cap = size_t(st.st_size);
+        if (g.cap) {
+            void *m = mmap(nullptr, g.cap, PROT_READ, MAP_SHARED, g.fd, 0);
+            if (m == MAP_FAILED) {
+                g.close();
+                return false;
+            }
+            g.map = static_cast<char *>(m);
+        }
+        open_.push_front(&g);
+        g.lru = open_.begin();
+        if (!g.loaded)
+            scan(g);
+        evict(&g);
+        return true;
+    }
+    // 从 LRU 尾部关掉多出来的段，跳过 keep 与 dirty 段；调用方持有 mu_
+    void evict(Segment const *keep) {
+        for (auto it = open_.end(); open_.size() > max_open_ && it != open_.begin();) {
+            Segment *g = *--it;
+            if (g == keep || g->dirty)
+                continue;
+            it = open_.erase(it);
+            g->close();
+        }
+    }
+    // 建稀疏索引，找出有效记录的结尾
+    static void scan(Segment &g) {
+        size_t off = 0;
+        long long prev = 0;
+        while (off + HEADER + FIXED + TRAILER <= g.cap) {
+            uint32_t len = load_le<uint32_t>(g.map + off);
+            size_t size = HEADER + size_t(len) + TRAILER;
+            if (len < FIXED || off + size > g.cap || load_le<uint32_t>(g.map + off + HEADER + len) != len ||
+                checksum(g.map + off + HEADER, len) != load_le<uint32_t>(g.map + off + 4) ||
+                load_le<uint16_t>(g.map + off + HEADER + 16) > len - FIXED || g.id_at(off) <= prev)
+                break;
+            prev = g.id_at(off);
+            if (g.index.empty() || off >= g.index.back().second + INDEX_STRIDE)
+                g.index.emplace_back(prev, off);
+            off += size;
+        }
+        g.end = g.wend = off;
+        g.last_id = g.wlast_id = prev;
+        g.loaded = true;
+    }
+
+    // 会话的当前写入段，装不下 need 字节就封上它、新开一段；返回的段已打开并标成 dirty
+    // （只在写线程上调用）
+    Segment *writable_tail(long long conv, long long id, size_t need) {
+        std::lock_guard<std::mutex> lk(mu_);
+        auto &segs = convs_[conv];
+        Segment *tail = segs.empty() ? nullptr : segs.back().get();
+        if (tail && !acquire(*tail)) {
+            std::fprintf(stderr, "无法打开消息日志段 %s: %s\n", tail->path.c_str(), std::strerror(errno));
+            return nullptr;
+        }
+        if (tail && tail->wend + need <= tail->cap)
+            return mark_dirty(tail);
+        if (tail)
+            seal(*tail);
+        auto s = std::make_unique<Segment>();
+        char name[32];
+        std::snprintf(name, sizeof name, "%020lld.seg", id);
+        std::string dir = dir_ + "/" + std::to_string(conv);
+        std::error_code ec;
+        if (std::filesystem::create_directories(dir, ec))
+            new_dirs_.insert(dir_); // 新会话目录本身的目录项
+        s->first_id = id;
+        s->path = dir + "/" + name;
+        s->cap = std::max(segment_bytes_, need);
+        s->fd = ::open(s->path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        void *m = MAP_FAILED;
+        if (s->fd >= 0 && ::ftruncate(s->fd, off_t(s->cap)) == 0)
+            m = mmap(nullptr, s->cap, PROT_READ, MAP_SHARED, s->fd, 0);
+        if (m == MAP_FAILED) {
+            std::fprintf(stderr, "无法新建消息日志段 %s: %s\n", s->path.c_str(), std::strerror(errno));
+            return nullptr;
+        }
+        s->map = static_cast<char *>(m);
+        s->loaded = true;
+        open_.push_front(s.get());
+        s->lru = open_.begin();
+        new_dirs_.insert(dir);
+        segs.push_back(std::move(s));
+        mark_dirty(segs.back().get());
+        evict(segs.back().get());
+        return segs.back().get();
+    }
+    Segment *mark_dirty(Segment *g) {
+        if (!g->dirty) {
+            g->dirty = true;
+            dirty_.push_back(g);
+        }
+        return g;
+    }
+    // 截掉预留的空洞，按写入位置重新映射；调用方持有 mu_
+    static void seal(Segment &g) {
+        if (g.sealed || !g.loaded)
+            return;
+        g.sealed = true;
+        if (g.wend == g.cap || ::ftruncate(g.fd, off_t(g.wend)) != 0)
+            return;
+        munmap(g.map, g.cap);
+        g.map = nullptr;
+        g.cap = g.wend;
+        if (g.cap) {
+            void *m = mmap(nullptr, g.cap, PROT_READ, MAP_SHARED, g.fd, 0);
+            g.map = m == MAP_FAILED ? nullptr : static_cast<char *>(m);
+            if (!g.map)
+                g.cap = g.end = g.wend = 0;
+        }
+    }
+    // 关闭并删除 segs 里的 g；调用方持有 mu_
+    void drop(std::vector<std::unique_ptr<Segment>> &segs, Segment *g) {
+        if (g->fd >= 0)
+            open_.erase(g->lru);
+        g->close();
+        ::unlink(g->path.c_str());
+        segs.erase(std::find_if(segs.begin(), segs.end(), [g](auto const &p) { return p.get() == g; }));
+    }
+    // 把 [from, to) 写成 0：扫描遇到长度为 0 的记录头即停
+    static void zero(Segment &g, size_t from, size_t to) {
+        static char const zeros[4096] = {};
+        for (size_t off = from; off < to;) {
+            size_t n = std::min(sizeof zeros, to - off);
+            if (::pwrite(g.fd, zeros, n, off_t(off)) != ssize_t(n)) {
+                std::fprintf(stderr, "清除消息日志失败 %s: %s\n", g.path.c_str(), std::strerror(errno));
+                return;
+            }
+            off += n;
+        }
+    }
+
+    std::string dir_;
+    size_t segment_bytes_;
+    size_t max_open_;
+    // convs_、open_ 与各段的元数据（end、index、映射、dirty）；Segment 对象除回滚与启动截断外不销毁，只开关文件
+    std::mutex mu_;
+    std::map<long long, std::vector<std::unique_ptr<Segment>>> convs_;
+    std::list<Segment *> open_; // 已打开的段，最近用过的在前
+    // 以下只由写线程访问
+    long long next_id_ = 1;
+    bool in_txn_ = false;
+    long long txn_next_id_ = 1;       // begin 时的 next_id_，rollback 退回去
+    std::vector<std::pair<long long, Segment *>> touched_; // 本事务写过的 (会话, 段)（改它们的 end 时持有 mu_）
+    std::string buf_;               // 编码缓冲
+    std::vector<Segment *> dirty_;  // 待 fsync 的段（标记 dirty 时持有 mu_）
+    std::set<std::string> new_dirs_; // 有新段的目录
+};
+
+} // namespace seglog
@@ -1,23 +1,44 @@
 #include <boost/asio.hpp>
 #include <boost/beast.hpp>
 #include <boost/beast/websocket.hpp>
+#include <boost/container/deque.hpp>
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <ctime>
 #include <deque>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <sstream>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
 #include <nlohmann/json.hpp>
 #include <sqlite3.h>
 
+#include "cluster.hpp"
+#include "json_scan.hpp"
+#include "schema.hpp"
+#include "segment_log.hpp"
+#include "slab.hpp"
+#include "storage.hpp"
+#include "timer_wheel.hpp"
+
 using tcp = boost::asio::ip::tcp;
 namespace ws = boost::beast::websocket;
 using json = nlohmann::json;
 
+#include <openssl/crypto.h>
 #include <openssl/evp.h>
 #include <openssl/rand.h>
 
@@ -30,10 +51,16 @@ std::array<unsigned char, SALT_LEN> gen_salt() {
     return s;
 }
 
+// iter == 0：旧账号的 SHA-256(salt||password)；否则 PBKDF2-HMAC-SHA256，迭代 iter 次
 std::array<unsigned char, HASH_LEN>
 hash_password(const std::array<unsigned char, SALT_LEN> &salt,
-              const std::string &password) {
+              const std::string &password, unsigned iter) {
     std::array<unsigned char, HASH_LEN> out{};
+    if (iter) {
+        PKCS5_PBKDF2_HMAC(password.data(), (int)password.size(), salt.data(), SALT_LEN, (int)iter, EVP_sha256(),
+                          HASH_LEN, out.data());
+        return out;
+    }
 
     EVP_MD_CTX *ctx = EVP_MD_CTX_new();
     EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr);
@@ -48,20 +75,327 @@ hash_password(const std::array<unsigned char, SALT_LEN> &salt,
     return out;
 }
 
+// ────────── 运行参数 ──────────
+// 发送队列按流区分：Control（登录应答、历史等单播）永不丢弃，其余两条流按各自策略处理慢消费者
+enum class Stream : unsigned char { Control, Presence, Chat };
+enum class SlowPolicy : unsigned char { DropOldest, Coalesce, Disconnect };
+constexpr char const *STREAM_NAMES[] = {"control", "presence", "chat"};
+// 写入的落盘策略，见 DbWriter
+enum class Durability : unsigned char { Sync, Group, Async };
+constexpr char const *DURABILITY_NAMES[] = {"sync", "group", "async"};
+
+constexpr size_t HISTORY_PAGE = 20; // 登录历史 / get_history 每页条数
+constexpr size_t GROUP_PAGE = 50;   // get_group_messages 每页条数
+constexpr size_t SEARCH_PAGE = 20, SEARCH_PAGE_MAX = 50; // search_messages 默认 / 最大每页条数
+constexpr size_t SEARCH_MAX_CONVS = 512; // 可见会话超过这么多就不把范围写进 MATCH，只靠可见性判断
+
+struct ServerConfig {
+    unsigned short port = 9002;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency()); // io_context 线程数
+    Durability durability = Durability::Group;
+    unsigned db_batch_ms = 5;     // group：一批最多攒多久；async：最多隔多久 fsync 一次
+    unsigned db_batch_rows = 256; // group：一批最多攒多少条；async：最多攒多少条 fsync 一次
+    unsigned presence_tick_ms = 200; // 上下线增量的合并窗口
+    unsigned history_ring = 200;     // 每个大厅 / 群 / 私聊会话在内存里保留的最近消息数
+    size_t wq_max_bytes = 1 << 20;   // 每个会话发送队列的字节上限
+    size_t wq_max_msgs = 1024;       // 每个会话发送队列的条数上限
+    SlowPolicy presence_policy = SlowPolicy::Coalesce;
+    SlowPolicy chat_policy = SlowPolicy::DropOldest;
+    unsigned stats_interval = 0; // 秒；>0 时周期性打印运行统计
+    size_t batch_max_bytes = 64 << 10; // 一条 batch 消息最多打包的字节数
+    size_t batch_max_items = 64;       // 一条 batch 消息最多打包的帧数
+    // permessage-deflate：客户端提出时才启用；阈值以下的消息不压缩（需 Boost ≥ 1.80）
+    bool deflate = true;
+    size_t deflate_threshold = 256;
+    int deflate_window_bits = 15; // 9..15，越小每连接占用内存越少
+    int deflate_mem_level = 4;    // 1..9
+    int deflate_level = 6;        // 0..9
+    bool deflate_no_context = false; // 不保留跨消息的压缩上下文，省内存、压缩率变差
+    unsigned auth_threads = 2;    // 登录 / 注册的哈希计算线程数
+    unsigned read_threads = 4;    // 只读连接池的线程数（每线程一条 SQLite 连接）
+    size_t auth_queue = 256;      // 认证排队上限，满了直接回“繁忙”
+    unsigned kdf_iter = 100000;   // 新密码的 PBKDF2 迭代次数；旧账号登录成功后自动升级
+    unsigned short metrics_port = 9102; // Prometheus /metrics；0 关闭
+    // 集群模式：多个进程共用同一个 chatserver.db，经节点间总线互相转发消息与在线状态
+    int node_id = 0;                       // 本节点编号，集群内唯一
+    unsigned short cluster_port = 0;       // 总线监听端口；0 为单进程模式
+    std::string peers;                     // 其他节点的总线地址 host:port,...（可以包含自己）
+    std::string cluster_bind = "127.0.0.1"; // 总线监听地址；跨机器部署时改成本机网卡地址
+    std::string cluster_secret;            // 总线握手口令；不在回环地址上监听时必须设置
+    size_t cluster_queue_bytes = 64 << 20; // 每条出链的积压上限，超过就断开重连
+    // 断线续传：客户端握手带 ?resume=1 时生效
+    unsigned resume_grace_ms = 30000; // 断线后会话保留多久等待重连；0 关闭
+    size_t resume_msgs = 512;         // 每个会话保留最近多少帧用于补发
+    size_t resume_bytes = 1 << 20;    // 每个会话保留窗口的字节上限
+    // 心跳与超时（全部挂在共享时间轮上，粒度 100ms；0 关闭对应项）
+    unsigned login_timeout_ms = 60000; // 从建连到登录成功的总期限，含 websocket 握手
+    unsigned ping_interval_ms = 30000; // 连续这么久没收到数据就发一次 ping
+    unsigned idle_timeout_ms = 90000;  // 连续这么久没收到任何数据（含 pong）就断开
+    size_t max_msg_bytes = 64 << 10;   // 入站单条消息上限，超过即断开
+    size_t search_window = 256;        // 全文搜索每个窗口从每张表取的最新命中数
+    // 消息正文存哪：sqlite（chat_messages，可全文搜索）或 log（按会话的分段日志，见 segment_log.hpp）
+    std::string storage = "sqlite";
+    std::string log_dir = "chatlog";
+    size_t log_segment_bytes = 4 << 20; // 日志每段的大小
+    size_t log_open_segments = 256;     // 同时打开（fd + 映射）的日志段上限，按 LRU 换出
+};
+ServerConfig g_cfg;
+
+SlowPolicy parse_policy(std::string const &v) {
+    if (v == "drop-oldest")
+        return SlowPolicy::DropOldest;
+    if (v == "coalesce")
+        return SlowPolicy::Coalesce;
+    if (v == "disconnect")
+        return SlowPolicy::Disconnect;
+    throw std::invalid_argument(v);
+}
+
+// 解析 --key=value 形式的命令行参数
+bool parse_args(int argc, char **argv) {
+    bool threshold_set = false; // 显式给了 --deflate-threshold
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        auto eq = a.find('=');
+        std::string key = a.substr(0, eq), val = eq == std::string::npos ? "" : a.substr(eq + 1);
+        try {
+            if (key == "--port")
+                g_cfg.port = (unsigned short)std::stoi(val);
+            else if (key == "--threads")
+                g_cfg.threads = std::max(1, std::stoi(val));
+            else if (key == "--durability") {
+                auto it = std::find(std::begin(DURABILITY_NAMES), std::end(DURABILITY_NAMES), val);
+                if (it == std::end(DURABILITY_NAMES))
+                    throw std::invalid_argument(val);
+                g_cfg.durability = Durability(it - std::begin(DURABILITY_NAMES));
+            }
+            else if (key == "--db-batch-ms")
+                g_cfg.db_batch_ms = std::stoul(val);
+            else if (key == "--db-batch-rows")
+                g_cfg.db_batch_rows = std::max(1ul, std::stoul(val));
+            else if (key == "--presence-tick-ms")
+                g_cfg.presence_tick_ms = std::stoul(val);
+            else if (key == "--history-ring")
+                g_cfg.history_ring = std::max<unsigned long>(GROUP_PAGE, std::stoul(val));
+            else if (key == "--wq-max-bytes")
+                g_cfg.wq_max_bytes = std::stoul(val);
+            else if (key == "--wq-max-msgs")
+                g_cfg.wq_max_msgs = std::max(1ul, std::stoul(val));
+            else if (key == "--presence-policy")
+                g_cfg.presence_policy = parse_policy(val);
+            else if (key == "--chat-policy")
+                g_cfg.chat_policy = parse_policy(val);
+            else if (key == "--stats-interval")
+                g_cfg.stats_interval = std::stoul(val);
+            else if (key == "--batch-max-bytes")
+                g_cfg.batch_max_bytes = std::stoul(val);
+            else if (key == "--batch-max-items")
+                g_cfg.batch_max_items = std::max(1ul, std::stoul(val));
+            else if (key == "--deflate")
+                g_cfg.deflate = std::stoi(val) != 0;
+            else if (key == "--deflate-threshold") {
+                g_cfg.deflate_threshold = std::stoul(val);
+                threshold_set = true;
+            }
+            else if (key == "--deflate-window-bits")
+                g_cfg.deflate_window_bits = std::clamp(std::stoi(val), 9, 15);
+            else if (key == "--deflate-mem-level")
+                g_cfg.deflate_mem_level = std::clamp(std::stoi(val), 1, 9);
+            else if (key == "--deflate-level")
+                g_cfg.deflate_level = std::clamp(std::stoi(val), 0, 9);
+            else if (key == "--deflate-no-context")
+                g_cfg.deflate_no_context = std::stoi(val) != 0;
+            else if (key == "--auth-threads")
+                g_cfg.auth_threads = std::max(1ul, std::stoul(val));
+            else if (key == "--read-threads")
+                g_cfg.read_threads = std::max(1ul, std::stoul(val));
+            else if (key == "--auth-queue")
+                g_cfg.auth_queue = std::max(1ul, std::stoul(val));
+            else if (key == "--kdf-iter")
+                g_cfg.kdf_iter = std::max(1ul, std::stoul(val));
+            else if (key == "--metrics-port")
+                g_cfg.metrics_port = (unsigned short)std::stoul(val);
+            else if (key == "--node-id")
+                g_cfg.node_id = std::stoi(val);
+            else if (key == "--cluster-port")
+                g_cfg.cluster_port = (unsigned short)std::stoul(val);
+            else if (key == "--peers") {
+                cluster::parse_peers(val); // 只做格式检查
+                g_cfg.peers = val;
+            }
+            else if (key == "--cluster-bind") {
+                boost::asio::ip::make_address(val); // 只做格式检查，不合法时抛出
+                g_cfg.cluster_bind = val;
+            }
+            else if (key == "--cluster-secret")
+                g_cfg.cluster_secret = val;
+            else if (key == "--cluster-queue-bytes")
+                g_cfg.cluster_queue_bytes = std::stoul(val);
+            else if (key == "--resume-grace-ms")
+                g_cfg.resume_grace_ms = std::stoul(val);
+            else if (key == "--resume-msgs")
+                g_cfg.resume_msgs = std::stoul(val);
+            else if (key == "--resume-bytes")
+                g_cfg.resume_bytes = std::stoul(val);
+            else if (key == "--login-timeout-ms")
+                g_cfg.login_timeout_ms = std::stoul(val);
+            else if (key == "--ping-interval-ms")
+                g_cfg.ping_interval_ms = std::stoul(val);
+            else if (key == "--idle-timeout-ms")
+                g_cfg.idle_timeout_ms = std::stoul(val);
+            else if (key == "--max-msg-bytes")
+                g_cfg.max_msg_bytes = std::stoul(val);
+            else if (key == "--search-window")
+                g_cfg.search_window = std::max(1ul, std::stoul(val));
+            else if (key == "--storage") {
+                if (val != "sqlite" && val != "log")
+                    throw std::invalid_argument(val);
+                g_cfg.storage = val;
+            }
+            else if (key == "--log-dir")
+                g_cfg.log_dir = val;
+            else if (key == "--log-segment-bytes")
+                g_cfg.log_segment_bytes = std::max(4096ul, std::stoul(val));
+            else if (key == "--log-open-segments")
+                g_cfg.log_open_segments = std::max(1ul, std::stoul(val));
+            else {
+                std::cerr << "未知参数: " << a << '\n';
+                return false;
+            }
+        } catch (std::exception const &) {
+            std::cerr << "参数格式错误: " << a << '\n';
+            return false;
+        }
+    }
+#if BOOST_VERSION < 108000
+    // 旧版 Beast 的 permessage_deflate 没有 msg_size_threshold，阈值设了也不生效
+    if (threshold_set && g_cfg.deflate)
+        std::cerr << "警告: 当前 Boost " << BOOST_VERSION / 100000 << '.' << BOOST_VERSION / 100 % 1000
+                  << " 不支持 --deflate-threshold（需 ≥ 1.80），已忽略：压缩开启时所有消息都会压缩\n";
+#else
+    (void)threshold_set;
+#endif
+    // 总线上的帧会被直接当成其他节点的消息（在线状态、群成员变化、转发的聊天）
+    if (g_cfg.cluster_port && g_cfg.cluster_secret.empty() &&
+        !boost::asio::ip::make_address(g_cfg.cluster_bind).is_loopback()) {
+        std::cerr << "--cluster-bind=" << g_cfg.cluster_bind << " 不是回环地址，须同时设置 --cluster-secret\n";
+        return false;
+    }
+    // 日志目录没有跨进程的协调
+    if (g_cfg.storage == "log" && g_cfg.cluster_port) {
+        std::cerr << "集群模式只支持 --storage=sqlite\n";
+        return false;
+    }
+    return true;
+}
+
+// ────────── 运行指标 ──────────
+/* ===========================================================
+ * 热路径只写本线程的分片：每个分片只有一个写者，用 relaxed 的 load + store 累加，
+ * 不加锁也不用原子 RMW；/metrics 被抓取时才遍历所有分片求和。
+ * 分片在线程第一次记录时登记，之后一直保留。
+ * 直方图桶按 2 的幂划分：第 i 个桶的上界为 2^i（时间类单位 us，队列深度单位为帧）。
+ * =========================================================== */
+namespace metrics {
+enum Hist : unsigned char {
+    FanoutBroadcast, // 大厅 / 上下线广播
+    FanoutGroup,
+    FanoutDm,
+    SqlReader, // 只读连接池上的 step
+    SqlWriter, // 写线程上的 step
+    HandlerLag,
+    WriteQueueDepth, // 入队后的发送队列长度
+    Search,          // 一次 search_messages 的总耗时
+    NHIST
+};
+// 入站消息：cmd::Type 的各项，加上两类纯文本
+constexpr int N_CMD = 9;
+enum Inbound : unsigned char { TextLobby = N_CMD, TextDm, NINBOUND };
+constexpr char const *INBOUND_NAMES[NINBOUND] = {"unknown",       "create_group",       "add_group_member",
+                                                 "remove_group_member", "get_group_members", "get_group_messages",
+                                                 "group_message", "get_history",        "search_messages",
+                                                 "lobby",         "dm"};
+constexpr int BUCKETS = 22; // 上界 1 .. 2^21，再加 +Inf
+
+struct Histogram {
+    std::atomic<uint64_t> b[BUCKETS + 1]{};
+    std::atomic<uint64_t> sum{0};
+};
+struct Shard {
+    std::atomic<uint64_t> inbound[NINBOUND]{};
+    Histogram hist[NHIST];
+};
+
+inline void add(std::atomic<uint64_t> &a, uint64_t n = 1) {
+    a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+class Registry {
+  public:
+    Shard &local() {
+        thread_local Shard *s = enroll();
+        return *s;
+    }
+    template <class F>
+    void for_each(F f) {
+        std::lock_guard<std::mutex> lk(mu_);
+        for (auto &s : shards_)
+            f(*s);
+    }
+
+  private:
+    Shard *enroll() {
+        std::lock_guard<std::mutex> lk(mu_);
+        shards_.push_back(std::make_unique<Shard>());
+        return shards_.back().get();
+    }
+    std::mutex mu_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+};
+Registry g_registry;
+
+inline void inbound(int kind) { add(g_registry.local().inbound[kind]); }
+inline void observe(Hist h, uint64_t v) {
+    int i = v <= 1 ? 0 : 64 - __builtin_clzll(v - 1); // 最小的 i 使 v <= 2^i
+    auto &hist = g_registry.local().hist[h];
+    add(hist.b[std::min(i, BUCKETS)]);
+    add(hist.sum, v);
+}
+inline void observe_since(Hist h, std::chrono::steady_clock::time_point t0) {
+    observe(h, std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count());
+}
+} // namespace metrics
+
 // ────────── SQLite 基础 ──────────
+// g_db 只在启动时建表 / 升级；写入走 g_writer 的连接，读查询走 g_reads 的只读连接
 sqlite3 *g_db = nullptr;
 constexpr char DB_FILE[] = "chatserver.db";
+// 旧消息表还在迁移：期间历史环缓存不可信（迁移会补进更早的消息），翻历史一律查库
+bool g_legacy_pending = false;
 
-inline std::string now_str() {
-    std::time_t t = std::time(nullptr);
+inline std::string now_str(std::time_t t = std::time(nullptr)) {
     std::tm tm = *std::localtime(&t);
     std::ostringstream ss;
     ss << '[' << std::put_time(&tm, "%Y-%m-%d %H:%M:%S") << ']';
     return ss.str();
 }
-bool exec_sql(std::string const &sql) {
+// 与 SQLite CURRENT_TIMESTAMP 相同的 UTC 格式（消息的 timestamp 字段）
+inline std::string utc_timestamp(std::time_t t = std::time(nullptr)) {
+    std::tm tm = *std::gmtime(&t);
+    char buf[32];
+    std::strftime(buf, sizeof buf, "%Y-%m-%d %H:%M:%S", &tm);
+    return buf;
+}
+// 大厅 / 私聊消息的显示行：实时推送与历史记录同一格式，库里只存原文
+inline std::string lobby_line(std::time_t t, std::string const &sender, std::string const &text) {
+    return now_str(t) + " " + sender + " : " + text;
+}
+inline std::string dm_line(std::time_t t, std::string const &sender, std::string const &to, std::string const &text) {
+    return now_str(t) + " " + sender + " (私) 对 " + to + " 说: " + text;
+}
+bool exec_sql(std::string const &sql, sqlite3 *db = g_db) {
     char *err = nullptr;
-    if (sqlite3_exec(g_db, sql.c_str(), nullptr, nullptr, &err) != SQLITE_OK) {
+    if (sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &err) != SQLITE_OK) {
         std::cerr << "SQL error: " << err << '\n';
         sqlite3_free(err);
         return false;
@@ -69,7 +403,9 @@ bool exec_sql(std::string const &sql) {
     return true;
 }
 bool db_open() {
-    if (sqlite3_open(DB_FILE, &g_db) != SQLITE_OK) {
+    if (sqlite3_open_v2(DB_FILE, &g_db,
+                        SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX,
+                        nullptr) != SQLITE_OK) {
         std::cerr << "无法打开数据库\n";
         return false;
     }
@@ -77,23 +413,15 @@ bool db_open() {
 }
 void db_init() {
     /* ── 运行时优化 ─────────────────────────────── */
+    exec_sql("PRAGMA busy_timeout=3000;");  // 最先设：集群的多个节点会同时建表
     exec_sql("PRAGMA journal_mode=WAL;");   // 读写并发
     exec_sql("PRAGMA synchronous=NORMAL;"); // 更快落盘
-    exec_sql("PRAGMA busy_timeout=3000;");  // 写锁最多等 3s
     exec_sql("PRAGMA foreign_keys = ON;");
 
     /* ── 业务表 ─────────────────────────────────── */
-    exec_sql("CREATE TABLE IF NOT EXISTS users ("
-             " username TEXT PRIMARY KEY,"
-             " salt     BLOB NOT NULL,"    // 16 bytes
-             " hash     BLOB NOT NULL);"); // 32 bytes SHA-256
-
-    exec_sql("CREATE TABLE IF NOT EXISTS messages ("
-             " id        INTEGER PRIMARY KEY AUTOINCREMENT,"
-             " sender    TEXT,"
-             " receiver  TEXT," // 'all' 表示公共
-             " message   TEXT,"
-             " timestamp DATETIME DEFAULT CURRENT_TIMESTAMP);");
+    // 账号与消息表见 schema.hpp；集群的多个节点同时启动：只有一个会升级旧表
+    exec_sql("BEGIN IMMEDIATE;");
+    schema::ensure_users(g_db);
 
     exec_sql("CREATE TABLE IF NOT EXISTS groups ("
              " id     INTEGER PRIMARY KEY AUTOINCREMENT,"
@@ -108,13 +436,8 @@ void db_init() {
              " UNIQUE(group_id,username),"
              " FOREIGN KEY(group_id) REFERENCES groups(id) ON DELETE CASCADE);");
 
-    exec_sql("CREATE TABLE IF NOT EXISTS group_messages ("
-             " id        INTEGER PRIMARY KEY AUTOINCREMENT,"
-             " group_id  INTEGER,"
-             " sender    TEXT,"
-             " message   TEXT,"
-             " timestamp DATETIME DEFAULT CURRENT_TIMESTAMP,"
-             " FOREIGN KEY(group_id) REFERENCES groups(id) ON DELETE CASCADE);");
+    schema::ensure_messages(g_db);
+    schema::ensure_store_state(g_db);
 
     /* ── 辅助日志表（可选） ─────────────────────── */
     exec_sql("CREATE TABLE IF NOT EXISTS events ("
@@ -125,247 +448,1843 @@ void db_init() {
              " ts DATETIME DEFAULT CURRENT_TIMESTAMP);");
 
     /* ── 高频列索引 ─────────────────────────────── */
-    exec_sql("CREATE INDEX IF NOT EXISTS idx_messages_receiver ON messages(receiver);");
-    exec_sql("CREATE INDEX IF NOT EXISTS idx_messages_time     ON messages(timestamp);");
-
-    exec_sql("CREATE INDEX IF NOT EXISTS idx_grp_msg_gid_id    ON group_messages(group_id,id);");
     exec_sql("CREATE INDEX IF NOT EXISTS idx_grp_mem_gid_user  ON group_members(group_id,username);");
+    exec_sql("COMMIT;");
+
+    g_legacy_pending = schema::legacy_pending(g_db);
+    if (g_legacy_pending)
+        std::cout << "旧版 messages / group_messages 表还没迁移完，请运行 ./migrate（服务可照常运行）\n";
 }
 
+// ────────── Prepared statement 缓存 ──────────
+/* ===========================================================
+ * 每个连接一份缓存，以 SQL 文本为键，首次使用时 prepare，之后复用：
+ *   auto st = cache.get("SELECT ...");   // 取出句柄
+ *   sqlite3_bind_xxx(st, ...);           // 句柄可隐式转成 sqlite3_stmt*
+ *   while (st.step() == SQLITE_ROW) ...  // step 计时
+ *   // 句柄析构时 reset + clear_bindings，语句留在缓存里
+ * 缓存本身不加锁，由所属连接的使用方保证串行。
+ * =========================================================== */
+class StmtCache {
+    struct Entry {
+        std::string sql;
+        sqlite3_stmt *st = nullptr;
+        unsigned long long calls = 0; // 执行次数（句柄被 step 过才算一次）
+        unsigned long long steps = 0;
+        std::chrono::nanoseconds busy{0}; // 累计 step 耗时
+        metrics::Hist hist;               // 计入哪个延迟直方图
+    };
+
+  public:
+    class Stmt {
+      public:
+        Stmt(Entry *e) : e_(e) {}
+        Stmt(Stmt &&o) noexcept : e_(std::exchange(o.e_, nullptr)), stepped_(o.stepped_) {}
+        Stmt(Stmt const &) = delete;
+        ~Stmt() {
+            if (!e_ || !e_->st)
+                return;
+            sqlite3_reset(e_->st);
+            sqlite3_clear_bindings(e_->st);
+            if (stepped_)
+                ++e_->calls;
+        }
+        operator sqlite3_stmt *() const { return e_ ? e_->st : nullptr; }
+        int step() {
+            if (!e_ || !e_->st)
+                return SQLITE_MISUSE;
+            auto t0 = std::chrono::steady_clock::now();
+            int rc = sqlite3_step(e_->st);
+            auto dt = std::chrono::steady_clock::now() - t0;
+            e_->busy += dt;
+            metrics::observe(e_->hist, std::chrono::duration_cast<std::chrono::microseconds>(dt).count());
+            ++e_->steps;
+            stepped_ = true;
+            return rc;
+        }
+
+      private:
+        Entry *e_;
+        bool stepped_ = false;
+    };
+
+    StmtCache() = default;
+    StmtCache(StmtCache const &) = delete;
+    ~StmtCache() { clear(); }
+
+    void attach(sqlite3 *db, metrics::Hist hist) {
+        db_ = db;
+        hist_ = hist;
+    }
+    sqlite3 *db() const { return db_; }
+
+    Stmt get(std::string_view sql) {
+        auto it = cache_.find(sql);
+        if (it != cache_.end())
+            return Stmt(it->second.get());
+        auto e = std::make_unique<Entry>();
+        e->sql.assign(sql);
+        e->hist = hist_;
+        if (sqlite3_prepare_v3(db_, e->sql.c_str(), -1, SQLITE_PREPARE_PERSISTENT, &e->st, nullptr) != SQLITE_OK)
+            std::cerr << "SQL prepare error: " << sqlite3_errmsg(db_) << " in: " << e->sql << '\n';
+        Entry *raw = e.get();
+        cache_.emplace(raw->sql, std::move(e)); // 键指向 Entry 自己持有的字符串
+        return Stmt(raw);
+    }
+    // 关闭连接前调用
+    void clear() {
+        for (auto &kv : cache_)
+            sqlite3_finalize(kv.second->st);
+        cache_.clear();
+    }
+    // 按累计耗时从高到低打印
+    void dump_stats(std::ostream &os, char const *label) const {
+        std::vector<Entry const *> v;
+        for (auto &kv : cache_)
+            v.push_back(kv.second.get());
+        std::sort(v.begin(), v.end(), [](auto a, auto b) { return a->busy > b->busy; });
+        os << "── SQL 统计 [" << label << "] ──\n";
+        for (auto e : v) {
+            double ms = std::chrono::duration<double, std::milli>(e->busy).count();
+            os << std::setw(8) << e->calls << " 次 " << std::fixed << std::setprecision(3)
+               << std::setw(10) << ms << " ms  avg " << std::setw(8)
+               << (e->calls ? ms * 1000 / e->calls : 0.0) << " us  " << e->sql << '\n';
+        }
+    }
+
+  private:
+    sqlite3 *db_ = nullptr;
+    metrics::Hist hist_ = metrics::SqlReader;
+    std::unordered_map<std::string_view, std::unique_ptr<Entry>> cache_;
+};
+
+// 消息正文的存储；append 只在写线程的 job 里调用，会话与账号仍经 StmtCache 直接读写 SQLite
+std::unique_ptr<MessageStore> g_store;
+
+// ────────── 异步写入线程 ──────────
+/* ===========================================================
+ * 所有写操作都投递到唯一的写线程，网络线程只负责入队：
+ *   - 写线程持有独立连接（WAL 下与只读连接池上的读互不阻塞）
+ *   - job 返回的 Done 回调（广播、应答等回执）在 COMMIT 之后执行，保证回调里读得到新数据；
+ *     COMMIT 失败则整批 ROLLBACK，各回调收到 committed = false，只向客户端报错，不广播、不进历史
+ *     （--storage=log 时已 append 进日志的正文不随之撤回）
+ *   - BEGIN 失败（集群里别的进程长时间占着写锁等）时不执行 job，隔一秒重试，写入在队列里等着
+ * 落盘策略 --durability 对所有写入（消息、注册、建群、成员变更）一视同仁；
+ * 下面的 N = db_batch_ms，M = db_batch_rows：
+ *   sync   每个 job 单独一个事务，synchronous=FULL，COMMIT 即 fsync，之后才回执。
+ *          进程崩溃、断电都不丢已回执的写入，最多丢正在执行的那一条
+ *   group  一批攒到 M 条或 N 毫秒一起 COMMIT（FULL，一次 fsync），之后才回执。
+ *          不丢已回执的写入；丢的是还没回执的当前批：≤ M 条、≤ N 毫秒，回执也因此最多晚 N 毫秒
+ *   async  队列一空就 COMMIT 并回执（synchronous=NORMAL，不 fsync），已提交的写入攒到 M 条或
+ *          N 毫秒再 fsync 一次 WAL 与消息日志。进程崩溃不丢（数据已交给操作系统）；
+ *          断电 / 内核崩溃最多丢 N 毫秒、M 条已回执的写入
+ * 计时由 io_context 上的 flush 定时器负责（set_flush_timer）：批次或未 fsync 的写入出现时挂上，
+ * 到期调用 flush()。N = 0 或还没设定时器时，group 在队列一空时提交、async 每次提交都 fsync。
+ * stop() 处理完队列后做最后一次提交与 fsync。
+ * =========================================================== */
+class DbWriter {
+  public:
+    using Done = std::function<void(bool committed)>;
+    using Job = std::function<Done(StmtCache &)>;
+
+    bool start() {
+        if (sqlite3_open_v2(DB_FILE, &db_, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr) != SQLITE_OK) {
+            std::cerr << "写线程无法打开数据库\n";
+            return false;
+        }
+        // WAL 下 NORMAL 只在 checkpoint 时 fsync；FULL 每次 COMMIT 都 fsync
+        exec_sql(g_cfg.durability == Durability::Async ? "PRAGMA synchronous=NORMAL;" : "PRAGMA synchronous=FULL;",
+                 db_);
+        exec_sql("PRAGMA busy_timeout=3000;", db_);
+        exec_sql("PRAGMA foreign_keys = ON;", db_);
+        stmts_.attach(db_, metrics::SqlWriter);
+        th_ = std::thread([this] { run(); });
+        return true;
+    }
+    sqlite3 *db() const { return db_; } // 只能在写线程的 job 里使用
+    StmtCache &stmts() { return stmts_; } // 同上
+    // arm() 须在 db_batch_ms 毫秒后调用 flush()；在写线程上调用，每个窗口一次
+    void set_flush_timer(std::function<void()> arm) {
+        std::lock_guard<std::mutex> lk(mu_);
+        arm_ = std::move(arm);
+    }
+    void submit(Job job) {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            q_.push_back(std::move(job));
+        }
+        cv_.notify_one();
+    }
+    // group：提交当前批；async：fsync 已提交的写入
+    void flush() {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            flush_ = true;
+        }
+        cv_.notify_one();
+    }
+    // 处理完队列中剩余的写入、落盘后再退出
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            stop_ = true;
+        }
+        cv_.notify_one();
+        if (th_.joinable())
+            th_.join();
+        if (!db_)
+            return;
+        stmts_.dump_stats(std::cout, "writer");
+        std::cout << "── 写线程 ──\n  durability " << DURABILITY_NAMES[(int)g_cfg.durability] << ", " << rows_total_
+                  << " 条 / " << commits_ << " 次 COMMIT，额外 fsync " << syncs_ << " 次，回滚 " << rollbacks_ << " 次\n";
+        stmts_.clear();
+        sqlite3_close(db_);
+        db_ = nullptr;
+    }
+
+  private:
+    void run() {
+        std::unique_lock<std::mutex> lk(mu_);
+        for (;;) {
+            cv_.wait(lk, [this] { return stop_ || flush_ || !q_.empty(); });
+            bool stopping = stop_ && q_.empty();
+            bool flush = std::exchange(flush_, false);
+            std::deque<Job> jobs;
+            jobs.swap(q_);
+            timer_ = g_cfg.db_batch_ms ? arm_ : nullptr;
+            lk.unlock();
+            if (flush)
+                armed_ = false; // 定时器已到期，之后的写入重新挂
+            for (size_t i = 0; i < jobs.size(); ++i) {
+                if (run_job(jobs[i]))
+                    continue;
+                // 开不了事务：剩下的放回队首，等一会儿再试；要退出了就只能放弃
+                lk.lock();
+                if (stop_)
+                    std::cerr << "写线程: 无法开始事务，退出时放弃 " << jobs.size() - i << " 个写入\n";
+                else {
+                    q_.insert(q_.begin(), std::make_move_iterator(jobs.begin() + i), std::make_move_iterator(jobs.end()));
+                    cv_.wait_for(lk, std::chrono::seconds(1), [this] { return stop_; });
+                }
+                lk.unlock();
+                break;
+            }
+            // 队列空了：async 立即提交；group 没有定时器时也不再等
+            if (g_cfg.durability == Durability::Async || !timer_)
+                commit();
+            if (flush || stopping) {
+                commit();
+                sync();
+            }
+            lk.lock();
+            if (stopping)
+                return;
+        }
+    }
+    // 开不了事务时不执行 job，返回 false
+    bool run_job(Job &job) {
+        if (!in_txn_) {
+            // IMMEDIATE：一开始就拿写锁（受 busy_timeout 保护）；集群里多个进程共用一个库，
+            // 延迟事务在读锁升级写锁时可能直接 SQLITE_BUSY
+            if (stmts_.get("BEGIN IMMEDIATE;").step() != SQLITE_DONE) {
+                std::cerr << "SQL error: BEGIN 失败: " << sqlite3_errmsg(db_) << '\n';
+                return false;
+            }
+            in_txn_ = true;
+            g_store->begin();
+            if (g_cfg.durability == Durability::Group)
+                arm();
+        }
+        if (Done d = job(stmts_))
+            done_.push_back(std::move(d));
+        if (++rows_ >= g_cfg.db_batch_rows || g_cfg.durability == Durability::Sync)
+            commit();
+        return true;
+    }
+    // 提交当前事务并执行回执；sync / group 下 COMMIT 本身已 fsync，消息日志先于它落盘。
+    // 消息日志的提交水位随同一事务写入，日志里的记录 COMMIT 成功后才对读者可见。
+    // 失败则回滚整批（连同日志），回执一律收到 committed = false
+    void commit() {
+        if (!in_txn_)
+            return;
+        in_txn_ = false;
+        auto done = std::move(done_);
+        done_.clear();
+        if (g_cfg.durability != Durability::Async)
+            g_store->sync();
+        long long hw = g_store->high_water();
+        if (hw != hw_) {
+            auto st = stmts_.get("INSERT OR REPLACE INTO store_state(key, value) VALUES('log_committed', ?1);");
+            sqlite3_bind_int64(st, 1, hw);
+            st.step();
+        }
+        if (stmts_.get("COMMIT;").step() != SQLITE_DONE) {
+            std::cerr << "SQL error: COMMIT 失败，回滚 " << rows_ << " 条写入: " << sqlite3_errmsg(db_) << '\n';
+            if (!sqlite3_get_autocommit(db_)) // 出错时 SQLite 可能已自行回滚
+                stmts_.get("ROLLBACK;").step();
+            g_store->rollback();
+            ++rollbacks_;
+            rows_ = 0;
+            for (auto &d : done)
+                d(false);
+            return;
+        }
+        g_store->commit();
+        hw_ = hw;
+        ++commits_;
+        rows_total_ += rows_;
+        if (g_cfg.durability == Durability::Async) {
+            unsynced_ += rows_;
+            if (unsynced_ >= g_cfg.db_batch_rows || !timer_)
+                sync();
+            else
+                arm();
+        }
+        rows_ = 0;
+        for (auto &d : done)
+            d(true);
+    }
+    // async：把已提交的写入刷到盘上，消息日志先于记着水位的 WAL。fsync 作用于整个文件，另开一个描述符即可
+    void sync() {
+        if (g_cfg.durability != Durability::Async || !unsynced_)
+            return;
+        g_store->sync();
+        int fd = ::open((std::string(DB_FILE) + "-wal").c_str(), O_RDONLY);
+        if (fd >= 0) {
+            ::fsync(fd);
+            ::close(fd);
+        }
+        unsynced_ = 0;
+        ++syncs_;
+    }
+    void arm() {
+        if (armed_ || !timer_)
+            return;
+        armed_ = true;
+        timer_();
+    }
+
+    sqlite3 *db_ = nullptr;
+    StmtCache stmts_; // 只在写线程上使用
+    std::thread th_;
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::deque<Job> q_;
+    std::function<void()> arm_;
+    bool stop_ = false, flush_ = false;
+    // 以下只在写线程上使用
+    std::function<void()> timer_; // 本轮使用的 arm_；N = 0 时为空
+    std::vector<Done> done_;      // 当前事务的回执
+    bool in_txn_ = false, armed_ = false;
+    unsigned rows_ = 0;           // 当前事务的条数
+    long long hw_ = 0;            // 已提交的消息日志水位
+    unsigned long long unsynced_ = 0, rows_total_ = 0, commits_ = 0, syncs_ = 0, rollbacks_ = 0;
+};
+DbWriter g_writer;
+
 // ── 前向声明
 class Session;
-void broadcast_json(json const &);
+void broadcast_json(json const &, Stream = Stream::Control);
+struct WireFrame;
+using Frame = std::shared_ptr<const WireFrame>;
+void broadcast_frame(Frame const &, Stream = Stream::Control);
+
+// 线路编码：握手时 ?proto=msgpack 选二进制 MessagePack，默认文本（JSON / 纯文本聊天行）
+enum class Proto : unsigned char { Json, MsgPack };
+
+// 发给客户端的 JSON 都经这里序列化：库里若残留非法 UTF-8（旧数据等），替换成 U+FFFD，不抛异常
+inline std::string dump_wire(json const &j) { return j.dump(-1, ' ', false, json::error_handler_t::replace); }
+
+// Frame：不可变的共享帧，广播时只序列化一次，各会话发送队列引用同一份内存。
+// 两种编码按需生成且只生成一次：全是文本客户端时从不做 MessagePack 转换，反之亦然。
+// 纯文本聊天行在 MessagePack 里编码成字符串
+struct WireFrame {
+    WireFrame(std::string s, Proto p) { (p == Proto::Json ? text_ : packed_) = std::move(s), have_ = p; }
+
+    std::string const &as(Proto p) const {
+        if (p == have_)
+            return p == Proto::Json ? text_ : packed_;
+        std::call_once(once_, [&] {
+            if (p == Proto::MsgPack) {
+                if (!text_.empty() && text_.front() == '{')
+                    json::to_msgpack(json::parse(text_), packed_);
+                else
+                    json::to_msgpack(json(text_), packed_);
+            } else {
+                auto j = json::from_msgpack(packed_);
+                text_ = j.is_string() ? j.get<std::string>() : dump_wire(j);
+            }
+        });
+        return p == Proto::Json ? text_ : packed_;
+    }
 
-// ── 在线会话集合
-std::set<std::shared_ptr<Session>> g_sessions;
+  private:
+    Proto have_;
+    mutable std::string text_, packed_;
+    mutable std::once_flag once_;
+};
+inline Frame make_frame(std::string s, Proto p = Proto::Json) {
+    return std::make_shared<const WireFrame>(std::move(s), p);
+}
+// 单播：直接按会话的编码序列化，不经过另一种格式
+inline Frame make_frame(json const &j, Proto p) {
+    if (p == Proto::Json)
+        return make_frame(dump_wire(j));
+    std::string s;
+    json::to_msgpack(j, s);
+    return make_frame(std::move(s), Proto::MsgPack);
+}
 
-// ── SQLite 辅助
-bool user_exists(std::string const &u) {
-    sqlite3_stmt *st;
-    sqlite3_prepare_v2(g_db, "SELECT 1 FROM users WHERE username=?;", -1, &st, 0);
-    sqlite3_bind_text(st, 1, u.c_str(), -1, SQLITE_STATIC);
-    bool ok = sqlite3_step(st) == SQLITE_ROW;
-    sqlite3_finalize(st);
-    return ok;
+// ── 发送队列统计（所有会话汇总）
+struct WriteQueueStats {
+    std::atomic<unsigned long long> dropped[3]{};   // 按 Stream 下标
+    std::atomic<unsigned long long> coalesced[3]{}; // 被合并掉的帧数
+    std::atomic<unsigned long long> slow_disconnects{0};
+    std::atomic<size_t> hw_msgs{0}, hw_bytes{0}; // 单个会话队列的历史最高水位
+    std::atomic<unsigned long long> writes{0}, frames{0}; // async_write 次数 / 送出的帧数
+    std::atomic<unsigned long long> payload_bytes{0}, wire_bytes{0}; // 压缩前的消息字节 / 实际写进 socket 的字节
+    // 断线续传：断线后保留 / 被接管 / 接管失败 / 超时放弃的会话数，补发的帧数
+    std::atomic<unsigned long long> parked{0}, resumed{0}, resume_failed{0}, expired{0}, replayed{0};
+    // 心跳：发出的 ping 数，因空闲 / 登录超时被断开的连接数
+    std::atomic<unsigned long long> pings{0}, idle_closed{0}, login_timeouts{0};
+
+    static void raise(std::atomic<size_t> &hw, size_t v) {
+        size_t cur = hw.load(std::memory_order_relaxed);
+        while (v > cur && !hw.compare_exchange_weak(cur, v, std::memory_order_relaxed)) {
+        }
+    }
+    void dump(std::ostream &os) const {
+        os << "── 发送队列 ──\n";
+        for (int i = 0; i < 3; ++i)
+            os << "  " << STREAM_NAMES[i] << ": dropped " << dropped[i] << ", coalesced " << coalesced[i] << '\n';
+        os << "  slow disconnects " << slow_disconnects << ", high-water " << hw_msgs << " msgs / "
+           << hw_bytes << " bytes\n";
+        auto w = writes.load(), n = frames.load();
+        os << "  " << w << " writes, " << n << " frames (" << std::fixed << std::setprecision(2)
+           << (w ? double(n) / w : 0.0) << " frames/write)\n";
+        // 进程 CPU 时间：开关 --deflate 各跑一次对比，差值即压缩开销
+        auto raw = payload_bytes.load(), wire = wire_bytes.load();
+        os << "  payload " << raw << " bytes, wire " << wire << " bytes (saved "
+           << (raw > wire ? raw - wire : 0) << "), cpu " << std::setprecision(3)
+           << double(std::clock()) / CLOCKS_PER_SEC << " s\n";
+        os << "  resume: parked " << parked << ", resumed " << resumed << " (replayed " << replayed
+           << " frames), failed " << resume_failed << ", expired " << expired << '\n';
+        os << "  heartbeat: pings " << pings << ", idle closed " << idle_closed << ", login timeouts "
+           << login_timeouts << '\n';
+    }
+};
+WriteQueueStats g_wq_stats;
+
+// ── 统计写出字节数的 socket 包装：ws::stream 的下一层，记录压缩后真正上线的字节
+class CountingSocket {
+    tcp::socket s_;
+
+  public:
+    using executor_type = tcp::socket::executor_type;
+    using next_layer_type = tcp::socket;
+
+    explicit CountingSocket(tcp::socket s) : s_(std::move(s)) {}
+    executor_type get_executor() { return s_.get_executor(); }
+    tcp::socket &next_layer() { return s_; }
+
+    template <class Buffers, class Handler>
+    void async_read_some(Buffers const &b, Handler &&h) {
+        s_.async_read_some(b, std::forward<Handler>(h));
+    }
+    template <class Buffers, class Handler>
+    void async_write_some(Buffers const &b, Handler &&h) {
+        // 保留原 handler 关联的 executor（会话 strand）
+        auto ex = boost::asio::get_associated_executor(h, s_.get_executor());
+        s_.async_write_some(b, boost::asio::bind_executor(
+                                   ex, [h = std::forward<Handler>(h)](boost::system::error_code ec, std::size_t n) mutable {
+                                       g_wq_stats.wire_bytes += n;
+                                       std::move(h)(ec, n);
+                                   }));
+    }
+};
+// websocket 关闭握手用到的 teardown，转给底层 tcp::socket（ADL 查找）
+void teardown(boost::beast::role_type role, CountingSocket &s, boost::system::error_code &ec) {
+    ws::teardown(role, s.next_layer(), ec);
+}
+template <class Handler>
+void async_teardown(boost::beast::role_type role, CountingSocket &s, Handler &&h) {
+    ws::async_teardown(role, s.next_layer(), std::forward<Handler>(h));
 }
-bool verify_user(const std::string &u, const std::string &p) {
-    sqlite3_stmt *st;
-    sqlite3_prepare_v2(g_db,
-                       "SELECT salt,hash FROM users WHERE username=?;", -1, &st, 0);
-    sqlite3_bind_text(st, 1, u.c_str(), -1, SQLITE_STATIC);
 
-    bool ok = false;
-    if (sqlite3_step(st) == SQLITE_ROW) {
-        const void *salt_blob = sqlite3_column_blob(st, 0);
-        const void *hash_blob = sqlite3_column_blob(st, 1);
-        if (salt_blob && hash_blob) {
-            std::array<unsigned char, SALT_LEN> salt;
-            std::array<unsigned char, HASH_LEN> hash_db;
-            std::memcpy(salt.data(), salt_blob, SALT_LEN);
-            std::memcpy(hash_db.data(), hash_blob, HASH_LEN);
+// ── 全部会话共用的时间轮：登录期限、心跳、空闲断开、续传宽限期
+// 定义在会话集合之前：退出时会话先析构，析构里还要从轮上摘下自己
+TimerWheel g_wheel;
+
+// ── 在线会话集合与索引（多个 io 线程并发访问，g_sessions_mu 保护）
+std::set<std::shared_ptr<Session>> g_sessions;
+std::unordered_map<std::string, std::vector<std::shared_ptr<Session>>> g_users; // 用户名 → 在线会话（可多标签页）
+std::unordered_map<int, std::set<std::shared_ptr<Session>>> g_group_online;       // gid → 在线群成员会话
+std::unordered_map<std::string, std::set<int>> g_remote_users; // 集群模式：用户名 → 有其会话的其他节点
+std::unordered_map<std::string, std::shared_ptr<Session>> g_parked; // 断线续传：token → 断线后等待接管的会话
+std::mutex g_sessions_mu;
+
+// 以下需持有 g_sessions_mu
+bool online_locked(std::string const &user) { return g_users.count(user) || g_remote_users.count(user); }
+bool remote_online_locked(std::string const &user) { return g_remote_users.count(user) != 0; }
+
+// 拷贝一份快照再遍历，避免持锁期间投递消息
+std::vector<std::shared_ptr<Session>> sessions_snapshot() {
+    std::lock_guard<std::mutex> lk(g_sessions_mu);
+    return {g_sessions.begin(), g_sessions.end()};
+}
+// 某用户的全部在线会话，O(1) 查表
+std::vector<std::shared_ptr<Session>> sessions_of(std::string const &user) {
+    std::lock_guard<std::mutex> lk(g_sessions_mu);
+    auto it = g_users.find(user);
+    if (it == g_users.end())
+        return {};
+    return it->second;
+}
+
+// ── 在线状态增量
+/* ===========================================================
+ * 新登录的会话只收到一份完整 users_list 快照；其余会话收
+ * user_joined / user_left 增量。一个 tick 内的变化合并成一次
+ * 广播，状态以 flush 时的 g_users / g_remote_users 为准
+ * （抖动的用户只发最终态）。集群模式下各节点各自合并、各自广播。
+ * =========================================================== */
+class PresenceHub {
+  public:
+    void init(boost::asio::io_context &ioc) {
+        timer_ = std::make_unique<boost::asio::steady_timer>(boost::asio::make_strand(ioc));
+    }
+    // 定时器属于 ioc，须在 ioc 析构之前释放（g_presence 是全局对象，活得比 ioc 久）
+    void stop() { timer_.reset(); }
+    // 用户第一个标签页上线 / 最后一个标签页下线时调用
+    void touch(std::string const &user) {
+        std::lock_guard<std::mutex> lk(mu_);
+        dirty_.insert(user);
+        if (armed_)
+            return;
+        armed_ = true;
+        timer_->expires_after(std::chrono::milliseconds(g_cfg.presence_tick_ms));
+        timer_->async_wait([this](boost::system::error_code ec) {
+            if (!ec)
+                flush();
+        });
+    }
 
-            auto hash_in = hash_password(salt, p);
-            ok = std::memcmp(hash_in.data(), hash_db.data(), HASH_LEN) == 0;
+  private:
+    void flush() {
+        std::set<std::string> dirty;
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            dirty.swap(dirty_);
+            armed_ = false;
+        }
+        json joined = json::array(), left = json::array();
+        {
+            std::lock_guard<std::mutex> lk(g_sessions_mu);
+            for (auto &u : dirty)
+                (online_locked(u) ? joined : left).push_back(u);
         }
+        if (!joined.empty())
+            broadcast_json({{"type", "user_joined"}, {"users", std::move(joined)}}, Stream::Presence);
+        if (!left.empty())
+            broadcast_json({{"type", "user_left"}, {"users", std::move(left)}}, Stream::Presence);
     }
-    sqlite3_finalize(st);
-    return ok;
+
+    std::unique_ptr<boost::asio::steady_timer> timer_;
+    std::mutex mu_;
+    std::set<std::string> dirty_;
+    bool armed_ = false;
+};
+PresenceHub g_presence;
+
+// ── 集群总线：单进程模式下为空；节点间消息的格式与处理见 Session::on_bus
+std::unique_ptr<cluster::Bus> g_bus;
+void cluster_publish(json const &m) {
+    if (g_bus)
+        g_bus->publish(m);
 }
 
-bool register_user(const std::string &u, const std::string &p) {
-    if (user_exists(u))
-        return false;
+// ── 认证线程池：密码哈希很慢（尤其 PBKDF2），不能占用网络线程
+// 队列有上限，满了由调用方回“繁忙”；结果由任务自己 post 回会话 strand
+class AuthPool {
+  public:
+    using Task = std::function<void()>;
 
-    auto salt = gen_salt();
-    auto hash = hash_password(salt, p);
+    void start() {
+        for (unsigned i = 0; i < g_cfg.auth_threads; ++i)
+            th_.emplace_back([this] { run(); });
+    }
+    // 队列已满返回 false
+    bool submit(Task t) {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            if (stop_ || q_.size() >= g_cfg.auth_queue) {
+                ++rejected_;
+                return false;
+            }
+            q_.push_back({std::move(t), std::chrono::steady_clock::now()});
+            hw_ = std::max(hw_, q_.size());
+        }
+        cv_.notify_one();
+        return true;
+    }
+    // 排队中的任务直接丢弃：网络线程已停，结果也送不回去
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            stop_ = true;
+            q_.clear();
+        }
+        cv_.notify_all();
+        for (auto &t : th_)
+            t.join();
+        th_.clear();
+    }
+    // /metrics 用：当前排队数与累计拒绝数
+    std::pair<size_t, unsigned long long> depth() {
+        std::lock_guard<std::mutex> lk(mu_);
+        return {q_.size(), rejected_};
+    }
+    void dump(std::ostream &os) {
+        std::lock_guard<std::mutex> lk(mu_);
+        os << "── 认证队列 ──\n  depth " << q_.size() << " (high-water " << hw_ << "), done " << done_
+           << ", rejected " << rejected_ << ", avg wait " << std::fixed << std::setprecision(2)
+           << (done_ ? wait_us_ / 1000.0 / done_ : 0.0) << " ms\n";
+    }
 
-    sqlite3_stmt *st;
-    sqlite3_prepare_v2(g_db,
-                       "INSERT INTO users(username,salt,hash) VALUES(?,?,?);", -1, &st, 0);
-    sqlite3_bind_text(st, 1, u.c_str(), -1, SQLITE_STATIC);
-    sqlite3_bind_blob(st, 2, salt.data(), SALT_LEN, SQLITE_STATIC);
-    sqlite3_bind_blob(st, 3, hash.data(), HASH_LEN, SQLITE_STATIC);
+  private:
+    void run() {
+        std::unique_lock<std::mutex> lk(mu_);
+        for (;;) {
+            cv_.wait(lk, [this] { return stop_ || !q_.empty(); });
+            if (stop_)
+                return;
+            auto [task, queued] = std::move(q_.front());
+            q_.pop_front();
+            wait_us_ += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - queued)
+                            .count();
+            ++done_;
+            lk.unlock();
+            task();
+            lk.lock();
+        }
+    }
 
-    bool ok = sqlite3_step(st) == SQLITE_DONE;
-    sqlite3_finalize(st);
-    return ok;
-}
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::deque<std::pair<Task, std::chrono::steady_clock::time_point>> q_;
+    std::vector<std::thread> th_;
+    bool stop_ = false;
+    size_t hw_ = 0;
+    unsigned long long done_ = 0, rejected_ = 0, wait_us_ = 0;
+};
+AuthPool g_auth;
+
+void rehash_user(const std::string &u, const std::string &p);
+
+// ── 只读连接池：history、元数据、搜索、取凭据等读查询都在这里执行
+/* ===========================================================
+ * WAL 下每条连接读各自的快照，彼此之间、与写线程之间都不互相等待：
+ *   - 每个线程一条 SQLITE_OPEN_READONLY 连接和自己的语句缓存，任务拿到的 StmtCache 只属于本线程
+ *   - 任务可在任一线程上执行，结果由任务自己 post 回会话 strand（见 Session::on_reader）
+ *   - 慢查询（翻很早的历史、搜索）只占住一个池线程，不再挡网络线程和其他读
+ * 写线程 COMMIT 之后才执行 Done 回调，回调里再投递的读任务一定读得到刚提交的数据。
+ * =========================================================== */
+class ReadPool {
+  public:
+    using Task = std::function<void(StmtCache &)>;
+
+    bool start() {
+        for (unsigned i = 0; i < g_cfg.read_threads; ++i) {
+            sqlite3 *db = nullptr;
+            if (sqlite3_open_v2(DB_FILE, &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, nullptr) != SQLITE_OK) {
+                std::cerr << "只读连接池无法打开数据库\n";
+                sqlite3_close(db);
+                stop();
+                return false;
+            }
+            exec_sql("PRAGMA busy_timeout=3000;", db);
+            th_.emplace_back([this, db, i] { run(db, i); });
+        }
+        return true;
+    }
+    void submit(Task t) {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            if (stop_)
+                return;
+            q_.push_back({std::move(t), std::chrono::steady_clock::now()});
+            hw_ = std::max(hw_, q_.size());
+        }
+        cv_.notify_one();
+    }
+    // 排队中的任务直接丢弃：网络线程已停，结果也送不回去
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            stop_ = true;
+            q_.clear();
+        }
+        cv_.notify_all();
+        for (auto &t : th_)
+            t.join();
+        th_.clear();
+    }
+    size_t depth() {
+        std::lock_guard<std::mutex> lk(mu_);
+        return q_.size();
+    }
+    void dump(std::ostream &os) {
+        std::lock_guard<std::mutex> lk(mu_);
+        os << "── 只读连接池 ──\n  depth " << q_.size() << " (high-water " << hw_ << "), done " << done_
+           << ", avg wait " << std::fixed << std::setprecision(2) << (done_ ? wait_us_ / 1000.0 / done_ : 0.0)
+           << " ms\n";
+    }
 
-static sqlite3_stmt *ins_msg_stmt = nullptr;
-void insert_message(const std::string &sender,
-                    const std::string &receiver,
-                    const std::string &body) {
-    if (!ins_msg_stmt) {
-        sqlite3_prepare_v2(g_db,
-                           "INSERT INTO messages(sender,receiver,message) VALUES(?,?,?);",
-                           -1, &ins_msg_stmt, 0);
-    }
-    sqlite3_reset(ins_msg_stmt);
-    sqlite3_bind_text(ins_msg_stmt, 1, sender.c_str(), -1, SQLITE_STATIC);
-    sqlite3_bind_text(ins_msg_stmt, 2, receiver.c_str(), -1, SQLITE_STATIC);
-    sqlite3_bind_text(ins_msg_stmt, 3, body.c_str(), -1, SQLITE_STATIC);
-
-    // 按 100 条为批量阈值；也可以直接 BEGIN/COMMIT 每条，看场景
-    static int pending = 0;
-    if (pending == 0)
-        exec_sql("BEGIN;");
-    sqlite3_step(ins_msg_stmt);
-    if (++pending >= 100) {
-        exec_sql("COMMIT;");
-        pending = 0;
-    }
-}
-static sqlite3_stmt *ins_grp_msg_stmt = nullptr;
-int insert_group_message(int gid, const std::string &sender, const std::string &body) {
-    if (!ins_grp_msg_stmt) {
-        sqlite3_prepare_v2(g_db,
-                           "INSERT INTO group_messages(group_id,sender,message) VALUES(?,?,?);",
-                           -1, &ins_grp_msg_stmt, 0);
-    }
-    sqlite3_reset(ins_grp_msg_stmt);
-    sqlite3_bind_int(ins_grp_msg_stmt, 1, gid);
-    sqlite3_bind_text(ins_grp_msg_stmt, 2, sender.c_str(), -1, SQLITE_STATIC);
-    sqlite3_bind_text(ins_grp_msg_stmt, 3, body.c_str(), -1, SQLITE_STATIC);
-
-    exec_sql("BEGIN;");
-    sqlite3_step(ins_grp_msg_stmt);
-    exec_sql("COMMIT;");
+  private:
+    void run(sqlite3 *db, unsigned idx) {
+        StmtCache stmts;
+        stmts.attach(db, metrics::SqlReader);
+        SqliteStore<StmtCache>::attach_reader(&stmts);
+        std::unique_lock<std::mutex> lk(mu_);
+        for (;;) {
+            cv_.wait(lk, [this] { return stop_ || !q_.empty(); });
+            if (stop_)
+                break;
+            auto [task, queued] = std::move(q_.front());
+            q_.pop_front();
+            wait_us_ += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - queued)
+                            .count();
+            ++done_;
+            lk.unlock();
+            task(stmts);
+            lk.lock();
+        }
+        lk.unlock();
+        {
+            std::lock_guard<std::mutex> out(dump_mu_); // 各线程的统计不要交错打印
+            stmts.dump_stats(std::cout, ("reader " + std::to_string(idx)).c_str());
+        }
+        SqliteStore<StmtCache>::detach_reader();
+        stmts.clear();
+        sqlite3_close(db);
+    }
 
-    return (int)sqlite3_last_insert_rowid(g_db); // 返回 id 方便取 timestamp
+    std::mutex mu_, dump_mu_;
+    std::condition_variable cv_;
+    std::deque<std::pair<Task, std::chrono::steady_clock::time_point>> q_;
+    std::vector<std::thread> th_;
+    bool stop_ = false;
+    size_t hw_ = 0;
+    unsigned long long done_ = 0, wait_us_ = 0;
+};
+ReadPool g_reads;
+
+// ── SQLite 辅助：读路径，只能在 g_reads 的任务内调用
+struct Credentials {
+    std::array<unsigned char, SALT_LEN> salt;
+    std::array<unsigned char, HASH_LEN> hash;
+    unsigned iter = 0;
+};
+// 用户不存在返回 false
+bool load_credentials(StmtCache &db, std::string const &u, Credentials &c) {
+    auto st = db.get("SELECT salt,hash,iter FROM users WHERE username=?;");
+    sqlite3_bind_text(st, 1, u.c_str(), -1, SQLITE_STATIC);
+    if (st.step() != SQLITE_ROW)
+        return false;
+    const void *salt_blob = sqlite3_column_blob(st, 0);
+    const void *hash_blob = sqlite3_column_blob(st, 1);
+    if (!salt_blob || !hash_blob)
+        return false;
+    std::memcpy(c.salt.data(), salt_blob, SALT_LEN);
+    std::memcpy(c.hash.data(), hash_blob, HASH_LEN);
+    c.iter = (unsigned)sqlite3_column_int(st, 2);
+    return true;
 }
-bool user_in_group(int gid, std::string const &u) {
-    sqlite3_stmt *st;
-    sqlite3_prepare_v2(g_db,
-                       "SELECT 1 FROM group_members WHERE group_id=? AND username=?;",
-                       -1, &st, 0);
-    sqlite3_bind_int(st, 1, gid);
-    sqlite3_bind_text(st, 2, u.c_str(), -1, SQLITE_STATIC);
-    bool ok = sqlite3_step(st) == SQLITE_ROW;
-    sqlite3_finalize(st);
+// 在认证线程上调用：凭据已由只读连接池取出，这里只做哈希计算
+bool verify_user(const std::string &u, const std::string &p, Credentials const &c) {
+    auto hash_in = hash_password(c.salt, p, c.iter);
+    bool ok = CRYPTO_memcmp(hash_in.data(), c.hash.data(), HASH_LEN) == 0;
+    if (ok && c.iter != g_cfg.kdf_iter) // 旧算法或旧强度：趁有明文密码时升级
+        rehash_user(u, p);
     return ok;
 }
-bool is_owner(int gid, std::string const &u) {
-    sqlite3_stmt *st;
-    sqlite3_prepare_v2(g_db,
-                       "SELECT is_owner FROM group_members WHERE group_id=? AND username=?;",
-                       -1, &st, 0);
+
+bool is_owner(StmtCache &db, int gid, std::string const &u) {
+    auto st = db.get("SELECT is_owner FROM group_members WHERE group_id=? AND username=?;");
     sqlite3_bind_int(st, 1, gid);
     sqlite3_bind_text(st, 2, u.c_str(), -1, SQLITE_STATIC);
     bool owner = false;
-    if (sqlite3_step(st) == SQLITE_ROW)
+    if (st.step() == SQLITE_ROW)
         owner = sqlite3_column_int(st, 0) != 0;
-    sqlite3_finalize(st);
     return owner;
 }
+json query_group_members(StmtCache &db, int gid) {
+    json members = json::array();
 
-static sqlite3_stmt *ins_mem_stmt = nullptr;
-bool insert_group_member(int gid, const std::string &user, bool owner_flag) {
-    if (!ins_mem_stmt) {
-        sqlite3_prepare_v2(g_db,
-                           "INSERT OR IGNORE INTO group_members(group_id,username,is_owner)"
-                           " VALUES(?,?,?);",
-                           -1, &ins_mem_stmt, nullptr);
+    auto st = db.get("SELECT username,is_owner FROM group_members WHERE group_id=?;");
+    sqlite3_bind_int(st, 1, gid);
+
+    while (st.step() == SQLITE_ROW) {
+        members.push_back({{"username", reinterpret_cast<const char *>(sqlite3_column_text(st, 0))},
+                           {"is_owner", sqlite3_column_int(st, 1) != 0}});
     }
-    sqlite3_reset(ins_mem_stmt);
-    sqlite3_bind_int(ins_mem_stmt, 1, gid);
-    sqlite3_bind_text(ins_mem_stmt, 2, user.c_str(), -1, SQLITE_STATIC);
-    sqlite3_bind_int(ins_mem_stmt, 3, owner_flag ? 1 : 0);
+    return members;
+}
 
-    exec_sql("BEGIN;");
-    sqlite3_step(ins_mem_stmt);
-    exec_sql("COMMIT;");
+// ────────── 最近消息环形缓存 ──────────
+/* ===========================================================
+ * 大厅、每个群、每对私聊各一个环（对应 chat_messages 的一个会话），保留最近 history_ring 条：
+ *   - 第一次访问时从 SQLite 装载，之后由写线程在 COMMIT 后追加
+ *   - 登录历史、点开群聊、向上翻页只要环能覆盖就不碰数据库
+ *   - 覆盖不到（翻得比环更早）才按 before_id 游标回落到 SQLite，
+ *     每个会话一次 (conversation_id, id) 索引区间读
+ * 私聊环与私聊对象集合随用户的最后一个会话注销而丢掉（forget），内存只随在线用户增长；
+ * 大厅与群的环个数有限，一直保留。
+ * 读库的入口都带调用方（g_reads 的任务）的 StmtCache。装载时读库不持有 mu_：
+ * 先把环标成 loading，期间提交的消息照常 push 进来，读完再在锁内逐条 push 合并（按 id 去重）
+ * =========================================================== */
+struct HistMsg {
+    long long id;
+    std::string sender, body, ts; // body：大厅 / 私聊为显示行，群消息为原文
+};
+
+class HistoryCache {
+    struct Ring {
+        bool loaded = false;
+        bool loading = false;  // 正在锁外读库，on_* 照常往里 push
+        bool complete = false; // 环里已是该会话的全部消息
+        std::deque<HistMsg> q; // 旧 → 新
+
+        void push(HistMsg m) {
+            // 通常追加在末尾；集群模式下别的节点的提交可能晚到，按 id 插回原位
+            auto it = q.end();
+            while (it != q.begin() && std::prev(it)->id >= m.id)
+                --it;
+            if (it != q.end() && it->id == m.id)
+                return; // 装载时已经读到
+            if (it == q.begin() && q.size() >= g_cfg.history_ring)
+                return; // 比环里最旧的还旧，留给 SQLite
+            q.insert(it, std::move(m));
+            if (q.size() > g_cfg.history_ring) {
+                q.pop_front();
+                complete = false;
+            }
+        }
+        // 取 id < before 的最新 limit 条（新 → 旧）；环覆盖不到返回 false
+        bool page(long long before, size_t limit, std::vector<HistMsg> &out) const {
+            size_t n = 0;
+            for (auto it = q.rbegin(); it != q.rend() && n < limit; ++it)
+                if (it->id < before) {
+                    out.push_back(*it);
+                    ++n;
+                }
+            return n == limit || complete;
+        }
+    };
 
-    /* 插入成功时 sqlite3_changes(g_db) == 1 */
-    return sqlite3_changes(g_db) == 1;
+  public:
+    static constexpr long long NO_CURSOR = std::numeric_limits<long long>::max();
+
+    // 大厅 + 与 user 相关的私聊，按 id 倒序
+    std::vector<HistMsg> user_page(StmtCache &db, std::string const &user, long long before, size_t limit) {
+        std::vector<HistMsg> out;
+        std::set<std::string> dm_peers;
+        if (!g_legacy_pending) {
+            dm_peers = peers(db, user);
+            ensure([this](bool) { return &lobby_; }, [] { return schema::LOBBY_CONV; }, lobby_fmt);
+            bool hit;
+            {
+                std::lock_guard<std::mutex> lk(mu_);
+                hit = lobby_.loaded && lobby_.page(before, limit, out);
+            }
+            for (auto &peer : dm_peers) {
+                if (!hit)
+                    break;
+                std::string key = dm_key(user, peer);
+                ensure([this, &key](bool create) { return slot(dms_, key, create); },
+                       [&db, &user, &peer] { return dm_conv(db, user, peer); }, dm_fmt{user, peer});
+                std::lock_guard<std::mutex> lk(mu_);
+                auto it = dms_.find(key);
+                hit = it != dms_.end() && it->second.loaded && it->second.page(before, limit, out);
+            }
+            if (hit) {
+                std::sort(out.begin(), out.end(), [](auto &a, auto &b) { return a.id > b.id; });
+                if (out.size() > limit)
+                    out.resize(limit);
+                return out;
+            }
+        }
+        // 大厅与每个私聊会话各取一页再归并
+        out.clear();
+        if (g_legacy_pending)
+            dm_peers = peers_now(db, user);
+        read_page(schema::LOBBY_CONV, before, limit, out, lobby_fmt);
+        for (auto &peer : dm_peers)
+            if (long long conv = dm_conv(db, user, peer))
+                read_page(conv, before, limit, out, dm_fmt{user, peer});
+        std::sort(out.begin(), out.end(), [](auto &a, auto &b) { return a.id > b.id; });
+        if (out.size() > limit)
+            out.resize(limit);
+        return out;
+    }
+    std::vector<HistMsg> group_page(StmtCache &db, int gid, long long before, size_t limit) {
+        std::vector<HistMsg> out;
+        if (!g_legacy_pending) {
+            ensure([this, gid](bool create) { return slot(groups_, gid, create); },
+                   [&db, gid] { return group_conv(db, gid); }, group_fmt);
+            std::lock_guard<std::mutex> lk(mu_);
+            auto it = groups_.find(gid);
+            if (it != groups_.end() && it->second.loaded && it->second.page(before, limit, out))
+                return out;
+        }
+        out.clear();
+        if (long long conv = group_conv(db, gid))
+            read_page(conv, before, limit, out, group_fmt);
+        return out;
+    }
+
+    // 丢掉所有环，之后按需从 SQLite 重新装载（集群节点断线期间可能漏收别的节点的提交）
+    void clear() {
+        std::lock_guard<std::mutex> lk(mu_);
+        lobby_ = {};
+        dms_.clear();
+        groups_.clear();
+        peers_.clear();
+        ++gen_; // 还在读库的装载作废
+    }
+    // user 在本节点的最后一个会话注销：丢掉它的私聊对象集合与私聊环（对方还在线的话，下次翻历史时重新装载）
+    void forget(std::string const &user) {
+        std::lock_guard<std::mutex> lk(mu_);
+        auto it = peers_.find(user);
+        if (it == peers_.end())
+            return;
+        for (auto &peer : it->second.set)
+            dms_.erase(dm_key(user, peer));
+        peers_.erase(it);
+    }
+
+    // 以下由写线程在 COMMIT 之后调用（集群模式下也由总线转来别的节点的提交）；
+    // 环还没开始装载就不管，装载时自然会读到
+    void on_message(std::string const &sender, std::string const &receiver, HistMsg m) {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (receiver == "all") {
+            if (lobby_.loaded || lobby_.loading)
+                lobby_.push(std::move(m));
+            return;
+        }
+        auto add_peer = [this](std::string const &u, std::string const &peer) {
+            auto it = peers_.find(u);
+            if (it != peers_.end()) // 没装载过的用户等用到时再查
+                it->second.set.insert(peer);
+        };
+        add_peer(sender, receiver);
+        add_peer(receiver, sender);
+        auto it = dms_.find(dm_key(sender, receiver));
+        if (it != dms_.end() && (it->second.loaded || it->second.loading))
+            it->second.push(std::move(m));
+    }
+    void on_group_message(int gid, HistMsg m) {
+        std::lock_guard<std::mutex> lk(mu_);
+        auto it = groups_.find(gid);
+        if (it != groups_.end() && (it->second.loaded || it->second.loading))
+            it->second.push(std::move(m));
+    }
+
+  private:
+    static std::string dm_key(std::string const &a, std::string const &b) {
+        return a < b ? a + '\n' + b : b + '\n' + a;
+    }
+    // 以下读库的函数只能在 g_reads 的任务内调用
+
+    // 行 → HistMsg.body 的格式：大厅、私聊拼成显示行，群消息保持原文
+    static std::string lobby_fmt(std::time_t t, std::string const &sender, std::string const &text) {
+        return lobby_line(t, sender, text);
+    }
+    static std::string group_fmt(std::time_t, std::string const &, std::string const &text) { return text; }
+    struct dm_fmt {
+        std::string const &a, &b;
+        std::string operator()(std::time_t t, std::string const &sender, std::string const &text) const {
+            return dm_line(t, sender, sender == a ? b : a, text);
+        }
+    };
+    // 会话 conv 里 id < before 的最新 limit 条，按 id 倒序追加到 out
+    template <class Fmt>
+    static void read_page(long long conv, long long before, size_t limit, std::vector<HistMsg> &out, Fmt const &fmt) {
+        std::vector<StoredMsg> rows;
+        g_store->page(conv, before, limit, rows);
+        for (auto &m : rows)
+            out.push_back({m.id, m.sender, fmt(m.t, m.sender, m.body), utc_timestamp(m.t)});
+    }
+    // 会话 id；还没有过消息的私聊 / 群返回 0
+    static long long dm_conv(StmtCache &db, std::string const &a, std::string const &b) {
+        auto st = db.get("SELECT c.id FROM users a, users b, conversations c "
+                              "WHERE a.username = ?1 AND b.username = ?2 AND c.kind = 1"
+                              " AND c.user_a = MIN(a.id, b.id) AND c.user_b = MAX(a.id, b.id) AND c.group_id = 0;");
+        sqlite3_bind_text(st, 1, a.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_text(st, 2, b.c_str(), -1, SQLITE_STATIC);
+        return st.step() == SQLITE_ROW ? sqlite3_column_int64(st, 0) : 0;
+    }
+    static long long group_conv(StmtCache &db, int gid) {
+        auto st = db.get("SELECT id FROM conversations WHERE kind = 2 AND user_a = 0 AND user_b = 0 AND group_id = ?;");
+        sqlite3_bind_int(st, 1, gid);
+        return st.step() == SQLITE_ROW ? sqlite3_column_int64(st, 0) : 0;
+    }
+    // map 里 key 对应的环；create 为假时不存在返回 nullptr
+    template <class Map, class Key>
+    static Ring *slot(Map &map, Key const &key, bool create) {
+        if (create)
+            return &map[key];
+        auto it = map.find(key);
+        return it == map.end() ? nullptr : &it->second;
+    }
+    // 确保 at(true) 给出的环已装载：在锁外查会话 id（conv()）、读最新 history_ring 条，再在锁内合并。
+    // at 在持有 mu_ 时调用，每次重新查找：解锁期间 clear() / forget() 可能丢掉了环，
+    // 这时读到的作废（合并时用 at(false)，不把丢掉的环再建出来），本次请求回落到 SQLite
+    template <class At, class Conv, class Fmt>
+    void ensure(At at, Conv conv, Fmt const &fmt) {
+        unsigned gen;
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            Ring *r = at(true);
+            if (r->loaded)
+                return;
+            r->loading = true;
+            gen = gen_;
+        }
+        std::vector<HistMsg> rows;
+        if (long long c = conv())
+            read_page(c, NO_CURSOR, g_cfg.history_ring, rows, fmt);
+        std::lock_guard<std::mutex> lk(mu_);
+        Ring *r = at(false);
+        if (gen != gen_ || !r || !r->loading || r->loaded) // 作废，或别的读线程先装好了
+            return;
+        r->complete = rows.size() < g_cfg.history_ring; // 之后 push 挤掉最旧的会再清掉
+        for (auto it = rows.rbegin(); it != rows.rend(); ++it)
+            r->push(std::move(*it));
+        r->loaded = true;
+        r->loading = false;
+    }
+    // user 有过私聊的对象：私聊会话的两侧各走一个索引
+    static std::set<std::string> peers_now(StmtCache &db, std::string const &user) {
+        std::set<std::string> set;
+        auto st = db.get("SELECT u.username FROM users me JOIN conversations c ON c.kind = 1 AND c.user_a = me.id"
+                              " JOIN users u ON u.id = c.user_b WHERE me.username = ?1 "
+                              "UNION SELECT u.username FROM users me JOIN conversations c ON c.kind = 1 AND c.user_b = me.id"
+                              " JOIN users u ON u.id = c.user_a WHERE me.username = ?1;");
+        sqlite3_bind_text(st, 1, user.c_str(), -1, SQLITE_STATIC);
+        while (st.step() == SQLITE_ROW)
+            set.insert(reinterpret_cast<const char *>(sqlite3_column_text(st, 0)));
+        return set;
+    }
+    // 第一次用到时查库，之后由 on_message 维护。与 ensure 一样：先占位让 on_message 往里加，锁外查库再合并
+    std::set<std::string> peers(StmtCache &db, std::string const &user) {
+        unsigned gen;
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            Peers &p = peers_[user];
+            if (p.loaded)
+                return p.set;
+            gen = gen_;
+        }
+        auto set = peers_now(db, user);
+        std::lock_guard<std::mutex> lk(mu_);
+        auto it = peers_.find(user);
+        if (gen != gen_ || it == peers_.end())
+            return set;
+        it->second.set.insert(set.begin(), set.end());
+        it->second.loaded = true;
+        return it->second.set;
+    }
+
+    struct Peers {
+        bool loaded = false;
+        std::set<std::string> set;
+    };
+    std::mutex mu_;
+    unsigned gen_ = 0; // clear() 的次数
+    Ring lobby_;
+    std::unordered_map<std::string, Ring> dms_;
+    std::unordered_map<int, Ring> groups_;
+    std::unordered_map<std::string, Peers> peers_;
+};
+HistoryCache g_history;
+
+// ────────── 全文搜索 ──────────
+/* ===========================================================
+ * 一次请求按“窗口”取候选：FTS5 按 rowid 倒序走，攒够 search_window 条
+ * 可见的命中就停，按相关度排序分页。
+ *   - 搜索范围（大厅、自己的私聊、所在的群，或指定的一个群）先查成会话列表，
+ *     写进 MATCH 的 conv 列过滤（见 schema::conv_token）：FTS 只走范围内会话的命中，
+ *     别处再多的命中也不用逐行回表判断。代价只与窗口大小有关，不随总行数增长
+ *   - 可见性判断仍留在 WHERE 里兜底；会话多于 SEARCH_MAX_CONVS 时不写进 MATCH，只靠它过滤
+ *   - 相关度在窗口内自己算（BM25 的词频饱和 + 长度归一，平均长度取窗口内），
+ *     即在用户自己能看到的最新 search_window 条命中之间排序。
+ *     不用 FTS5 的 bm25()：它要先把每个词在全表的命中数数一遍，常见词在
+ *     百万行上就要几十上百毫秒；而词之间是 AND，窗口内每行都含全部关键词，
+ *     IDF 对排序本就不起作用
+ *   - 游标 "hi:off"：本窗口的 rowid 上界与窗口内偏移。上界固定后
+ *     窗口就固定，期间的新消息不会挤动正在翻的结果；0 表示已翻完
+ *   - 窗口翻完而还有更早的命中，接着取更早的窗口，直到凑满一页或没有更早的命中；
+ *     窗口里只有可见的命中，所以返回 next_cursor 时本页一定不空
+ * 即窗口内按相关度、窗口之间按时间由新到旧。
+ * =========================================================== */
+struct SearchHit {
+    long long id;
+    int kind; // schema::ConvKind
+    int gid;
+    std::string sender, receiver, body, ts;
+    double score = 0; // 越大越相关
+};
+struct SearchQuery {
+    std::string match;              // FTS5 查询串
+    std::vector<std::string> terms; // 小写后的关键词，算相关度用
+};
+struct SearchCursor {
+    long long hi = cmd::NO_CURSOR;
+    size_t offset = 0;
+
+    bool parse(std::string_view s) {
+        auto num = [](std::string_view t, long long &v) {
+            auto r = std::from_chars(t.data(), t.data() + t.size(), v);
+            return r.ec == std::errc{} && r.ptr == t.data() + t.size() && v >= 0;
+        };
+        auto colon = s.find(':');
+        long long h, off;
+        if (colon == std::string_view::npos || !num(s.substr(0, colon), h) || !num(s.substr(colon + 1), off))
+            return false;
+        hi = h, offset = size_t(off);
+        return true;
+    }
+    std::string str() const { return std::to_string(hi) + ':' + std::to_string(offset); }
+    bool done() const { return hi <= 0; }
+};
+
+// 用户输入转成 FTS5 查询：按空白切词，每个词作为带引号的短语（内部引号成对转义），
+// 词之间隐含 AND。trigram 下不足 3 个字的词匹配不到任何东西，match 留空并给出原因
+SearchQuery fts_query(std::string_view q, std::string &err) {
+    SearchQuery sq;
+    std::string &out = sq.match;
+    for (size_t i = 0; i < q.size();) {
+        while (i < q.size() && std::isspace((unsigned char)q[i]))
+            ++i;
+        size_t j = i;
+        while (j < q.size() && !std::isspace((unsigned char)q[j]))
+            ++j;
+        if (j == i)
+            break;
+        auto term = q.substr(i, j - i);
+        size_t chars = std::count_if(term.begin(), term.end(), [](char c) { return (c & 0xc0) != 0x80; });
+        if (chars < 3) {
+            err = "每个关键词至少 3 个字";
+            return {};
+        }
+        if (sq.terms.size() == 8) {
+            err = "关键词太多";
+            return {};
+        }
+        out += out.empty() ? "\"" : " \"";
+        for (char c : term)
+            out += c == '"' ? std::string("\"\"") : std::string(1, c);
+        out += '"';
+        auto &t = sq.terms.emplace_back(term);
+        std::transform(t.begin(), t.end(), t.begin(), [](unsigned char c) { return std::tolower(c); });
+        i = j;
+    }
+    if (out.empty())
+        err = "请输入关键词";
+    return sq;
 }
-static sqlite3_stmt *del_mem_stmt = nullptr;
-bool remove_group_member(int gid, const std::string &user) {
-    if (!del_mem_stmt) {
-        sqlite3_prepare_v2(g_db,
-                           "DELETE FROM group_members WHERE group_id=? AND username=?;",
-                           -1, &del_mem_stmt, nullptr);
+
+// 关键词在正文里出现的次数；与 trigram 分词器一致，只对 ASCII 不区分大小写
+size_t count_term(std::string_view body, std::string const &term) {
+    size_t n = 0;
+    for (size_t i = 0; i + term.size() <= body.size(); ++i) {
+        size_t k = 0;
+        while (k < term.size() && std::tolower((unsigned char)body[i + k]) == (unsigned char)term[k])
+            ++k;
+        if (k == term.size()) {
+            ++n;
+            i += k - 1;
+        }
     }
-    sqlite3_reset(del_mem_stmt);
-    sqlite3_bind_int(del_mem_stmt, 1, gid);
-    sqlite3_bind_text(del_mem_stmt, 2, user.c_str(), -1, SQLITE_STATIC);
+    return n;
+}
 
-    exec_sql("BEGIN;");
-    sqlite3_step(del_mem_stmt);
-    exec_sql("COMMIT;");
+// 窗口内的 BM25（k1 = 1.2，b = 0.75）；正文长度按字节计
+void score_hits(std::vector<SearchHit> &hits, std::vector<std::string> const &terms) {
+    if (hits.empty())
+        return;
+    double avg = 0;
+    for (auto &h : hits)
+        avg += double(h.body.size());
+    avg = std::max(1.0, avg / double(hits.size()));
+    for (auto &h : hits) {
+        double norm = 1.2 * (0.25 + 0.75 * double(h.body.size()) / avg);
+        for (auto &t : terms) {
+            double tf = double(count_term(h.body, t));
+            h.score += tf * 2.2 / (tf + norm);
+        }
+    }
+}
 
-    return sqlite3_changes(g_db) == 1;
+// 搜索范围：groups 为群 id 的 JSON 数组；lobby_dm 为假时只搜这些群
+struct SearchScope {
+    std::string user, groups;
+    bool lobby_dm = true;
+};
+
+// q.match 加上 scope 的会话过滤；scope 里一个会话都没有时返回空串（不可能有命中）
+std::string scoped_match(StmtCache &db, SearchQuery const &q, SearchScope const &scope) {
+    auto st = db.get("SELECT id FROM conversations"
+                     " WHERE kind = 2 AND user_a = 0 AND user_b = 0 AND group_id IN (SELECT value FROM json_each(?1)) "
+                     "UNION ALL SELECT 1 WHERE ?2 "
+                     "UNION ALL SELECT c.id FROM users me JOIN conversations c ON c.kind = 1 AND c.user_a = me.id"
+                     " WHERE ?2 AND me.username = ?3 "
+                     "UNION ALL SELECT c.id FROM users me JOIN conversations c ON c.kind = 1 AND c.user_b = me.id"
+                     " WHERE ?2 AND me.username = ?3;");
+    sqlite3_bind_text(st, 1, scope.groups.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int(st, 2, scope.lobby_dm);
+    sqlite3_bind_text(st, 3, scope.user.c_str(), -1, SQLITE_STATIC);
+    std::string convs;
+    size_t n = 0;
+    while (st.step() == SQLITE_ROW) {
+        if (++n > SEARCH_MAX_CONVS)
+            return q.match;
+        convs += (convs.empty() ? "conv:(\"" : " OR \"") + schema::conv_token(sqlite3_column_int64(st, 0)) + '"';
+    }
+    return convs.empty() ? std::string() : convs + ") AND (" + q.match + ')';
 }
-json query_group_members(int gid) {
-    sqlite3_stmt *st = nullptr;
-    json members = json::array();
 
-    sqlite3_prepare_v2(g_db,
-                       "SELECT username,is_owner FROM group_members WHERE group_id=?;",
-                       -1, &st, nullptr);
-    sqlite3_bind_int(st, 1, gid);
+// 一个窗口：cur 的上界以下、scope 内最新的 search_window 条命中（已按相关度排好）
+struct SearchWindow {
+    std::vector<SearchHit> hits;
+    long long max = 0, min = 0; // 窗口内命中的 rowid 范围
+    bool full = false;          // 命中数到了窗口上限：更早处可能还有
+};
+SearchWindow search_window(StmtCache &db, SearchQuery const &q, SearchScope const &scope, SearchCursor const &cur) {
+    SearchWindow w;
+    auto text = [](sqlite3_stmt *st, int i) {
+        auto p = reinterpret_cast<const char *>(sqlite3_column_text(st, i));
+        return p ? std::string(p) : std::string();
+    };
+    // FTS 按 rowid 倒序驱动（MATCH 里已带会话过滤），逐行回表取显示字段、兜底判断可见性，够 LIMIT 条就停
+    auto st = db.get("SELECT m.id, c.kind, c.group_id, s.username, r.username, m.body, m.created_at "
+                          "FROM chat_messages_fts f "
+                          "JOIN chat_messages m ON m.id = f.rowid "
+                          "JOIN conversations c ON c.id = m.conversation_id "
+                          "JOIN users s ON s.id = m.sender_id "
+                          "LEFT JOIN users r ON c.kind = 1 AND r.id = c.user_a + c.user_b - m.sender_id " // 私聊的另一方
+                          "WHERE chat_messages_fts MATCH ?1 AND f.rowid <= ?2 AND"
+                          " ((c.kind = 2 AND c.group_id IN (SELECT value FROM json_each(?3))) OR (?4 AND"
+                          "  (c.kind = 0 OR (SELECT id FROM users WHERE username = ?5) IN (c.user_a, c.user_b)))) "
+                          "ORDER BY f.rowid DESC LIMIT ?6;");
+    sqlite3_bind_text(st, 1, q.match.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(st, 2, cur.hi);
+    sqlite3_bind_text(st, 3, scope.groups.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int(st, 4, scope.lobby_dm);
+    sqlite3_bind_text(st, 5, scope.user.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(st, 6, (long long)g_cfg.search_window);
+    size_t n = 0;
+    for (; st.step() == SQLITE_ROW; ++n) {
+        long long id = sqlite3_column_int64(st, 0);
+        w.max = std::max(w.max, id);
+        w.min = n ? std::min(w.min, id) : id;
+        w.hits.push_back({id, sqlite3_column_int(st, 1), sqlite3_column_int(st, 2), text(st, 3), text(st, 4),
+                          text(st, 5), utc_timestamp(std::time_t(sqlite3_column_int64(st, 6)))});
+    }
+    w.full = n == g_cfg.search_window;
+    // 相关度相同（常见于同一句话反复出现）按新到旧
+    score_hits(w.hits, q.terms);
+    std::sort(w.hits.begin(), w.hits.end(), [](SearchHit const &a, SearchHit const &b) {
+        return a.score != b.score ? a.score > b.score : a.id > b.id;
+    });
+    return w;
+}
 
-    while (sqlite3_step(st) == SQLITE_ROW) {
-        members.push_back({{"username", reinterpret_cast<const char *>(sqlite3_column_text(st, 0))},
-                           {"is_owner", sqlite3_column_int(st, 1) != 0}});
+// 取一页结果：凑满 limit 条或没有更早的命中为止；next 置为下一页的游标，翻完时上界为 0
+std::vector<SearchHit> search_page(StmtCache &db, SearchQuery q, SearchScope const &scope, SearchCursor cur,
+                                   size_t limit, SearchCursor &next) {
+    std::vector<SearchHit> page;
+    next = {0, 0};
+    q.match = scoped_match(db, q, scope);
+    if (q.match.empty())
+        return page;
+    while (!cur.done() && page.size() < limit) {
+        auto w = search_window(db, q, scope, cur);
+        size_t take = std::min(limit - page.size(), w.hits.size() - std::min(cur.offset, w.hits.size()));
+        for (size_t k = 0; k < take; ++k)
+            page.push_back(std::move(w.hits[cur.offset + k]));
+        if (cur.offset + take < w.hits.size()) { // 停在窗口中间：上界收紧到窗口实际范围，下次取回同一个窗口
+            next = {w.max, cur.offset + take};
+            break;
+        }
+        cur = {w.full ? w.min - 1 : 0, 0};
+        next = cur;
     }
-    sqlite3_finalize(st);
-    return members;
+    return page;
+}
+
+// ── 写路径：全部经 g_writer 异步执行，结果通过回调（在写线程上）返回
+// register_user / rehash_user 含哈希计算，应在认证线程上调用
+void register_user(const std::string &u, const std::string &p, std::function<void(bool)> cb) {
+    auto salt = gen_salt();
+    unsigned iter = g_cfg.kdf_iter;
+    auto hash = hash_password(salt, p, iter);
+    g_writer.submit([u, salt, hash, iter, cb = std::move(cb)](StmtCache &db) -> DbWriter::Done {
+        auto st = db.get("INSERT OR IGNORE INTO users(username,salt,hash,iter) VALUES(?,?,?,?);");
+        sqlite3_bind_text(st, 1, u.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_blob(st, 2, salt.data(), SALT_LEN, SQLITE_STATIC);
+        sqlite3_bind_blob(st, 3, hash.data(), HASH_LEN, SQLITE_STATIC);
+        sqlite3_bind_int(st, 4, (int)iter);
+        bool ok = st.step() == SQLITE_DONE && sqlite3_changes(db.db()) == 1; // 重名时被 IGNORE
+        return [cb, ok](bool committed) { cb(ok && committed); };
+    });
+}
+void rehash_user(const std::string &u, const std::string &p) {
+    auto salt = gen_salt();
+    unsigned iter = g_cfg.kdf_iter;
+    auto hash = hash_password(salt, p, iter);
+    g_writer.submit([u, salt, hash, iter](StmtCache &db) -> DbWriter::Done {
+        auto st = db.get("UPDATE users SET salt=?,hash=?,iter=? WHERE username=?;");
+        sqlite3_bind_blob(st, 1, salt.data(), SALT_LEN, SQLITE_STATIC);
+        sqlite3_bind_blob(st, 2, hash.data(), HASH_LEN, SQLITE_STATIC);
+        sqlite3_bind_int(st, 3, (int)iter);
+        sqlite3_bind_text(st, 4, u.c_str(), -1, SQLITE_STATIC);
+        st.step();
+        return nullptr;
+    });
+}
+
+// 以下 *_now 同步执行，只能在写线程的 job 内调用；找不到返回 0
+static long long user_id_now(StmtCache &db, std::string const &name) {
+    auto st = db.get("SELECT id FROM users WHERE username=?;");
+    sqlite3_bind_text(st, 1, name.c_str(), -1, SQLITE_STATIC);
+    return st.step() == SQLITE_ROW ? sqlite3_column_int64(st, 0) : 0;
+}
+// 会话 id，没有就建；私聊两端按 id 排序，同一对用户只有一个会话
+static long long conv_id_now(StmtCache &db, schema::ConvKind kind, long long a, long long b, long long gid) {
+    if (a > b)
+        std::swap(a, b);
+    auto run = [&](char const *sql) {
+        auto st = db.get(sql);
+        sqlite3_bind_int(st, 1, kind);
+        sqlite3_bind_int64(st, 2, a);
+        sqlite3_bind_int64(st, 3, b);
+        sqlite3_bind_int64(st, 4, gid);
+        return st.step() == SQLITE_ROW ? sqlite3_column_int64(st, 0) : 0;
+    };
+    char const *find = "SELECT id FROM conversations WHERE kind=? AND user_a=? AND user_b=? AND group_id=?;";
+    if (long long id = run(find))
+        return id;
+    // 集群的其他节点可能同时建了同一个会话：IGNORE 后再查一次
+    run("INSERT OR IGNORE INTO conversations(kind,user_a,user_b,group_id) VALUES(?,?,?,?);");
+    return run(find);
+}
+static long long insert_chat_now(long long conv, long long sender_id, std::string const &sender,
+                                 std::string const &text, std::time_t t) {
+    return g_store->append(conv, sender_id, sender, text, t);
+}
+
+// 消息回调参数：行 id 与写入时间戳（格式同 CURRENT_TIMESTAMP）；没能入库时 id 为 0
+using MsgCallback = std::function<void(long long id, std::string const &ts)>;
+
+// receiver 为 "all" 是大厅，否则是私聊；text 为用户输入的原文，t 为显示行里用的时间。
+// 发给不存在的用户的私聊不入库（本来也投递不到）
+void insert_message(const std::string &sender,
+                    const std::string &receiver,
+                    const std::string &text,
+                    std::time_t t,
+                    MsgCallback cb = nullptr) {
+    g_writer.submit([sender, receiver, text, t, cb = std::move(cb)](StmtCache &db) -> DbWriter::Done {
+        long long from = user_id_now(db, sender), conv = schema::LOBBY_CONV;
+        if (receiver != "all") {
+            long long to = user_id_now(db, receiver);
+            conv = to ? conv_id_now(db, schema::Dm, from, to, 0) : 0;
+        }
+        long long id = from && conv ? insert_chat_now(conv, from, sender, text, t) : 0;
+        if (!id)
+            return nullptr;
+        return [sender, receiver, text, t, cb, id](bool committed) {
+            if (!committed)
+                return;
+            std::string body = receiver == "all" ? lobby_line(t, sender, text) : dm_line(t, sender, receiver, text);
+            std::string ts = utc_timestamp(t);
+            g_history.on_message(sender, receiver, {id, sender, body, ts});
+            cluster_publish({{"type", "hist"}, {"sender", sender}, {"receiver", receiver}, {"id", id}, {"body", body},
+                             {"ts", ts}});
+            if (cb)
+                cb(id, ts);
+        };
+    });
+}
+void insert_group_message(int gid, const std::string &sender, const std::string &body,
+                          MsgCallback cb) {
+    g_writer.submit([gid, sender, body, cb = std::move(cb)](StmtCache &db) -> DbWriter::Done {
+        std::time_t t = std::time(nullptr);
+        long long from = user_id_now(db, sender);
+        long long conv = from ? conv_id_now(db, schema::Group, 0, 0, gid) : 0;
+        long long id = conv ? insert_chat_now(conv, from, sender, body, t) : 0;
+        return [gid, sender, body, cb, id, ts = utc_timestamp(t)](bool committed) {
+            if (!id || !committed) {
+                cb(0, ts);
+                return;
+            }
+            g_history.on_group_message(gid, {id, sender, body, ts});
+            cb(id, ts);
+        };
+    });
+}
+
+// 同步执行，只能在写线程的 job 内调用
+static bool insert_group_member_now(StmtCache &db, int gid, const std::string &user, bool owner_flag) {
+    auto st = db.get("INSERT OR IGNORE INTO group_members(group_id,username,is_owner) VALUES(?,?,?);");
+    sqlite3_bind_int(st, 1, gid);
+    sqlite3_bind_text(st, 2, user.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int(st, 3, owner_flag ? 1 : 0);
+    st.step();
+    /* 插入成功时 sqlite3_changes(db) == 1 */
+    return sqlite3_changes(db.db()) == 1;
+}
+void insert_group_member(int gid, const std::string &user, bool owner_flag,
+                         std::function<void(bool)> cb) {
+    g_writer.submit([gid, user, owner_flag, cb = std::move(cb)](StmtCache &db) -> DbWriter::Done {
+        bool ok = insert_group_member_now(db, gid, user, owner_flag);
+        return [cb, ok](bool committed) { cb(ok && committed); };
+    });
+}
+void remove_group_member(int gid, const std::string &user, std::function<void(bool)> cb) {
+    g_writer.submit([gid, user, cb = std::move(cb)](StmtCache &db) -> DbWriter::Done {
+        auto st = db.get("DELETE FROM group_members WHERE group_id=? AND username=?;");
+        sqlite3_bind_int(st, 1, gid);
+        sqlite3_bind_text(st, 2, user.c_str(), -1, SQLITE_STATIC);
+        st.step();
+        bool ok = sqlite3_changes(db.db()) == 1;
+        return [cb, ok](bool committed) { cb(ok && committed); };
+    });
+}
+// 建群 + 群主入群放在同一个 job 里，回调给出新群 id（失败为 -1）
+void create_group(const std::string &name, const std::string &owner, std::function<void(int)> cb) {
+    g_writer.submit([name, owner, cb = std::move(cb)](StmtCache &db) -> DbWriter::Done {
+        int gid = -1;
+        {
+            auto st = db.get("INSERT INTO groups(name,owner) VALUES(?,?);");
+            sqlite3_bind_text(st, 1, name.c_str(), -1, SQLITE_STATIC);
+            sqlite3_bind_text(st, 2, owner.c_str(), -1, SQLITE_STATIC);
+            if (st.step() == SQLITE_DONE)
+                gid = (int)sqlite3_last_insert_rowid(db.db());
+        }
+        if (gid >= 0)
+            insert_group_member_now(db, gid, owner, /*owner_flag=*/true);
+        return [cb, gid](bool committed) { cb(committed ? gid : -1); };
+    });
 }
 
 // ─────────────────────── Session ───────────────────────
+// 每个 Session 的 socket 绑定在独立 strand 上：自身的读写回调天然串行，
+// 其他线程要操作它时一律 post 到 ws_.get_executor()
+// 对象本身、读缓冲、发送 / 保留队列都从 slab 分配；空闲时只留 beast 每次读预备的一小块
 class Session : public std::enable_shared_from_this<Session> {
-    ws::stream<tcp::socket> ws_;
-    boost::beast::flat_buffer buf_;
+    template <class T>
+    using SlabDeque = boost::container::deque<T, slab::Allocator<T>>; // 默认构造不分配
+    template <class T>
+    using SlabVector = std::vector<T, slab::Allocator<T>>;
+    static constexpr size_t READ_BUF_KEEP = 4096; // 读缓冲超过这个容量，消息处理完就缩回
+
+    ws::stream<CountingSocket> ws_;
+    boost::beast::basic_flat_buffer<slab::Allocator<char>> buf_;
+    boost::beast::http::request<boost::beast::http::string_body> req_; // 握手请求，取 query 参数
+    bool batch_ = false; // 握手带 ?batch=1：允许把排队的多帧打包成一条 batch 消息
+    Proto proto_ = Proto::Json;
     std::string username_;
-
-    // 发送队列
-    std::deque<std::string> write_q_;
-
-    // 启动真正写
+    std::set<int> groups_; // 所在群组，与 g_group_online 一起由 g_sessions_mu 保护
+
+    // 发送队列：队首是正在写的帧，其余等待；f 为空表示合并后的占位帧，轮到时再生成内容
+    struct Outgoing {
+        Frame f;
+        Stream stream;
+        size_t skipped = 0; // Chat 占位帧：合并掉的消息数
+        uint64_t seq = 0;   // 续传序号（按流编号）；0 表示不编号
+    };
+    SlabDeque<Outgoing> write_q_;
+    size_t q_bytes_ = 0;
+    size_t inflight_ = 0; // 队首正在被 async_write 引用的帧数，写完前不能动
+    bool dead_ = false;   // 写失败或因慢被断开，之后的帧直接丢弃
+    // batch 写的拼接件：帧本身零拷贝引用，只有纯文本帧需要转义成 JSON 字符串
+    SlabVector<std::string> escaped_;
+    SlabVector<boost::asio::const_buffer> gather_;
+    std::string batch_len_; // MessagePack batch 的数组长度头
+    std::string scan_buf_;  // 入站命令里带转义的字符串解码到这里，容量复用
+
+    // 断线续传（握手带 ?resume=1）
+    /* ===========================================================
+     * 三条流各自从 1 开始编号；每次写出都套 batch 信封，信封的 seq 字段
+     * 给出各流已送出的最大序号，客户端记下最后一次收到的即可。
+     * 最近 resume_msgs 帧（共享 Frame，不拷贝内容）留在 retain_ 里。
+     * 断线后会话不注销，而是以 token 登记进 g_parked 保留 resume_grace_ms：
+     * 期间照常收帧（只进 retain_，用户仍算在线）。新连接凭 token 接管，
+     * 只补发客户端 seq 之后的帧；窗口覆盖不到的流才回落到查库全量推送。
+     * =========================================================== */
+    struct Retained {
+        Stream stream;
+        uint64_t seq;
+        Frame f;
+    };
+    bool resume_ = false;
+    std::string token_;             // 登录后分配，接管时原样沿用
+    uint64_t seq_[3] = {};          // 各流已分配的最大序号
+    uint64_t sent_seq_[3] = {};     // 各流已交给 socket 的最大序号，写进信封
+    uint64_t evicted_seq_[3] = {};  // 各流被挤出保留窗口的最大序号：客户端落后于此就补不全
+    SlabDeque<Retained> retain_;
+    size_t retain_bytes_ = 0;
+    bool parked_ = false;
+    std::weak_ptr<Session> successor_; // 已被新连接接管：迟到的帧转交过去
+    bool resuming_ = false;            // 正在接管旧会话：新到的帧先攒着，补发完再入队
+    std::vector<std::pair<Frame, Stream>> held_;
+    std::string batch_head_; // 带 seq 的 batch 信封头，每次写前重新生成
+
+    // 超时：每个会话只有一个时间轮节点，按阶段复用
+    /* ===========================================================
+     * 登录前：login_timeout_ms 的总期限，到期直接断开；
+     * 登录后：心跳。收到数据只记下 tick（读路径不碰时间轮的锁），
+     *         节点到期时再看空闲了多久：够 ping_interval 发 ping，
+     *         够 idle_timeout 断开，否则按剩余时间重新挂上；
+     * 断线待续传：resume_grace_ms 后注销。
+     * =========================================================== */
+    TimerWheel::Node timer_;
+    uint64_t last_rx_ = 0;   // 最近一次收到数据（含 pong）的 tick
+    uint64_t last_ping_ = 0; // 最近一次发 ping 的 tick
+
+    // 本会话线路上的帧内容
+    std::string const &wire(Frame const &f) const { return f->as(proto_); }
+    // 占位帧在真正发送时才生成，内容总是最新的
+    void materialize(Outgoing &out) {
+        if (out.f)
+            return;
+        if (out.stream == Stream::Presence)
+            out.f = make_frame(users_list_json(), proto_);
+        else
+            out.f = make_frame(json{{"type", "notification"},
+                                    {"message", "网络拥塞，已跳过 " + std::to_string(out.skipped) + " 条消息，可向上翻阅历史"}},
+                               proto_);
+        q_bytes_ += wire(out.f).size();
+    }
+    // 启动真正写：未协商 batch 时一次一帧；否则把队列里现有的帧（受 batch_max_* 限制）
+    // 拼成 {"type":"batch","items":[...]} 一条消息，用分散缓冲区一次 async_write 发出
     void do_write() {
         if (write_q_.empty())
-            return;
+            return shed_write_scratch();
+        materialize(write_q_.front());
+        size_t n = 1, bytes = wire(write_q_.front().f).size();
+        if (batch_)
+            for (; n < write_q_.size() && n < g_cfg.batch_max_items; ++n) {
+                materialize(write_q_[n]);
+                if (bytes + wire(write_q_[n].f).size() > g_cfg.batch_max_bytes)
+                    break;
+                bytes += wire(write_q_[n].f).size();
+            }
+        inflight_ = n;
+        ++g_wq_stats.writes;
+        g_wq_stats.frames += n;
+        for (size_t i = 0; i < n; ++i)
+            if (write_q_[i].seq)
+                sent_seq_[(int)write_q_[i].stream] = write_q_[i].seq;
+
         auto self = shared_from_this();
-        ws_.text(true);
-        ws_.async_write(boost::asio::buffer(write_q_.front()),
-                        [self](boost::system::error_code ec, std::size_t) {
-                            if (!ec) {
-                                self->write_q_.pop_front();
-                                self->do_write();
-                            }
-                        });
-    }
-    // 投递文本（JSON 或普通）
-    void queue_text(std::string text) {
+        auto on_written = [self](boost::system::error_code ec, std::size_t) {
+            if (ec) {
+                self->kill();
+                self->write_q_.clear();
+                self->q_bytes_ = 0;
+                self->inflight_ = 0;
+                return;
+            }
+            for (; self->inflight_; --self->inflight_) {
+                self->q_bytes_ -= self->wire(self->write_q_.front().f).size();
+                self->write_q_.pop_front();
+            }
+            self->do_write();
+        };
+        ws_.binary(proto_ == Proto::MsgPack);
+        if (n == 1 && !resume_) { // 续传模式下单帧也套信封，客户端靠它拿到 seq
+            g_wq_stats.payload_bytes += bytes;
+            ws_.async_write(boost::asio::buffer(wire(write_q_.front().f)), std::move(on_written));
+            return;
+        }
+        gather_.clear();
+        if (proto_ == Proto::MsgPack)
+            gather_packed(n);
+        else
+            gather_text(n);
+        g_wq_stats.payload_bytes += boost::asio::buffer_size(gather_);
+        ws_.async_write(gather_, std::move(on_written));
+    }
+    // 队列写空：队列块与 batch 拼接件都还回 slab，空闲连接不背着上一批的峰值
+    void shed_write_scratch() {
+        decltype(write_q_)().swap(write_q_);
+        decltype(escaped_)().swap(escaped_);
+        decltype(gather_)().swap(gather_);
+    }
+    // 一条消息处理完：被大消息撑大的读缓冲与转义解码缓冲还回去
+    void shed_read_scratch() {
+        if (buf_.capacity() > READ_BUF_KEEP)
+            buf_.shrink_to_fit();
+        if (scan_buf_.capacity() > READ_BUF_KEEP)
+            std::string().swap(scan_buf_);
+    }
+    void gather_text(size_t n) {
+        static const std::string head = R"({"type":"batch","items":[)", comma = ",", tail = "]}";
+        escaped_.clear();
+        escaped_.reserve(n); // 先定容量，保证下面取到的 data() 不因扩容失效
+        if (resume_) {
+            batch_head_ = R"({"type":"batch","seq":[)" + std::to_string(sent_seq_[0]) + ',' +
+                          std::to_string(sent_seq_[1]) + ',' + std::to_string(sent_seq_[2]) + R"(],"items":[)";
+            gather_.push_back(boost::asio::buffer(batch_head_));
+        } else
+            gather_.push_back(boost::asio::buffer(head));
+        for (size_t i = 0; i < n; ++i) {
+            auto const &f = wire(write_q_[i].f);
+            if (i)
+                gather_.push_back(boost::asio::buffer(comma));
+            if (!f.empty() && f.front() == '{')
+                gather_.push_back(boost::asio::buffer(f));
+            else {
+                escaped_.push_back(dump_wire(json(f)));
+                gather_.push_back(boost::asio::buffer(escaped_.back()));
+            }
+        }
+        gather_.push_back(boost::asio::buffer(tail));
+    }
+    // MessagePack 版 batch：固定的 map 头 + 数组长度，后面直接接各帧的编码，纯文本帧本身已是 str
+    void gather_packed(size_t n) {
+        static const std::string head = "\x82\xa4" "type" "\xa5" "batch" "\xa5" "items";
+        batch_len_.clear();
+        if (n < 16)
+            batch_len_.push_back(char(0x90 | n));
+        else {
+            batch_len_ = {char(0xdd), char(n >> 24), char(n >> 16), char(n >> 8), char(n)};
+        }
+        if (resume_) {
+            batch_head_ = "\x83\xa4" "type" "\xa5" "batch" "\xa3" "seq";
+            auto seq = json::to_msgpack(json::array({sent_seq_[0], sent_seq_[1], sent_seq_[2]}));
+            batch_head_.append(seq.begin(), seq.end());
+            batch_head_ += "\xa5" "items";
+        }
+        gather_.push_back(boost::asio::buffer(resume_ ? batch_head_ : head));
+        gather_.push_back(boost::asio::buffer(batch_len_));
+        for (size_t i = 0; i < n; ++i)
+            gather_.push_back(boost::asio::buffer(wire(write_q_[i].f)));
+    }
+    // 投递共享帧，可从任意线程调用
+    void queue_frame(Frame f, Stream stream = Stream::Control) {
         auto self = shared_from_this();
         boost::asio::post(ws_.get_executor(),
-                          [self, txt = std::move(text)]() mutable {
-                              bool writing = !self->write_q_.empty();
-                              self->write_q_.push_back(std::move(txt));
-                              if (!writing)
-                                  self->do_write();
-                          });
+                          [self, f = std::move(f), stream]() mutable { self->enqueue(std::move(f), stream); });
+    }
+    // 以下在本会话 strand 上执行
+    // 续传模式下先编号、留档再入队；已被新连接接管则转交，正在接管则先攒着
+    void enqueue(Frame f, Stream stream) {
+        if (auto next = successor_.lock())
+            return next->queue_frame(std::move(f), stream);
+        if (resuming_) {
+            held_.emplace_back(std::move(f), stream);
+            return;
+        }
+        uint64_t seq = 0;
+        if (resume_) {
+            seq = ++seq_[(int)stream];
+            retain(f, stream, seq);
+        }
+        push(std::move(f), stream, seq);
+    }
+    void retain(Frame const &f, Stream stream, uint64_t seq) {
+        retain_bytes_ += wire(f).size();
+        retain_.push_back({stream, seq, f});
+        while (retain_.size() > g_cfg.resume_msgs || retain_bytes_ > g_cfg.resume_bytes) {
+            auto &r = retain_.front();
+            evicted_seq_[(int)r.stream] = r.seq;
+            retain_bytes_ -= wire(r.f).size();
+            retain_.pop_front();
+        }
+    }
+    // 进发送队列；断线后（dead_）帧只留在 retain_ 里
+    void push(Frame f, Stream stream, uint64_t seq) {
+        if (dead_)
+            return;
+        if (stream != Stream::Control &&
+            (write_q_.size() + 1 > g_cfg.wq_max_msgs || q_bytes_ + wire(f).size() > g_cfg.wq_max_bytes) &&
+            !make_room(wire(f), stream, seq)) {
+            // coalesce 可能刚放进一个占位帧：队列原本是空的（单帧就超过 wq_max_bytes）就没有写在进行，
+            // 得在这里启动，否则占位帧要等到下一帧入队才发出
+            if (inflight_ == 0 && !dead_)
+                do_write();
+            return;
+        }
+        bool writing = inflight_ > 0;
+        q_bytes_ += wire(f).size();
+        write_q_.push_back({std::move(f), stream, 0, seq});
+        WriteQueueStats::raise(g_wq_stats.hw_msgs, write_q_.size());
+        metrics::observe(metrics::WriteQueueDepth, write_q_.size());
+        WriteQueueStats::raise(g_wq_stats.hw_bytes, q_bytes_);
+        if (!writing)
+            do_write();
+    }
+    // 队列超限时按该流的策略腾位置；返回 false 表示新帧已被处理（丢弃 / 合并 / 断开），不用再入队
+    bool make_room(std::string const &f, Stream stream, uint64_t seq) {
+        auto policy = stream == Stream::Presence ? g_cfg.presence_policy : g_cfg.chat_policy;
+        int si = (int)stream;
+        auto fits = [&] {
+            return write_q_.size() + 1 <= g_cfg.wq_max_msgs && q_bytes_ + f.size() <= g_cfg.wq_max_bytes;
+        };
+        switch (policy) {
+        case SlowPolicy::Disconnect:
+            ++g_wq_stats.slow_disconnects;
+            kill();
+            return false;
+        case SlowPolicy::DropOldest:
+            // 正在写的帧不能动；从其后开始丢同一条流里最旧的
+            for (auto it = write_q_.begin() + inflight_; it != write_q_.end() && !fits();) {
+                if (it->stream != stream || !it->f) {
+                    ++it;
+                    continue;
+                }
+                q_bytes_ -= wire(it->f).size();
+                it = write_q_.erase(it);
+                ++g_wq_stats.dropped[si];
+            }
+            if (fits())
+                return true;
+            ++g_wq_stats.dropped[si]; // 腾不出来就丢新的
+            return false;
+        case SlowPolicy::Coalesce: {
+            // 同一条流排队中的帧全部换成一个占位帧（已有占位帧则并入）；占位帧继承其中最大的序号
+            size_t skipped = 1;
+            for (auto it = write_q_.begin() + inflight_; it != write_q_.end();) {
+                if (it->stream != stream) {
+                    ++it;
+                    continue;
+                }
+                seq = std::max(seq, it->seq);
+                if (!it->f) {
+                    skipped += it->skipped;
+                    it = write_q_.erase(it);
+                    continue;
+                }
+                q_bytes_ -= wire(it->f).size();
+                it = write_q_.erase(it);
+                ++skipped;
+            }
+            g_wq_stats.coalesced[si] += skipped;
+            write_q_.push_back({nullptr, stream, skipped, seq});
+            return false;
+        }
+        }
+        return false;
+    }
+    // 关闭底层 socket：挂起的读写随之失败，读循环里走 on_close
+    void kill() {
+        if (dead_)
+            return;
+        dead_ = true;
+        boost::system::error_code ec;
+        boost::beast::get_lowest_layer(ws_).close(ec);
+        // 正在写的帧仍被 async_write 引用，留给写回调释放
+        while (write_q_.size() > inflight_) {
+            if (write_q_.back().f)
+                q_bytes_ -= wire(write_q_.back().f).size();
+            write_q_.pop_back();
+        }
+    }
+    // helpers：单播，内容只属于这一个会话
+    void queue_text(std::string text) { queue_frame(make_frame(std::move(text))); }
+    void queue_json(json const &j) { queue_frame(make_frame(j, proto_)); }
+
+    // 包装写线程回调：持有 self，并把执行切回本会话的 strand
+    template <class F>
+    auto on_strand(F f) {
+        return [self = shared_from_this(), f = std::move(f)](auto const &...args) {
+            boost::asio::post(self->ws_.get_executor(), [self, f, args...]() mutable { f(args...); });
+        };
+    }
+    // 在只读连接池上执行 query(StmtCache &) 得到结果，再把结果移交回本会话的 strand 上的 then
+    template <class Query, class Then>
+    void on_reader(Query query, Then then) {
+        g_reads.submit([self = shared_from_this(), query = std::move(query), then = std::move(then)](StmtCache &db) mutable {
+            boost::asio::post(self->ws_.get_executor(),
+                              [self, then = std::move(then), r = query(db)]() mutable { then(r); });
+        });
     }
-    // helpers
-    void queue_json(json const &j) { queue_text(j.dump()); }
 
   public:
-    explicit Session(tcp::socket sock) : ws_(std::move(sock)) {}
-    ws::stream<tcp::socket> &ws() { return ws_; }
+    explicit Session(tcp::socket sock) : ws_(std::move(sock)) {
+        ws_.read_message_max(g_cfg.max_msg_bytes);
+        ws_.control_callback([this](ws::frame_type kind, boost::beast::string_view) {
+            if (kind == ws::frame_type::pong)
+                touch();
+        });
+        if (g_cfg.deflate) {
+            ws::permessage_deflate pmd;
+            pmd.server_enable = true;
+            pmd.server_max_window_bits = g_cfg.deflate_window_bits;
+            pmd.server_no_context_takeover = g_cfg.deflate_no_context;
+            pmd.memLevel = g_cfg.deflate_mem_level;
+            pmd.compLevel = g_cfg.deflate_level;
+#if BOOST_VERSION >= 108000
+            pmd.msg_size_threshold = g_cfg.deflate_threshold;
+#endif
+            ws_.set_option(pmd);
+        }
+    }
+    ~Session() { g_wheel.cancel(timer_); }
+    ws::stream<CountingSocket> &ws() { return ws_; }
     std::string const &name() const { return username_; }
 
-    void push_json(const json &j) { queue_json(j); }
+    void push_frame(Frame f, Stream stream) { queue_frame(std::move(f), stream); }
 
     void start() {
-        ws_.async_accept([self = shared_from_this()](boost::system::error_code ec) {
-            if (!ec) {
-                self->ws_.text(true);
-                self->prompt_login();
-            }
-        });
+        timer_.owner = weak_from_this();
+        timer_.fire = on_wheel;
+        if (g_cfg.login_timeout_ms)
+            g_wheel.arm(timer_, g_wheel.ticks(std::chrono::milliseconds(g_cfg.login_timeout_ms)));
+        // 先自己读 HTTP 升级请求，拿到 query 参数再交给 websocket 握手
+        boost::beast::http::async_read(
+            ws_.next_layer(), buf_, req_, [self = shared_from_this()](boost::system::error_code ec, std::size_t) {
+                if (ec || !ws::is_upgrade(self->req_))
+                    return;
+                auto target = self->req_.target();
+                self->batch_ = query_param({target.data(), target.size()}, "batch") == "1";
+                if (query_param({target.data(), target.size()}, "proto") == "msgpack")
+                    self->proto_ = Proto::MsgPack;
+                // 续传的 seq 放在 batch 信封里，所以 resume 隐含 batch
+                self->resume_ = g_cfg.resume_grace_ms && query_param({target.data(), target.size()}, "resume") == "1";
+                self->batch_ |= self->resume_;
+                self->ws_.async_accept(self->req_, [self](boost::system::error_code ec) {
+                    if (!ec) {
+                        self->req_ = {};
+                        self->buf_.shrink_to_fit(); // HTTP 读时预备的空间
+                        self->ws_.text(true);
+                        self->prompt_login();
+                    }
+                });
+            });
     }
 
   private:
+    // 取握手 URL 里 ?a=1&b=2 形式的参数，没有则返回空
+    static std::string_view query_param(std::string_view target, std::string_view key) {
+        auto q = target.find('?');
+        if (q == std::string_view::npos)
+            return {};
+        for (auto rest = target.substr(q + 1); !rest.empty();) {
+            auto amp = std::min(rest.find('&'), rest.size());
+            auto kv = rest.substr(0, amp);
+            auto eq = kv.find('=');
+            if (kv.substr(0, eq) == key)
+                return eq == std::string_view::npos ? std::string_view{} : kv.substr(eq + 1);
+            rest.remove_prefix(std::min(amp + 1, rest.size()));
+        }
+        return {};
+    }
+
     // ——— 登录流程 ———
     void prompt_login() {
         static const std::string prompt =
@@ -383,8 +2302,23 @@ class Session : public std::enable_shared_from_this<Session> {
                        [self = shared_from_this()](boost::system::error_code ec, std::size_t) {
                            if (ec)
                                return;
-                           std::string msg = boost::beast::buffers_to_string(self->buf_.data());
-                           self->buf_.consume(self->buf_.size());
+                           std::string msg;
+                           json req; // 对象形式的请求：目前只有续传
+                           if (self->ws_.got_binary()) { // MessagePack 客户端把登录行编码成 str
+                               json j = self->take_packed();
+                               if (j.is_string())
+                                   msg = j.get<std::string>();
+                               else if (j.is_object())
+                                   req = std::move(j);
+                           } else {
+                               msg = boost::beast::buffers_to_string(self->buf_.data());
+                               self->buf_.consume(self->buf_.size());
+                               self->shed_read_scratch();
+                               if (!msg.empty() && msg.front() == '{')
+                                   req = json::parse(msg, nullptr, /*allow_exceptions=*/false);
+                           }
+                           if (req.is_object())
+                               return self->try_resume(req);
                            trim(msg);
 
                            // 注册
@@ -396,10 +2330,16 @@ class Session : public std::enable_shared_from_this<Session> {
                                    std::string u = msg.substr(0, pos), p = msg.substr(pos + 1);
                                    trim(u);
                                    trim(p);
-                                   if (register_user(u, p))
-                                       self->queue_text("注册成功！请登录。\n");
-                                   else
-                                       self->queue_text("注册失败，用户名已存在。\n");
+                                   auto done = self->on_strand([self](bool ok) {
+                                       if (ok)
+                                           self->queue_text("注册成功！请登录。\n");
+                                       else
+                                           self->queue_text("注册失败，用户名已存在。\n");
+                                       self->prompt_login();
+                                   });
+                                   if (!g_auth.submit([u, p, done] { register_user(u, p, done); }))
+                                       self->auth_busy();
+                                   return;
                                }
                                self->prompt_login();
                                return;
@@ -414,50 +2354,185 @@ class Session : public std::enable_shared_from_this<Session> {
                            std::string u = msg.substr(0, pos), p = msg.substr(pos + 1);
                            trim(u);
                            trim(p);
-                           if (!verify_user(u, p)) {
-                               self->queue_text("登录失败，请重新输入 user,pass：");
-                               self->read_login();
-                               return;
-                           }
-
-                           self->username_ = u;
-                           g_sessions.insert(self);
-                           self->queue_text("登录成功，欢迎 " + u + "\n");
-                           self->push_meta();
-                           self->send_history();
+                           // 只读连接池取凭据，认证线程算哈希，结果回到 strand
+                           auto done = self->on_strand([self, u](bool ok) { self->on_login(u, ok); });
+                           auto busy = self->on_strand([self] { self->auth_busy(); });
+                           g_reads.submit([u, p, done, busy](StmtCache &db) {
+                               Credentials c;
+                               if (!load_credentials(db, u, c))
+                                   return done(false);
+                               if (!g_auth.submit([u, p, c, done] { done(verify_user(u, p, c)); }))
+                                   busy();
+                           });
+                       });
+    }
+    void auth_busy() {
+        queue_text("服务器繁忙，请稍后重新输入 user,pass：");
+        read_login();
+    }
+    // 认证结果回到本会话 strand
+    void on_login(std::string const &u, bool ok) {
+        if (!ok) {
+            queue_text("登录失败，请重新输入 user,pass：");
+            read_login();
+            return;
+        }
 
-                           // 广播更新用户列表
-                           json uj = {{"type", "users_list"}, {"users", json::array()}};
-                           for (auto &s : g_sessions)
-                               uj["users"].push_back(s->name());
-                           broadcast_json(uj);
+        username_ = u;
+        // 先投递欢迎语再登记：保证它排在任何广播之前
+        queue_text("登录成功，欢迎 " + u + "\n");
+        if (resume_) {
+            token_ = new_token();
+            queue_json({{"type", "session"}, {"token", token_}});
+        }
+        auto self = shared_from_this();
+        bool first_tab, elsewhere;
+        {
+            std::lock_guard<std::mutex> lk(g_sessions_mu);
+            g_sessions.insert(self);
+            auto &tabs = g_users[u];
+            tabs.push_back(self);
+            first_tab = tabs.size() == 1;
+            elsewhere = remote_online_locked(u);
+        }
+        // 群列表与历史一起取回再开始读：之后收到的群消息按已建好的群索引校验
+        load_snapshot(true, true, [this, u, first_tab, elsewhere] {
+            // 其他人只收增量；快照里已给自己发了完整的在线列表
+            if (first_tab) {
+                cluster_publish({{"type", "up"}, {"user", u}});
+                if (!elsewhere) // 在别的节点已在线：对外没有变化
+                    g_presence.touch(u);
+            }
+            do_read();
+            touch();
+            heartbeat();
+        });
+    }
 
-                           self->do_read();
-                       });
+    static json users_list_json() {
+        json uj = {{"type", "users_list"}, {"users", json::array()}};
+        std::lock_guard<std::mutex> lk(g_sessions_mu);
+        for (auto &kv : g_users) // 同一用户多标签页只列一次
+            uj["users"].push_back(kv.first);
+        for (auto &kv : g_remote_users) // 集群里其他节点上的用户
+            if (!g_users.count(kv.first))
+                uj["users"].push_back(kv.first);
+        return uj;
     }
 
     // ——— 推送在线用户/群组列表 ———
+    struct Meta {
+        json groups_list;
+        std::set<int> gids;
+    };
+    // 只读连接池上执行
+    static Meta load_meta(StmtCache &db, std::string const &user) {
+        Meta m{{{"type", "groups_list"}, {"groups", json::array()}}, {}};
+        auto st = db.get("SELECT g.id,g.name,gm.is_owner "
+                         "FROM groups g JOIN group_members gm ON gm.group_id=g.id "
+                         "WHERE gm.username=?;");
+        sqlite3_bind_text(st, 1, user.c_str(), -1, SQLITE_STATIC);
+        while (st.step() == SQLITE_ROW) {
+            m.gids.insert(sqlite3_column_int(st, 0));
+            m.groups_list["groups"].push_back({{"id", sqlite3_column_int(st, 0)},
+                                               {"name", reinterpret_cast<const char *>(sqlite3_column_text(st, 1))},
+                                               {"is_owner", sqlite3_column_int(st, 2) != 0}});
+        }
+        return m;
+    }
+    void apply_meta(Meta &m) {
+        queue_json(users_list_json());
+        set_groups(std::move(m.gids)); // 登录时建立索引，之后每次刷新顺带校正
+        queue_json(m.groups_list);
+    }
     void push_meta() {
-        json uj = {{"type", "users_list"}, {"users", json::array()}};
-        for (auto &s : g_sessions)
-            uj["users"].push_back(s->name());
-        queue_json(uj);
-
-        json gl = {{"type", "groups_list"}, {"groups", json::array()}};
-        sqlite3_stmt *st;
-        sqlite3_prepare_v2(g_db,
-                           "SELECT g.id,g.name,gm.is_owner "
-                           "FROM groups g JOIN group_members gm ON gm.group_id=g.id "
-                           "WHERE gm.username=?;",
-                           -1, &st, 0);
-        sqlite3_bind_text(st, 1, username_.c_str(), -1, SQLITE_STATIC);
-        while (sqlite3_step(st) == SQLITE_ROW) {
-            gl["groups"].push_back({{"id", sqlite3_column_int(st, 0)},
-                                    {"name", reinterpret_cast<const char *>(sqlite3_column_text(st, 1))},
-                                    {"is_owner", sqlite3_column_int(st, 2) != 0}});
-        }
-        sqlite3_finalize(st);
-        queue_json(gl);
+        on_reader([u = username_](StmtCache &db) { return load_meta(db, u); }, [this](Meta &m) { apply_meta(m); });
+    }
+    // 登录 / 续传：元数据与第一页历史在同一个读任务里取，按原顺序发出后再执行 then
+    template <class Then>
+    void load_snapshot(bool meta, bool history, Then then) {
+        struct Snapshot {
+            Meta meta;
+            json history;
+        };
+        on_reader(
+            [u = username_, meta, history](StmtCache &db) {
+                Snapshot s;
+                if (meta)
+                    s.meta = load_meta(db, u);
+                if (history)
+                    s.history = history_json(db, u, HistoryCache::NO_CURSOR);
+                return s;
+            },
+            [this, meta, history, then = std::move(then)](Snapshot &s) mutable {
+                if (meta)
+                    apply_meta(s.meta);
+                if (history)
+                    queue_json(s.history);
+                then();
+            });
+    }
+    // ——— 在线群组索引：群消息的成员校验与扇出只查内存 ———
+    void set_groups(std::set<int> gids) {
+        auto self = shared_from_this();
+        std::lock_guard<std::mutex> lk(g_sessions_mu);
+        if (!g_sessions.count(self))
+            return; // 已断开，不能再挂回索引
+        for (int g : groups_)
+            if (!gids.count(g))
+                unindex_group(g, self);
+        for (int g : gids)
+            g_group_online[g].insert(self);
+        groups_ = std::move(gids);
+    }
+    // 以下两个需持有 g_sessions_mu
+    static void unindex_group(int gid, std::shared_ptr<Session> const &s) {
+        auto it = g_group_online.find(gid);
+        if (it == g_group_online.end())
+            return;
+        it->second.erase(s);
+        if (it->second.empty())
+            g_group_online.erase(it);
+    }
+    static void unindex_all(std::shared_ptr<Session> const &s) {
+        for (int g : s->groups_)
+            unindex_group(g, s);
+        s->groups_.clear();
+    }
+    // user 的所有在线会话加入 / 退出 gid
+    static void index_member(int gid, std::string const &user, bool joined) {
+        std::lock_guard<std::mutex> lk(g_sessions_mu);
+        auto it = g_users.find(user);
+        if (it == g_users.end())
+            return;
+        for (auto &s : it->second) {
+            if (joined) {
+                s->groups_.insert(gid);
+                g_group_online[gid].insert(s);
+            } else {
+                s->groups_.erase(gid);
+                unindex_group(gid, s);
+            }
+        }
+    }
+    static void publish_member(int gid, std::string const &user, bool joined) {
+        cluster_publish({{"type", "member"}, {"group_id", gid}, {"user", user}, {"joined", joined}});
+    }
+    bool in_group(int gid) const {
+        std::lock_guard<std::mutex> lk(g_sessions_mu);
+        return groups_.count(gid) != 0;
+    }
+    static std::vector<std::shared_ptr<Session>> group_online(int gid) {
+        std::lock_guard<std::mutex> lk(g_sessions_mu);
+        auto it = g_group_online.find(gid);
+        if (it == g_group_online.end())
+            return {};
+        return {it->second.begin(), it->second.end()};
+    }
+
+    // 在 s 自己的 strand 上刷新其元数据
+    static void push_meta_to(std::shared_ptr<Session> const &s) {
+        boost::asio::post(s->ws_.get_executor(), [s] { s->push_meta(); });
     }
 
     // ——— 公共历史 20 条 ———
@@ -466,30 +2541,19 @@ class Session : public std::enable_shared_from_this<Session> {
      *   1) receiver = 'all'              → 公共聊天
      *   2) sender   = <me>               → 我发出的私聊
      *   3) receiver = <me>               → 发给我的私聊
+     * 优先由 g_history 的环提供；before_id 给出时返回更早的一页
      * =========================================================== */
-    void send_history() {
+    static json history_json(StmtCache &db, std::string const &user, long long before_id) {
         json hist = {{"type", "history"}, {"messages", json::array()}};
-
-        sqlite3_stmt *st = nullptr;
-        const char *sql =
-            "SELECT sender, message, timestamp "
-            "FROM messages "
-            "WHERE receiver = 'all' "
-            "   OR sender   = ?1 "
-            "   OR receiver = ?1 "
-            "ORDER BY id DESC LIMIT 20;";
-
-        sqlite3_prepare_v2(g_db, sql, -1, &st, nullptr);
-        sqlite3_bind_text(st, 1, username_.c_str(), -1, SQLITE_STATIC);
-
-        while (sqlite3_step(st) == SQLITE_ROW) {
-            hist["messages"].push_back({{"sender", reinterpret_cast<const char *>(sqlite3_column_text(st, 0))},
-                                        {"raw", reinterpret_cast<const char *>(sqlite3_column_text(st, 1))},
-                                        {"time", reinterpret_cast<const char *>(sqlite3_column_text(st, 2))}});
-        }
-        sqlite3_finalize(st);
-
-        queue_json(hist);
+        if (before_id != HistoryCache::NO_CURSOR)
+            hist["before_id"] = before_id;
+        for (auto &m : g_history.user_page(db, user, before_id, HISTORY_PAGE))
+            hist["messages"].push_back({{"id", m.id}, {"sender", m.sender}, {"raw", m.body}, {"time", m.ts}});
+        return hist;
+    }
+    void send_history(long long before_id = HistoryCache::NO_CURSOR) {
+        on_reader([u = username_, before_id](StmtCache &db) { return history_json(db, u, before_id); },
+                  [this](json &hist) { queue_json(hist); });
     }
 
     // ——— 主读循环 ———
@@ -500,18 +2564,254 @@ class Session : public std::enable_shared_from_this<Session> {
                                self->on_close();
                                return;
                            }
-                           std::string msg = boost::beast::buffers_to_string(self->buf_.data());
-                           self->buf_.consume(self->buf_.size());
-                           self->handle_msg(msg);
+                           self->touch();
+                           if (self->ws_.got_binary()) {
+                               json j = self->take_packed();
+                               if (j.is_string())
+                                   self->handle_msg(j.get<std::string>());
+                               else if (j.is_object())
+                                   self->dispatch(j);
+                           } else {
+                               // JSON 命令直接在读缓冲上扫描，聊天行才拷成 string
+                               auto data = self->buf_.data();
+                               std::string_view view{static_cast<char const *>(data.data()), data.size()};
+                               if (!view.empty() && view.front() == '{')
+                                   self->handle_json(view);
+                               else
+                                   self->handle_msg(std::string(view));
+                               self->buf_.consume(self->buf_.size());
+                           }
+                           self->shed_read_scratch();
                            self->do_read();
                        });
     }
     void on_close() {
-        g_sessions.erase(shared_from_this());
-        json uj = {{"type", "users_list"}, {"users", json::array()}};
-        for (auto &s : g_sessions)
-            uj["users"].push_back(s->name());
-        broadcast_json(uj);
+        if (resume_ && !token_.empty() && g_cfg.resume_grace_ms) {
+            park();
+            return;
+        }
+        g_wheel.cancel(timer_);
+        unregister();
+    }
+    // 注销：退出在线索引，最后一个标签页离开时通知上下线
+    void unregister() {
+        bool last_tab = false, elsewhere = false;
+        {
+            std::lock_guard<std::mutex> lk(g_sessions_mu);
+            auto self = shared_from_this();
+            if (!g_sessions.erase(self))
+                return; // 未登录的连接不影响在线列表
+            unindex_all(self);
+            auto it = g_users.find(username_);
+            auto &tabs = it->second;
+            tabs.erase(std::find(tabs.begin(), tabs.end(), self));
+            if (tabs.empty()) {
+                g_users.erase(it);
+                last_tab = true;
+                elsewhere = remote_online_locked(username_);
+            }
+        }
+        if (last_tab) {
+            g_history.forget(username_);
+            cluster_publish({{"type", "down"}, {"user", username_}});
+            if (!elsewhere)
+                g_presence.touch(username_);
+        }
+    }
+
+    // ——— 断线续传 ———
+    static std::string new_token() {
+        static const char hex[] = "0123456789abcdef";
+        unsigned char b[16];
+        RAND_bytes(b, sizeof b);
+        std::string t;
+        for (auto c : b) {
+            t += hex[c >> 4];
+            t += hex[c & 15];
+        }
+        return t;
+    }
+    // 断线但可续传：保持在线登记，新帧只进 retain_，等新连接在宽限期内接管
+    void park() {
+        kill();
+        {
+            std::lock_guard<std::mutex> lk(g_sessions_mu);
+            g_parked[token_] = shared_from_this();
+        }
+        ++g_wq_stats.parked;
+        parked_ = true;
+        g_wheel.arm(timer_, g_wheel.ticks(std::chrono::milliseconds(g_cfg.resume_grace_ms)));
+    }
+    void expire() {
+        parked_ = false;
+        {
+            std::lock_guard<std::mutex> lk(g_sessions_mu);
+            auto it = g_parked.find(token_);
+            if (it == g_parked.end() || it->second.get() != this)
+                return; // 已被接管
+            g_parked.erase(it);
+        }
+        ++g_wq_stats.expired;
+        retain_.clear();
+        unregister();
+    }
+    // 新连接的第一条消息 {"type":"resume","token":"...","seq":[control,presence,chat]}
+    // 字段类型由客户端决定：一律 find + 类型检查，不用会抛异常的 value() / get()
+    void try_resume(json const &req) {
+        auto str = [&req](char const *k) {
+            auto it = req.find(k);
+            return it != req.end() && it->is_string() ? it->get<std::string>() : std::string();
+        };
+        std::string token = str("token");
+        std::array<uint64_t, 3> acked{};
+        auto it = req.find("seq");
+        if (it != req.end() && it->is_array() && it->size() == 3)
+            for (size_t i = 0; i < 3; ++i)
+                if ((*it)[i].is_number_unsigned())
+                    acked[i] = (*it)[i].get<uint64_t>();
+        std::shared_ptr<Session> old;
+        if (resume_ && str("type") == "resume" && !token.empty()) {
+            std::lock_guard<std::mutex> lk(g_sessions_mu);
+            auto p = g_parked.find(token);
+            if (p != g_parked.end())
+                old = p->second;
+        }
+        if (!old)
+            return resume_failed();
+        resuming_ = true;
+        boost::asio::post(old->ws_.get_executor(),
+                          [old, self = shared_from_this(), acked] { old->hand_over(self, acked); });
+    }
+    void resume_failed() {
+        ++g_wq_stats.resume_failed;
+        resuming_ = false;
+        queue_json({{"type", "resume_failed"}});
+        prompt_login();
+    }
+    // 旧会话交给新连接的全部状态
+    struct Handover {
+        std::string user, token;
+        std::array<uint64_t, 3> seq, evicted;
+        SlabDeque<Retained> retain;
+    };
+    // 在旧会话的 strand 上：在线索引里的自己换成 next，序号与保留窗口整体移交
+    void hand_over(std::shared_ptr<Session> const &next, std::array<uint64_t, 3> acked) {
+        auto self = shared_from_this();
+        {
+            std::lock_guard<std::mutex> lk(g_sessions_mu);
+            auto it = g_parked.find(token_);
+            if (it == g_parked.end() || it->second != self) { // 恰好超时注销了
+                boost::asio::post(next->ws_.get_executor(), [next] { next->resume_failed(); });
+                return;
+            }
+            g_parked.erase(it);
+            g_sessions.erase(self);
+            g_sessions.insert(next);
+            auto &tabs = g_users[username_];
+            std::replace(tabs.begin(), tabs.end(), self, next);
+            for (int g : groups_) {
+                auto &members = g_group_online[g];
+                members.erase(self);
+                members.insert(next);
+            }
+            next->groups_ = std::move(groups_);
+            groups_.clear();
+        }
+        g_wheel.cancel(timer_); // 已投递的到期回调看到 parked_ 为假、dead_ 为真，什么也不做
+        parked_ = false;
+        successor_ = next;
+        Handover h{username_, token_, {seq_[0], seq_[1], seq_[2]}, {evicted_seq_[0], evicted_seq_[1], evicted_seq_[2]},
+                   std::move(retain_)};
+        retain_.clear();
+        boost::asio::post(next->ws_.get_executor(),
+                          [next, h = std::move(h), acked]() mutable { next->resume_from(std::move(h), acked); });
+    }
+    // 在新连接的 strand 上：补发客户端没收到的帧，再放行接管期间攒下的新帧
+    void resume_from(Handover h, std::array<uint64_t, 3> acked) {
+        username_ = std::move(h.user);
+        token_ = std::move(h.token);
+        retain_ = std::move(h.retain);
+        retain_bytes_ = 0;
+        for (auto &r : retain_)
+            retain_bytes_ += wire(r.f).size();
+        bool covered[3];
+        for (int i = 0; i < 3; ++i) {
+            seq_[i] = h.seq[i];
+            evicted_seq_[i] = h.evicted[i];
+            sent_seq_[i] = std::min(acked[i], seq_[i]);
+            covered[i] = acked[i] >= evicted_seq_[i];
+        }
+        auto missed = [&](Retained const &r) { return covered[(int)r.stream] && r.seq > acked[(int)r.stream]; };
+        size_t n = std::count_if(retain_.begin(), retain_.end(), missed);
+        ++g_wq_stats.resumed;
+        g_wq_stats.replayed += n;
+
+        resuming_ = false;
+        push(make_frame(json{{"type", "resumed"}, {"user", username_}, {"replayed", n}}, proto_), Stream::Control, 0);
+        for (auto &r : retain_)
+            if (missed(r))
+                push(r.f, r.stream, r.seq);
+        auto held = std::move(held_);
+        held_.clear();
+        for (auto &[f, stream] : held)
+            enqueue(std::move(f), stream);
+        // 保留窗口覆盖不到的流，回落到登录时的全量推送
+        bool meta = !covered[(int)Stream::Control] || !covered[(int)Stream::Presence];
+        bool history = !covered[(int)Stream::Chat];
+        auto resume_reading = [this] {
+            do_read();
+            touch();
+            heartbeat();
+        };
+        if (meta || history)
+            load_snapshot(meta, history, resume_reading);
+        else
+            resume_reading();
+    }
+
+    // ——— 超时与心跳 ———
+    // 时间轮线程上调用：只负责切回本会话的 strand
+    static void on_wheel(std::shared_ptr<void> const &owner) {
+        auto self = std::static_pointer_cast<Session>(owner);
+        boost::asio::post(self->ws_.get_executor(), [self] { self->on_timer(); });
+    }
+    void on_timer() {
+        if (parked_)
+            return expire();
+        if (dead_)
+            return; // 已断开或已被新连接接管，读循环负责收尾
+        if (username_.empty()) { // 握手 / 登录超时（接管中的连接也算，接管完成前 username_ 为空）
+            ++g_wq_stats.login_timeouts;
+            return kill();
+        }
+        heartbeat();
+    }
+    void touch() { last_rx_ = g_wheel.now(); }
+    // 按空闲时长决定断开 / 发 ping，再把节点挂到下一个需要检查的时刻
+    void heartbeat() {
+        uint64_t now = g_wheel.now(), next = UINT64_MAX;
+        uint64_t idle_limit = g_wheel.ticks(std::chrono::milliseconds(g_cfg.idle_timeout_ms));
+        uint64_t ping_every = g_wheel.ticks(std::chrono::milliseconds(g_cfg.ping_interval_ms));
+        if (idle_limit) {
+            if (now - last_rx_ >= idle_limit) {
+                ++g_wq_stats.idle_closed;
+                return kill();
+            }
+            next = last_rx_ + idle_limit;
+        }
+        if (ping_every) {
+            uint64_t quiet_since = std::max(last_rx_, last_ping_);
+            if (now - quiet_since >= ping_every) {
+                ++g_wq_stats.pings;
+                last_ping_ = quiet_since = now;
+                ws_.async_ping({}, [self = shared_from_this()](boost::system::error_code) {});
+            }
+            next = std::min(next, quiet_since + ping_every);
+        }
+        if (next != UINT64_MAX)
+            g_wheel.arm(timer_, next - now);
+        else
+            g_wheel.cancel(timer_); // 心跳全关：撤掉登录期限
     }
 
     // ——— 处理单条消息 ———
@@ -527,53 +2827,141 @@ class Session : public std::enable_shared_from_this<Session> {
             if (pos == std::string::npos)
                 return;
             std::string target = raw.substr(1, pos - 1), text = raw.substr(pos + 1);
-            std::string out = now_str() + " " + username_ + " (私) 对 " + target + " 说: " + text;
-            bool found = false;
-            for (auto &s : g_sessions)
-                if (s->name() == target) {
-                    found = true;
-                    s->queue_text(out);
-                }
-            queue_text(out); // 回显
-            insert_message(username_, target, out);
+            std::time_t t = std::time(nullptr);
+            std::string out = dm_line(t, username_, target, text);
+            metrics::inbound(metrics::TextDm);
+            auto t0 = std::chrono::steady_clock::now();
+            auto f = make_frame(out);
+            auto peers = sessions_of(target);
+            for (auto &s : peers)
+                s->queue_frame(f, Stream::Chat);
+            if (target != username_) // 回显到自己的所有标签页
+                for (auto &s : sessions_of(username_))
+                    s->queue_frame(f, Stream::Chat);
+            bool remote = relay_dm(target, out); // 即使收件人本节点在线，其他节点的标签页也要收到
+            bool found = !peers.empty() || remote;
+            metrics::observe_since(metrics::FanoutDm, t0);
+            insert_message(username_, target, text, t);
             if (!found)
                 queue_text("系统: 用户 " + target + " 不在线或不存在");
             return;
         }
 
         // 公共
-        std::string out = now_str() + " " + username_ + " : " + raw;
-        for (auto &s : g_sessions)
-            s->queue_text(out);
-        insert_message(username_, "all", out);
-        ;
+        std::time_t t = std::time(nullptr);
+        std::string out = lobby_line(t, username_, raw);
+        metrics::inbound(metrics::TextLobby);
+        broadcast_frame(make_frame(out), Stream::Chat);
+        cluster_publish({{"type", "lobby"}, {"frame", out}});
+        insert_message(username_, "all", raw, t);
+    }
+
+    // 集群模式：私聊转给有收件人、或有自己其他标签页的节点；返回收件人是否在别的节点在线
+    bool relay_dm(std::string const &target, std::string const &text) const {
+        if (!g_bus)
+            return false;
+        std::set<int> nodes;
+        bool found = false;
+        {
+            std::lock_guard<std::mutex> lk(g_sessions_mu);
+            auto it = g_remote_users.find(target);
+            if (it != g_remote_users.end()) {
+                found = true;
+                nodes = it->second;
+            }
+            it = g_remote_users.find(username_);
+            if (target != username_ && it != g_remote_users.end())
+                nodes.insert(it->second.begin(), it->second.end());
+        }
+        if (!nodes.empty()) {
+            json m = {{"type", "dm"}, {"to", target}, {"from", username_}, {"frame", text}};
+            for (int n : nodes)
+                g_bus->send_to(n, m);
+        }
+        return found;
+    }
+
+    // 取出读缓冲里的 MessagePack 帧；格式错误或任何键、字符串不是合法 UTF-8 返回 null（整帧丢弃）
+    json take_packed() {
+        auto data = buf_.data();
+        auto p = static_cast<unsigned char const *>(data.data());
+        json j = json::from_msgpack(p, p + data.size(), true, /*allow_exceptions=*/false);
+        buf_.consume(buf_.size());
+        return j.is_discarded() || !utf8_clean(j) ? json{} : j;
+    }
+    static bool utf8_clean(json const &j) {
+        if (j.is_string())
+            return cmd::valid_utf8(j.get_ref<std::string const &>());
+        if (j.is_object()) {
+            for (auto it = j.begin(); it != j.end(); ++it)
+                if (!cmd::valid_utf8(it.key()) || !utf8_clean(it.value()))
+                    return false;
+        } else if (j.is_array())
+            for (auto const &e : j)
+                if (!utf8_clean(e))
+                    return false;
+        return true;
     }
 
     // ——— JSON 协议 ———
-    void handle_json(std::string const &s) {
-        json j;
-        try {
-            j = json::parse(s);
-        } catch (...) {
+    // 文本命令：扫描出需要的字段（视图指向 s 或 scan_buf_），不建 DOM
+    void handle_json(std::string_view s) {
+        cmd::Command c;
+        if (cmd::parse(s, scan_buf_, c))
+            dispatch(c);
+    }
+    // MessagePack 解出的 DOM：取同样的字段，视图指向 j 内部
+    void dispatch(json const &j) {
+        cmd::Command c;
+        auto str = [&](char const *k, std::string_view &out) {
+            auto it = j.find(k);
+            if (it != j.end() && it->is_string())
+                out = it->get_ref<std::string const &>();
+        };
+        auto num = [&](char const *k, long long &out) {
+            auto it = j.find(k);
+            if (it != j.end() && it->is_number_integer())
+                out = it->get<long long>();
+        };
+        std::string_view type;
+        str("type", type);
+        c.type = cmd::lookup(type);
+        num("group_id", c.group_id);
+        num("before_id", c.before_id);
+        str("group_name", c.group_name);
+        str("username", c.username);
+        str("content", c.content);
+        str("query", c.query);
+        str("cursor", c.cursor);
+        num("limit", c.limit);
+        dispatch(c);
+    }
+    void dispatch(cmd::Command const &c) {
+        metrics::inbound((int)c.type);
+        int gid = c.group_id >= 0 && c.group_id <= INT_MAX ? int(c.group_id) : -1;
+        switch (c.type) {
+        case cmd::Type::CreateGroup:
+            return on_create_group(std::string(c.group_name));
+        case cmd::Type::AddMember:
+            return on_add_member(gid, std::string(c.username));
+        case cmd::Type::RemoveMember:
+            return on_remove_member(gid, std::string(c.username));
+        case cmd::Type::GetMembers:
+            return on_get_members(gid);
+        case cmd::Type::GetGroupMsgs:
+            return on_get_group_msgs(gid, c.before_id);
+        case cmd::Type::GroupMessage:
+            return on_group_msg(gid, c.content);
+        case cmd::Type::GetHistory:
+            return send_history(c.before_id);
+        case cmd::Type::SearchMessages:
+            return on_search(c.query, c.cursor, c.group_id, c.limit);
+        case cmd::Type::Unknown:
             return;
         }
-        std::string type = j.value("type", "");
-        if (type == "create_group")
-            on_create_group(j);
-        else if (type == "add_group_member")
-            on_add_member(j);
-        else if (type == "remove_group_member")
-            on_remove_member(j);
-        else if (type == "get_group_members")
-            on_get_members(j);
-        else if (type == "get_group_messages")
-            on_get_group_msgs(j);
-        else if (type == "group_message")
-            on_group_msg(j);
-    }
-
-    void on_create_group(json const &j) {
-        std::string name = j.value("group_name", "");
+    }
+
+    void on_create_group(std::string name) {
         json resp = {{"type", "create_group_response"}};
         if (name.empty()) {
             resp["message"] = "群名不能为空";
@@ -581,197 +2969,656 @@ class Session : public std::enable_shared_from_this<Session> {
             return;
         }
 
-        sqlite3_stmt *st;
-        sqlite3_prepare_v2(g_db,
-                           "INSERT INTO groups(name,owner) VALUES(?,?);", -1, &st, 0);
-        sqlite3_bind_text(st, 1, name.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(st, 2, username_.c_str(), -1, SQLITE_STATIC);
-        bool ok = sqlite3_step(st) == SQLITE_DONE;
-        sqlite3_finalize(st);
-        if (!ok) {
-            resp["message"] = "创建失败(重名)";
+        create_group(name, username_, on_strand([this, name, resp](int gid) mutable {
+            if (gid < 0) {
+                resp["message"] = "创建失败(重名)";
+                queue_json(resp);
+                return;
+            }
+            index_member(gid, username_, true);
+            publish_member(gid, username_, true);
+            resp["message"] = "群组创建成功";
+            resp["group"] = {{"id", gid}, {"name", name}, {"is_owner", true}};
             queue_json(resp);
-            return;
-        }
-
-        int gid = (int)sqlite3_last_insert_rowid(g_db);
-        // exec_sql("INSERT INTO group_members(group_id,username,is_owner) VALUES(" + std::to_string(gid) + ",'" + username_ + "',1);");
-        insert_group_member(gid, username_, /*owner_flag=*/true);
-        resp["message"] = "群组创建成功";
-        resp["group"] = {{"id", gid}, {"name", name}, {"is_owner", true}};
-        queue_json(resp);
-        push_meta();
+            push_meta();
+        }));
     }
-    void on_add_member(json const &j) {
-        int gid = j.value("group_id", -1);
-        std::string user = j.value("username", "");
+    void on_add_member(int gid, std::string user) {
         json resp = {{"type", "add_member_response"}};
         if (gid < 0 || user.empty()) {
             resp["message"] = "参数错误";
             queue_json(resp);
             return;
         }
-        if (!is_owner(gid, username_)) {
-            resp["message"] = "只有群主能加人";
-            queue_json(resp);
-            return;
-        }
-
-        sqlite3_stmt *st;
-        sqlite3_prepare_v2(g_db,
-                           "INSERT OR IGNORE INTO group_members(group_id,username,is_owner)VALUES(?,?,0);",
-                           -1, &st, 0);
-        sqlite3_bind_int(st, 1, gid);
-        sqlite3_bind_text(st, 2, user.c_str(), -1, SQLITE_STATIC);
-        // bool ok = sqlite3_step(st) == SQLITE_DONE;
-        bool ok = insert_group_member(gid, user, false);
-        sqlite3_finalize(st);
-        resp["message"] = ok ? "成员已添加" : "添加失败(可能已存在)";
-        queue_json(resp);
-        for (auto &s : g_sessions)
-            if (s->name() == user)
-                s->push_meta();
-    }
-    void on_remove_member(json const &j) {
-        int gid = j.value("group_id", -1);
-        std::string user = j.value("username", "");
+        on_reader([gid, me = username_](StmtCache &db) { return is_owner(db, gid, me); },
+                  [this, gid, user, resp](bool owner) mutable {
+                      if (!owner) {
+                          resp["message"] = "只有群主能加人";
+                          queue_json(resp);
+                          return;
+                      }
+                      insert_group_member(gid, user, false, on_strand([this, gid, user, resp](bool ok) mutable {
+                          if (ok) {
+                              index_member(gid, user, true);
+                              publish_member(gid, user, true);
+                          }
+                          resp["message"] = ok ? "成员已添加" : "添加失败(可能已存在)";
+                          queue_json(resp);
+                          for (auto &s : sessions_of(user))
+                              push_meta_to(s);
+                      }));
+                  });
+    }
+    void on_remove_member(int gid, std::string user) {
         json resp = {{"type", "remove_member_response"}};
         if (gid < 0 || user.empty()) {
             resp["message"] = "参数错误";
             queue_json(resp);
             return;
         }
-        if (!is_owner(gid, username_)) {
-            resp["message"] = "只有群主能踢人";
-            queue_json(resp);
-            return;
-        }
-        if (user == username_) {
-            resp["message"] = "不能移除自己";
-            queue_json(resp);
-            return;
-        }
-
-        sqlite3_stmt *st;
-        sqlite3_prepare_v2(g_db,
-                           "DELETE FROM group_members WHERE group_id=? AND username=?;", -1, &st, 0);
-        sqlite3_bind_int(st, 1, gid);
-        sqlite3_bind_text(st, 2, user.c_str(), -1, SQLITE_STATIC);
-        // bool ok = (sqlite3_step(st) == SQLITE_DONE && sqlite3_changes(g_db));
-        bool ok = remove_group_member(gid, user);
-        sqlite3_finalize(st);
-        resp["message"] = ok ? "成员已移除" : "移除失败";
-        queue_json(resp);
-        for (auto &s : g_sessions)
-            if (s->name() == user)
-                s->push_meta();
-    }
-    void on_get_members(json const &j) {
-        int gid = j.value("group_id", -1);
+        on_reader([gid, me = username_](StmtCache &db) { return is_owner(db, gid, me); },
+                  [this, gid, user, resp](bool owner) mutable {
+                      if (!owner) {
+                          resp["message"] = "只有群主能踢人";
+                          queue_json(resp);
+                          return;
+                      }
+                      if (user == username_) {
+                          resp["message"] = "不能移除自己";
+                          queue_json(resp);
+                          return;
+                      }
+                      remove_group_member(gid, user, on_strand([this, gid, user, resp](bool ok) mutable {
+                          if (ok) {
+                              index_member(gid, user, false);
+                              publish_member(gid, user, false);
+                          }
+                          resp["message"] = ok ? "成员已移除" : "移除失败";
+                          queue_json(resp);
+                          for (auto &s : sessions_of(user))
+                              push_meta_to(s);
+                      }));
+                  });
+    }
+    void on_get_members(int gid) {
         if (gid < 0)
             return;
-        // json resp = {{"type", "group_members"}, {"group_id", gid}, {"members", json::array()}};
-        json resp = {{"type", "group_members"}, {"group_id", gid}, {"members", query_group_members(gid)}};
-        sqlite3_stmt *st;
-        sqlite3_prepare_v2(g_db,
-                           "SELECT username,is_owner FROM group_members WHERE group_id=?;", -1, &st, 0);
-        sqlite3_bind_int(st, 1, gid);
-        while (sqlite3_step(st) == SQLITE_ROW) {
-            resp["members"].push_back({{"username", reinterpret_cast<const char *>(sqlite3_column_text(st, 0))},
-                                       {"is_owner", sqlite3_column_int(st, 1) != 0}});
-        }
-        sqlite3_finalize(st);
-        queue_json(resp);
+        on_reader(
+            [gid](StmtCache &db) {
+                return json{{"type", "group_members"}, {"group_id", gid}, {"members", query_group_members(db, gid)}};
+            },
+            [this](json &resp) { queue_json(resp); });
     }
-    void on_get_group_msgs(json const &j) {
-        int gid = j.value("group_id", -1);
-        if (gid < 0 || !user_in_group(gid, username_))
+    void on_get_group_msgs(int gid, long long before_id) {
+        if (gid < 0 || !in_group(gid))
             return;
-        json resp = {{"type", "group_messages"}, {"group_id", gid}, {"messages", json::array()}};
-        sqlite3_stmt *st;
-        sqlite3_prepare_v2(g_db,
-                           "SELECT sender,message,timestamp FROM group_messages "
-                           "WHERE group_id=? ORDER BY id DESC LIMIT 50;",
-                           -1, &st, 0);
-        sqlite3_bind_int(st, 1, gid);
-        while (sqlite3_step(st) == SQLITE_ROW) {
-            resp["messages"].push_back({{"sender", reinterpret_cast<const char *>(sqlite3_column_text(st, 0))},
-                                        {"message", reinterpret_cast<const char *>(sqlite3_column_text(st, 1))},
-                                        {"timestamp", reinterpret_cast<const char *>(sqlite3_column_text(st, 2))}});
+        on_reader(
+            [gid, before_id](StmtCache &db) {
+                json resp = {{"type", "group_messages"}, {"group_id", gid}, {"messages", json::array()}};
+                if (before_id != HistoryCache::NO_CURSOR)
+                    resp["before_id"] = before_id;
+                for (auto &m : g_history.group_page(db, gid, before_id, GROUP_PAGE))
+                    resp["messages"].push_back(
+                        {{"id", m.id}, {"sender", m.sender}, {"message", m.body}, {"timestamp", m.ts}});
+                return resp;
+            },
+            [this](json &resp) { queue_json(resp); });
+    }
+    // 全文搜索；给了 group_id 只搜该群，否则搜大厅、自己的私聊和所在的全部群
+    void on_search(std::string_view query, std::string_view cursor, long long group_id, long long limit) {
+        auto t0 = std::chrono::steady_clock::now();
+        json resp = {{"type", "search_results"}, {"query", query}};
+        if (!cursor.empty())
+            resp["cursor"] = cursor;
+        std::string err;
+        auto q = fts_query(query, err);
+        SearchCursor cur;
+        if (!g_store->searchable()) {
+            resp["message"] = "当前存储后端不支持全文搜索";
+            return queue_json(resp);
+        }
+        if (q.match.empty()) {
+            resp["message"] = err;
+            return queue_json(resp);
+        }
+        if (!cursor.empty() && !cur.parse(cursor)) {
+            resp["message"] = "游标无效";
+            return queue_json(resp);
+        }
+        SearchScope scope{username_, "["};
+        if (group_id != -1) {
+            if (group_id < 0 || group_id > INT_MAX || !in_group(int(group_id))) {
+                resp["message"] = "不是该群成员";
+                return queue_json(resp);
+            }
+            scope.groups += std::to_string(group_id);
+            scope.lobby_dm = false;
+        } else {
+            std::lock_guard<std::mutex> lk(g_sessions_mu);
+            for (int g : groups_)
+                scope.groups += (scope.groups.size() > 1 ? "," : "") + std::to_string(g);
         }
-        sqlite3_finalize(st);
-        queue_json(resp);
+        scope.groups += ']';
+
+        size_t n = limit > 0 ? std::min<size_t>(limit, SEARCH_PAGE_MAX) : SEARCH_PAGE;
+        on_reader(
+            [q = std::move(q), scope = std::move(scope), cur, n, resp = std::move(resp)](StmtCache &db) mutable {
+                SearchCursor next;
+                json results = json::array();
+                for (auto &h : search_page(db, q, scope, cur, n, next)) {
+                    json r = {{"id", h.id}, {"sender", h.sender}, {"content", h.body}, {"timestamp", h.ts}};
+                    if (h.kind == schema::Group) {
+                        r["kind"] = "group";
+                        r["group_id"] = h.gid;
+                    } else if (h.kind == schema::Lobby)
+                        r["kind"] = "lobby";
+                    else {
+                        r["kind"] = "dm";
+                        r["receiver"] = h.receiver;
+                    }
+                    results.push_back(std::move(r));
+                }
+                resp["results"] = std::move(results);
+                resp["next_cursor"] = next.done() ? json() : json(next.str());
+                return resp;
+            },
+            [this, t0](json &resp) {
+                queue_json(resp);
+                metrics::observe_since(metrics::Search, t0);
+            });
     }
-    void on_group_msg(json const &j) {
+    void on_group_msg(int gid, std::string_view text) {
         /* 1. 基本合法性检查 */
-        int gid = j.value("group_id", -1);
-        std::string content = j.value("content", "");
-        if (gid < 0 || content.empty())
+        if (gid < 0 || text.empty())
             return;
-        if (!user_in_group(gid, username_))
+        if (!in_group(gid))
             return; // 非群成员直接忽略
 
-        /* 2. 写入数据库并取 timestamp */
-        int row_id = insert_group_message(gid, username_, content);
+        /* 2. 交给写线程，提交后回调带回行 id 与 timestamp */
+        std::string content(text);
+        insert_group_message(gid, username_, content,
+                             on_strand([this, gid, content](long long id, std::string const &ts) {
+                                 if (!id) {
+                                     queue_text("系统: 群消息保存失败，未发送");
+                                     return;
+                                 }
+                                 /* 3. 组装前端需要的 JSON */
+                                 json gm = {
+                                     {"type", "group_message"},
+                                     {"id", id},
+                                     {"group_id", gid},
+                                     {"sender", username_},
+                                     {"timestamp", ts},
+                                     {"formatted_message",
+                                      "[" + ts + "] " + username_ + ": " + content}};
+
+                                 /* 4. 广播给群内所有在线成员（只遍历该群的在线会话，只序列化一次） */
+                                 auto t0 = std::chrono::steady_clock::now();
+                                 std::string text = dump_wire(gm);
+                                 auto f = make_frame(text);
+                                 for (auto &s : group_online(gid))
+                                     s->push_frame(f, Stream::Chat);
+                                 metrics::observe_since(metrics::FanoutGroup, t0);
+                                 cluster_publish({{"type", "group"}, {"group_id", gid}, {"frame", std::move(text)},
+                                                  {"id", id}, {"sender", username_}, {"body", content}, {"ts", ts}});
+                             }));
+    }
 
-        std::string ts;
-        sqlite3_stmt *ts_stmt = nullptr;
-        sqlite3_prepare_v2(g_db,
-                           "SELECT timestamp FROM group_messages WHERE id=?;",
-                           -1, &ts_stmt, nullptr);
-        sqlite3_bind_int(ts_stmt, 1, row_id);
-        if (sqlite3_step(ts_stmt) == SQLITE_ROW) {
-            ts = reinterpret_cast<const char *>(sqlite3_column_text(ts_stmt, 0));
+  public:
+    // ——— 集群总线 ———
+    /* ===========================================================
+     * 节点间消息（type 区分）：
+     *   up / down {user}     该用户在发送节点上第一个标签页上线 / 最后一个下线
+     *   sync {users}         出链建立时发来的全量在线用户，替换该节点的旧登记
+     *   lobby {frame}        大厅消息，投给本节点所有会话
+     *   dm {to, from, frame} 私聊，只发往有收件人或发件人其他标签页的节点
+     *   group {group_id, frame, id, sender, body, ts}
+     *                        群消息：本节点在线成员扇出，并补进群历史环
+     *   hist {sender, receiver, id, body, ts}
+     *                        大厅 / 私聊提交后补进本节点的历史环
+     *   member {group_id, user, joined}
+     *                        群成员变化：更新索引并刷新该用户在本节点的会话
+     * 在入链的 strand 上执行：同一节点发来的消息按发送顺序处理
+     * =========================================================== */
+    static void on_bus(int node, json const &m) {
+        auto str = [&m](char const *k) {
+            auto it = m.find(k);
+            return it != m.end() && it->is_string() ? it->get<std::string>() : std::string();
+        };
+        auto num = [&m](char const *k) {
+            auto it = m.find(k);
+            return it != m.end() && it->is_number_integer() ? it->get<long long>() : -1LL;
+        };
+        std::string type = str("type");
+        if (type == "up" || type == "down")
+            set_remote(node, {str("user")}, type == "up", false);
+        else if (type == "sync") {
+            std::vector<std::string> users;
+            auto it = m.find("users");
+            if (it != m.end() && it->is_array())
+                for (auto &u : *it)
+                    if (u.is_string())
+                        users.push_back(u.get<std::string>());
+            set_remote(node, users, true, true);
+        } else if (type == "lobby")
+            broadcast_frame(make_frame(str("frame")), Stream::Chat);
+        else if (type == "dm") {
+            auto f = make_frame(str("frame"));
+            std::string to = str("to"), from = str("from");
+            for (auto &s : sessions_of(to))
+                s->push_frame(f, Stream::Chat);
+            if (from != to)
+                for (auto &s : sessions_of(from))
+                    s->push_frame(f, Stream::Chat);
+        } else if (type == "group") {
+            long long gid = num("group_id");
+            if (gid < 0 || gid > INT_MAX)
+                return;
+            g_history.on_group_message(int(gid), {num("id"), str("sender"), str("body"), str("ts")});
+            auto f = make_frame(str("frame"));
+            for (auto &s : group_online(int(gid)))
+                s->push_frame(f, Stream::Chat);
+        } else if (type == "hist")
+            g_history.on_message(str("sender"), str("receiver"), {num("id"), str("sender"), str("body"), str("ts")});
+        else if (type == "member") {
+            long long gid = num("group_id");
+            std::string user = str("user");
+            if (gid < 0 || gid > INT_MAX)
+                return;
+            auto it = m.find("joined");
+            index_member(int(gid), user, it != m.end() && it->is_boolean() && it->get<bool>());
+            for (auto &s : sessions_of(user))
+                push_meta_to(s);
         }
-        sqlite3_finalize(ts_stmt);
-
-        /* 3. 组装前端需要的 JSON */
-        json gm = {
-            {"type", "group_message"},
-            {"group_id", gid},
-            {"sender", username_},
-            {"timestamp", ts},
-            {"formatted_message",
-             "[" + ts + "] " + username_ + ": " + content}};
+    }
+    // 入链握手 / 断开。断开即该节点上的用户全部下线；
+    // 断线期间可能漏收该节点的提交，两种情况都清空历史环，之后从 SQLite 重新装载
+    static void on_peer(int node, bool up) {
+        g_history.clear();
+        if (!up)
+            set_remote(node, {}, false, true);
+    }
+    // 出链建立时先发给对端的全量状态
+    static std::vector<json> bus_snapshot() {
+        json users = json::array();
+        {
+            std::lock_guard<std::mutex> lk(g_sessions_mu);
+            for (auto &kv : g_users)
+                users.push_back(kv.first);
+        }
+        std::vector<json> out;
+        out.push_back({{"type", "sync"}, {"users", std::move(users)}});
+        return out;
+    }
 
-        /* 4. 广播给群内所有在线成员 */
-        for (auto &s : g_sessions) {
-            if (user_in_group(gid, s->name()))
-                s->push_json(gm); // push_json 是我们在 Session public 区域暴露的包装
+  private:
+    // 登记 node 上用户的上下线；replace 时 users 是该节点在线用户的全集，不在其中的都算下线。
+    // 只有集群范围内的在线状态真的变了才通知 g_presence
+    static void set_remote(int node, std::vector<std::string> const &users, bool up, bool replace) {
+        std::vector<std::string> changed;
+        {
+            std::lock_guard<std::mutex> lk(g_sessions_mu);
+            auto apply = [&](std::string const &u, bool on) {
+                bool before = online_locked(u);
+                auto it = g_remote_users.find(u);
+                if (on)
+                    g_remote_users[u].insert(node);
+                else if (it != g_remote_users.end()) {
+                    it->second.erase(node);
+                    if (it->second.empty())
+                        g_remote_users.erase(it);
+                }
+                if (online_locked(u) != before)
+                    changed.push_back(u);
+            };
+            if (replace) {
+                std::set<std::string> keep(users.begin(), users.end());
+                std::vector<std::string> gone;
+                for (auto &kv : g_remote_users)
+                    if (kv.second.count(node) && !keep.count(kv.first))
+                        gone.push_back(kv.first);
+                for (auto &u : gone)
+                    apply(u, false);
+            }
+            for (auto &u : users)
+                if (!u.empty())
+                    apply(u, up);
         }
+        for (auto &u : changed)
+            g_presence.touch(u);
     }
 }; // Session
 
-// ── broadcast_json：调用每个 Session 的 queue_json
-void broadcast_json(json const &j) {
-    for (auto &s : g_sessions)
-        s->push_json(j);
+// ── 广播：序列化一次，所有会话共享同一帧
+void broadcast_frame(Frame const &f, Stream stream) {
+    auto t0 = std::chrono::steady_clock::now();
+    for (auto &s : sessions_snapshot())
+        s->push_frame(f, stream);
+    metrics::observe_since(metrics::FanoutBroadcast, t0);
+}
+void broadcast_json(json const &j, Stream stream) { broadcast_frame(make_frame(dump_wire(j)), stream); }
+
+// ── /metrics：Prometheus 文本格式，抓取时才汇总各线程分片
+std::string render_metrics() {
+    using namespace metrics;
+    uint64_t inbound_sum[NINBOUND]{};
+    struct Sum {
+        uint64_t b[BUCKETS + 1]{}, sum = 0;
+    } hist[NHIST];
+    g_registry.for_each([&](Shard &s) {
+        for (int i = 0; i < NINBOUND; ++i)
+            inbound_sum[i] += s.inbound[i].load(std::memory_order_relaxed);
+        for (int h = 0; h < NHIST; ++h) {
+            for (int i = 0; i <= BUCKETS; ++i)
+                hist[h].b[i] += s.hist[h].b[i].load(std::memory_order_relaxed);
+            hist[h].sum += s.hist[h].sum.load(std::memory_order_relaxed);
+        }
+    });
+
+    std::ostringstream os;
+    os.precision(12); // 桶上界 2^21 也要原样打印，别变成 2.09715e+06
+    auto head = [&](char const *name, char const *type, char const *help) {
+        os << "# HELP " << name << ' ' << help << "\n# TYPE " << name << ' ' << type << '\n';
+    };
+    // scale：桶上界与 sum 的换算（us → 秒；队列深度为 1）
+    auto histogram = [&](char const *name, std::string const &labels, Sum const &h, double scale) {
+        uint64_t cum = 0;
+        std::string sep = labels.empty() ? "" : ",";
+        for (int i = 0; i < BUCKETS; ++i) {
+            cum += h.b[i];
+            os << name << "_bucket{" << labels << sep << "le=\"" << double(1ull << i) * scale << "\"} " << cum << '\n';
+        }
+        cum += h.b[BUCKETS];
+        os << name << "_bucket{" << labels << sep << "le=\"+Inf\"} " << cum << '\n';
+        os << name << "_sum" << (labels.empty() ? "" : "{" + labels + "}") << ' ' << h.sum * scale << '\n';
+        os << name << "_count" << (labels.empty() ? "" : "{" + labels + "}") << ' ' << cum << '\n';
+    };
+
+    size_t sessions, users;
+    {
+        std::lock_guard<std::mutex> lk(g_sessions_mu);
+        sessions = g_sessions.size();
+        users = g_users.size();
+    }
+    head("chat_sessions", "gauge", "Logged-in websocket sessions");
+    os << "chat_sessions " << sessions << '\n';
+    head("chat_users_online", "gauge", "Distinct online users");
+    os << "chat_users_online " << users << '\n';
+
+    head("chat_inbound_messages_total", "counter", "Inbound messages by type");
+    for (int i = 0; i < NINBOUND; ++i)
+        os << "chat_inbound_messages_total{type=\"" << INBOUND_NAMES[i] << "\"} " << inbound_sum[i] << '\n';
+
+    head("chat_write_queue_depth", "histogram", "Session write queue length after each enqueue");
+    histogram("chat_write_queue_depth", "", hist[WriteQueueDepth], 1);
+    head("chat_fanout_seconds", "histogram", "Time to enqueue one message to all recipients");
+    histogram("chat_fanout_seconds", "kind=\"broadcast\"", hist[FanoutBroadcast], 1e-6);
+    histogram("chat_fanout_seconds", "kind=\"group\"", hist[FanoutGroup], 1e-6);
+    histogram("chat_fanout_seconds", "kind=\"dm\"", hist[FanoutDm], 1e-6);
+    head("chat_sql_step_seconds", "histogram", "sqlite3_step latency");
+    histogram("chat_sql_step_seconds", "db=\"reader\"", hist[SqlReader], 1e-6);
+    histogram("chat_sql_step_seconds", "db=\"writer\"", hist[SqlWriter], 1e-6);
+    head("chat_io_handler_lag_seconds", "histogram", "Delay between a timer deadline and its handler running");
+    histogram("chat_io_handler_lag_seconds", "", hist[HandlerLag], 1e-6);
+    head("chat_search_seconds", "histogram", "search_messages latency, all windows included");
+    histogram("chat_search_seconds", "", hist[Search], 1e-6);
+
+    head("chat_frames_dropped_total", "counter", "Frames dropped by slow-consumer policy");
+    for (int i = 0; i < 3; ++i)
+        os << "chat_frames_dropped_total{stream=\"" << STREAM_NAMES[i] << "\"} " << g_wq_stats.dropped[i] << '\n';
+    head("chat_frames_coalesced_total", "counter", "Frames merged by slow-consumer policy");
+    for (int i = 0; i < 3; ++i)
+        os << "chat_frames_coalesced_total{stream=\"" << STREAM_NAMES[i] << "\"} " << g_wq_stats.coalesced[i] << '\n';
+    head("chat_slow_disconnects_total", "counter", "Sessions closed for being too slow");
+    os << "chat_slow_disconnects_total " << g_wq_stats.slow_disconnects << '\n';
+    head("chat_ws_writes_total", "counter", "websocket async_write calls");
+    os << "chat_ws_writes_total " << g_wq_stats.writes << '\n';
+    head("chat_ws_frames_total", "counter", "Frames sent, counting each item of a batch");
+    os << "chat_ws_frames_total " << g_wq_stats.frames << '\n';
+    head("chat_payload_bytes_total", "counter", "Bytes handed to websocket before compression");
+    os << "chat_payload_bytes_total " << g_wq_stats.payload_bytes << '\n';
+    head("chat_wire_bytes_total", "counter", "Bytes written to sockets");
+    os << "chat_wire_bytes_total " << g_wq_stats.wire_bytes << '\n';
+    head("chat_resume_sessions_total", "counter", "Disconnected sessions by resume outcome");
+    os << "chat_resume_sessions_total{result=\"parked\"} " << g_wq_stats.parked << '\n';
+    os << "chat_resume_sessions_total{result=\"resumed\"} " << g_wq_stats.resumed << '\n';
+    os << "chat_resume_sessions_total{result=\"failed\"} " << g_wq_stats.resume_failed << '\n';
+    os << "chat_resume_sessions_total{result=\"expired\"} " << g_wq_stats.expired << '\n';
+    head("chat_resume_replayed_frames_total", "counter", "Frames replayed to resumed sessions");
+    os << "chat_resume_replayed_frames_total " << g_wq_stats.replayed << '\n';
+    head("chat_ws_pings_total", "counter", "Heartbeat pings sent to idle sessions");
+    os << "chat_ws_pings_total " << g_wq_stats.pings << '\n';
+    head("chat_sessions_timed_out_total", "counter", "Connections closed by a deadline");
+    os << "chat_sessions_timed_out_total{reason=\"idle\"} " << g_wq_stats.idle_closed << '\n';
+    os << "chat_sessions_timed_out_total{reason=\"login\"} " << g_wq_stats.login_timeouts << '\n';
+    head("chat_timer_wheel_pending", "gauge", "Timers armed on the shared timer wheel");
+    os << "chat_timer_wheel_pending " << g_wheel.pending() << '\n';
+    head("chat_slab_bytes", "gauge", "Slab allocator memory for sessions, read buffers and queues");
+    os << "chat_slab_bytes{state=\"reserved\"} " << slab::stats().reserved << '\n';
+    os << "chat_slab_bytes{state=\"in_use\"} " << slab::stats().in_use << '\n';
+
+    auto [auth_depth, auth_rejected] = g_auth.depth();
+    head("chat_auth_queue_depth", "gauge", "Pending login/register hashing jobs");
+    os << "chat_auth_queue_depth " << auth_depth << '\n';
+    head("chat_auth_rejected_total", "counter", "Logins refused because the auth queue was full");
+    os << "chat_auth_rejected_total " << auth_rejected << '\n';
+    head("chat_read_queue_depth", "gauge", "Pending jobs on the read-only SQLite connection pool");
+    os << "chat_read_queue_depth " << g_reads.depth() << '\n';
+
+    if (g_bus) {
+        auto const &bs = g_bus->stats();
+        head("chat_cluster_links_up", "gauge", "Outbound bus links with a completed handshake");
+        os << "chat_cluster_links_up{node=\"" << g_bus->self() << "\"} " << g_bus->links_up() << '\n';
+        head("chat_cluster_messages_total", "counter", "Bus messages by direction");
+        os << "chat_cluster_messages_total{dir=\"out\"} " << bs.out_msgs << '\n';
+        os << "chat_cluster_messages_total{dir=\"in\"} " << bs.in_msgs << '\n';
+        head("chat_cluster_bytes_total", "counter", "Bus bytes by direction, including frame headers");
+        os << "chat_cluster_bytes_total{dir=\"out\"} " << bs.out_bytes << '\n';
+        os << "chat_cluster_bytes_total{dir=\"in\"} " << bs.in_bytes << '\n';
+        head("chat_cluster_dropped_total", "counter", "Bus messages dropped because a link was down or backlogged");
+        os << "chat_cluster_dropped_total " << bs.dropped << '\n';
+        head("chat_cluster_link_resets_total", "counter", "Outbound bus links torn down and redialled");
+        os << "chat_cluster_link_resets_total " << bs.resets << '\n';
+        head("chat_cluster_rejected_total", "counter", "Bus connections closed for a bad hello or a non-loopback source");
+        os << "chat_cluster_rejected_total " << bs.rejected << '\n';
+    }
+    return os.str();
 }
 
-// ── 异步 accept
+// 一次抓取一条连接：读请求、写响应、关闭
+class MetricsConn : public std::enable_shared_from_this<MetricsConn> {
+    tcp::socket sock_;
+    boost::beast::flat_buffer buf_;
+    boost::beast::http::request<boost::beast::http::empty_body> req_;
+    boost::beast::http::response<boost::beast::http::string_body> res_;
+
+  public:
+    explicit MetricsConn(tcp::socket s) : sock_(std::move(s)) {}
+    void start() {
+        namespace http = boost::beast::http;
+        http::async_read(sock_, buf_, req_, [self = shared_from_this()](boost::system::error_code ec, std::size_t) {
+            if (ec)
+                return;
+            auto &res = self->res_;
+            res.version(self->req_.version());
+            res.keep_alive(false);
+            if (self->req_.method() == http::verb::get && self->req_.target() == "/metrics") {
+                res.result(http::status::ok);
+                res.set(http::field::content_type, "text/plain; version=0.0.4");
+                res.body() = render_metrics();
+            } else {
+                res.result(http::status::not_found);
+                res.body() = "not found\n";
+            }
+            res.prepare_payload();
+            http::async_write(self->sock_, res, [self](boost::system::error_code, std::size_t) {
+                boost::system::error_code ec;
+                self->sock_.shutdown(tcp::socket::shutdown_send, ec);
+            });
+        });
+    }
+};
+void do_metrics_accept(tcp::acceptor &acc) {
+    acc.async_accept([&acc](boost::system::error_code ec, tcp::socket s) {
+        if (!ec)
+            std::make_shared<MetricsConn>(std::move(s))->start();
+        do_metrics_accept(acc);
+    });
+}
+
+// ── 异步 accept：每条新连接分配一个独立 strand
 void do_accept(boost::asio::io_context &ioc, tcp::acceptor &acc) {
     acc.async_accept(
+        boost::asio::make_strand(ioc),
         [&](boost::system::error_code ec, tcp::socket sock) {
             if (!ec)
-                std::make_shared<Session>(std::move(sock))->start();
+                std::allocate_shared<Session>(slab::Allocator<Session>(), std::move(sock))->start();
             do_accept(ioc, acc);
         });
 }
 
 // ── main
-int main() {
+int main(int argc, char **argv) {
+    if (!parse_args(argc, argv))
+        return 1;
     if (!db_open())
         return 1;
     db_init();
+    if (!g_writer.start())
+        return 1;
+    if (!g_reads.start()) {
+        g_writer.stop();
+        return 1;
+    }
+    if (g_cfg.storage == "log") {
+        auto log = std::make_unique<seglog::LogStore>(g_cfg.log_dir, g_cfg.log_segment_bytes,
+                                                      g_cfg.log_open_segments);
+        std::string err;
+        if (!log->open(err)) {
+            std::cerr << "无法打开消息日志: " << err << '\n';
+            g_reads.stop();
+            g_writer.stop();
+            return 1;
+        }
+        long long hw = schema::log_committed(g_db);
+        if (hw >= 0)
+            if (size_t n = log->truncate_after(hw))
+                std::cout << "消息日志: 截掉 " << n << " 个会话里 id > " << hw << " 的未提交记录\n";
+        g_store = std::move(log);
+        g_legacy_pending = false; // 日志里没有旧消息，历史环照常使用
+        std::cout << "消息存储: 分段日志 " << g_cfg.log_dir << "/（不支持全文搜索）\n";
+    } else
+        g_store = std::make_unique<SqliteStore<StmtCache>>(g_writer.stmts());
+    g_auth.start();
     try {
-        boost::asio::io_context ioc{1};
-        tcp::acceptor acc{ioc, {tcp::v4(), 9002}};
-        std::cout << "Chat server listening on :9002\n";
+        boost::asio::io_context ioc{(int)g_cfg.threads};
+        tcp::acceptor acc{ioc, {tcp::v4(), g_cfg.port}};
+        std::cout << "Chat server listening on :" << g_cfg.port
+                  << " (" << g_cfg.threads << " threads, durability " << DURABILITY_NAMES[(int)g_cfg.durability]
+                  << ")\n";
+        g_presence.init(ioc);
+        g_wheel.start(ioc, std::chrono::milliseconds(100));
+        // 落盘定时器：写线程在 group 批次开始 / async 有未 fsync 的写入时挂上，到期让它提交或 fsync。
+        // 先于 bus_guard 声明：guard 停掉写线程之后它才析构
+        boost::asio::steady_timer flush_timer{ioc};
+        g_writer.set_flush_timer([&ioc, &flush_timer] {
+            boost::asio::post(ioc, [&flush_timer] {
+                flush_timer.expires_after(std::chrono::milliseconds(g_cfg.db_batch_ms));
+                flush_timer.async_wait([](boost::system::error_code ec) {
+                    if (!ec)
+                        g_writer.flush();
+                });
+            });
+        });
+        // 总线、时间轮与在线状态定时器挂在 ioc 上，必须先于 ioc 析构；写线程 / 认证线程可能还在往总线发，先停它们
+        struct BusGuard {
+            ~BusGuard() {
+                g_reads.stop();
+                g_auth.stop();
+                g_writer.stop();
+                {
+                    // 在线 / 等待续传的会话持有 ioc 上的套接字，同样要在 ioc 析构之前放掉
+                    std::lock_guard<std::mutex> lk(g_sessions_mu);
+                    g_parked.clear();
+                    g_group_online.clear();
+                    g_users.clear();
+                    g_sessions.clear();
+                }
+                g_bus.reset();
+                g_wheel.stop();
+                g_presence.stop();
+            }
+        } bus_guard;
+        if (g_cfg.cluster_port) {
+            g_bus = std::make_unique<cluster::Bus>(ioc, g_cfg.node_id, boost::asio::ip::make_address(g_cfg.cluster_bind),
+                                                   g_cfg.cluster_port, cluster::parse_peers(g_cfg.peers),
+                                                   g_cfg.cluster_queue_bytes, g_cfg.cluster_secret);
+            g_bus->start(Session::on_bus, Session::on_peer, Session::bus_snapshot);
+            std::cout << "Cluster node " << g_cfg.node_id << ", bus on " << g_cfg.cluster_bind << ':'
+                      << g_cfg.cluster_port << '\n';
+        }
         do_accept(ioc, acc);
+
+        // Ctrl-C / kill：停止网络线程，随后 g_writer.stop() 提交剩余写入并 fsync
+        boost::asio::signal_set signals{ioc, SIGINT, SIGTERM};
+        signals.async_wait([&](boost::system::error_code, int) { ioc.stop(); });
+
+        // --stats-interval：周期性打印发送队列统计，便于观察慢消费者
+        boost::asio::steady_timer stats_timer{ioc};
+        std::function<void()> arm_stats = [&] {
+            stats_timer.expires_after(std::chrono::seconds(g_cfg.stats_interval));
+            stats_timer.async_wait([&](boost::system::error_code ec) {
+                if (ec)
+                    return;
+                g_wq_stats.dump(std::cout);
+                g_auth.dump(std::cout);
+                g_reads.dump(std::cout);
+                arm_stats();
+            });
+        };
+        if (g_cfg.stats_interval)
+            arm_stats();
+
+        // /metrics 旁路端口
+        std::unique_ptr<tcp::acceptor> metrics_acc;
+        if (g_cfg.metrics_port) {
+            metrics_acc = std::make_unique<tcp::acceptor>(ioc, tcp::endpoint{tcp::v4(), g_cfg.metrics_port});
+            do_metrics_accept(*metrics_acc);
+            std::cout << "Metrics on :" << g_cfg.metrics_port << "/metrics\n";
+        }
+        // 调度延迟探针：每 100ms 一个定时器，实际执行时刻减去到期时刻即为 handler 排队延迟
+        boost::asio::steady_timer lag_timer{ioc};
+        std::function<void()> arm_lag = [&] {
+            lag_timer.expires_after(std::chrono::milliseconds(100));
+            lag_timer.async_wait([&](boost::system::error_code ec) {
+                if (ec)
+                    return;
+                metrics::observe_since(metrics::HandlerLag, lag_timer.expiry());
+                arm_lag();
+            });
+        };
+        arm_lag();
+
+        // 主线程也参与 run，共 g_cfg.threads 个线程
+        std::vector<std::thread> pool;
+        for (unsigned i = 1; i < g_cfg.threads; ++i)
+            pool.emplace_back([&ioc] { ioc.run(); });
         ioc.run();
+        for (auto &t : pool)
+            t.join();
+        g_reads.stop();
+        g_auth.stop();
+        g_writer.stop();
     } catch (std::exception const &e) {
         std::cerr << "Fatal: " << e.what() << '\n';
     }
+    g_reads.stop(); // 读任务会把凭据交给认证线程，先停
+    g_auth.stop();  // 认证任务会向写线程提交注册 / 升级哈希，再停
+    g_writer.stop(); // 幂等；异常退出时也要收尾写线程
+    g_wq_stats.dump(std::cout);
+    g_auth.dump(std::cout);
+    g_reads.dump(std::cout);
+    g_store.reset();
     sqlite3_close(g_db);
     return 0;
 }
@@ -0,0 +1,138 @@
+// slab.hpp – 会话对象、读缓冲与发送队列用的定长块分配器
+// 按 64 字节分档，最大 4 KiB；更大的请求（粘贴的大段文字等）直接走 operator new，用完即还。
+//   - 每档从 64 KiB 的大块里切，块之间没有 malloc 头，同档对象紧挨着
+//   - 释放的块进本线程的空闲链表；攒多了一次还一半给全局链表，别的线程再整批取走
+//   - 大块从不还给系统：连接数回落后留作下一波连接的池子
+// 线程退出时缓存里的块不回收（本服务的线程与进程同寿），因此缓存不需要析构。
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <new>
+
+namespace slab {
+
+constexpr size_t GRAIN = 64, MAX_BLOCK = 4096, CLASSES = MAX_BLOCK / GRAIN;
+constexpr size_t CHUNK = 64 << 10;
+constexpr size_t CACHE_MAX = 64; // 每线程每档最多缓存的块数
+
+struct Stats {
+    std::atomic<size_t> reserved{0}; // 切给 slab 的大块总字节
+    std::atomic<size_t> in_use{0};   // 已分出去的块（按档位大小计）
+};
+inline Stats &stats() {
+    static Stats s;
+    return s;
+}
+
+namespace detail {
+struct FreeBlock {
+    FreeBlock *next;
+};
+struct Central {
+    struct Class {
+        std::mutex mu;
+        FreeBlock *head = nullptr;
+    } cls[CLASSES];
+};
+// 故意不析构：静态对象析构期间仍可能有会话释放
+inline Central &central() {
+    static Central *c = new Central;
+    return *c;
+}
+struct Cache {
+    FreeBlock *head[CLASSES];
+    size_t count[CLASSES];
+};
+inline Cache &cache() {
+    thread_local Cache c{}; // 平凡析构
+    return c;
+}
+inline size_t class_of(size_t n) { return n ? (n - 1) / GRAIN : 0; }
+
+// 本线程这一档空了：先从全局整批取，全局也空就切一个新的大块
+inline void refill(Cache &c, size_t k) {
+    auto &g = central().cls[k];
+    {
+        std::lock_guard<std::mutex> lk(g.mu);
+        while (g.head && c.count[k] < CACHE_MAX / 2) {
+            FreeBlock *b = g.head;
+            g.head = b->next;
+            b->next = c.head[k];
+            c.head[k] = b;
+            ++c.count[k];
+        }
+    }
+    if (c.head[k])
+        return;
+    size_t size = (k + 1) * GRAIN;
+    char *chunk = static_cast<char *>(::operator new(CHUNK));
+    stats().reserved += CHUNK;
+    for (size_t off = 0; off + size <= CHUNK; off += size) {
+        auto *b = reinterpret_cast<FreeBlock *>(chunk + off);
+        b->next = c.head[k];
+        c.head[k] = b;
+        ++c.count[k];
+    }
+}
+// 本线程缓存太多：还一半给全局
+inline void drain(Cache &c, size_t k) {
+    auto &g = central().cls[k];
+    std::lock_guard<std::mutex> lk(g.mu);
+    while (c.count[k] > CACHE_MAX / 2) {
+        FreeBlock *b = c.head[k];
+        c.head[k] = b->next;
+        --c.count[k];
+        b->next = g.head;
+        g.head = b;
+    }
+}
+} // namespace detail
+
+inline void *allocate(size_t n) {
+    if (n > MAX_BLOCK)
+        return ::operator new(n);
+    size_t k = detail::class_of(n);
+    auto &c = detail::cache();
+    if (!c.head[k])
+        detail::refill(c, k);
+    detail::FreeBlock *b = c.head[k];
+    c.head[k] = b->next;
+    --c.count[k];
+    stats().in_use.fetch_add((k + 1) * GRAIN, std::memory_order_relaxed);
+    return b;
+}
+inline void deallocate(void *p, size_t n) {
+    if (n > MAX_BLOCK)
+        return ::operator delete(p);
+    size_t k = detail::class_of(n);
+    auto &c = detail::cache();
+    auto *b = static_cast<detail::FreeBlock *>(p);
+    b->next = c.head[k];
+    c.head[k] = b;
+    if (++c.count[k] > CACHE_MAX)
+        detail::drain(c, k);
+    stats().in_use.fetch_sub((k + 1) * GRAIN, std::memory_order_relaxed);
+}
+
+// 标准分配器接口：allocate_shared、容器、beast 的 basic_flat_buffer 都可以用
+template <class T>
+struct Allocator {
+    static_assert(alignof(T) <= alignof(std::max_align_t), "slab 块只保证 max_align_t 对齐");
+    using value_type = T;
+
+    Allocator() = default;
+    template <class U>
+    Allocator(Allocator<U> const &) noexcept {}
+
+    T *allocate(size_t n) { return static_cast<T *>(slab::allocate(n * sizeof(T))); }
+    void deallocate(T *p, size_t n) noexcept { slab::deallocate(p, n * sizeof(T)); }
+
+    template <class U>
+    bool operator==(Allocator<U> const &) const noexcept { return true; }
+    template <class U>
+    bool operator!=(Allocator<U> const &) const noexcept { return false; }
+};
+
+} // namespace slab
@@ -0,0 +1,125 @@
+// storage.hpp – 消息正文的存储接口（--storage=sqlite|log）与 SQLite 实现
+// 会话、账号、群仍在 SQLite（schema.hpp）；这里只管一条条消息：
+//   - append 只在写线程上调用，按调用顺序分配全局递增的 id（跨会话可比，历史归并与游标都靠它）
+//   - page 可在任意线程调用，实现自己负责同步（SqliteStore 要求调用线程登记过读缓存）
+// 日志实现见 segment_log.hpp；两者的对比压测见 bench_storage.cpp。
+#pragma once
+
+#include <ctime>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <sqlite3.h>
+
+struct StoredMsg {
+    long long id;
+    std::string sender, body; // body 为用户输入的原文
+    std::time_t t;
+};
+
+class MessageStore {
+  public:
+    virtual ~MessageStore() = default;
+    // 失败返回 0
+    virtual long long append(long long conv, long long sender_id, std::string const &sender, std::string const &body,
+                             std::time_t t) = 0;
+    // 会话 conv 里 id < before 的最新 limit 条，按 id 倒序追加到 out
+    virtual void page(long long conv, long long before, size_t limit, std::vector<StoredMsg> &out) = 0;
+    // 把已 append 的内容刷到盘上（写线程按落盘策略调用）；SQLite 随 COMMIT / WAL 落盘，无需实现
+    virtual void sync() {}
+    // 写线程的事务边界：begin 之后 append 的记录 commit 时才对 page 可见，rollback 时撤销。
+    // 不在事务里的 append 立即可见。SqliteStore 的消息本就在 SQLite 事务里，无需实现
+    virtual void begin() {}
+    virtual void commit() {}
+    virtual void rollback() {}
+    // 已 append 的最大 id，写线程把它和同一事务一起记进 SQLite（schema::log_committed）；0 表示不需要
+    virtual long long high_water() const { return 0; }
+    // 有没有 chat_messages_fts 可搜
+    virtual bool searchable() const { return false; }
+};
+
+// 最简单的语句缓存：首次用到时 prepare，句柄析构时 reset。与服务端的 StmtCache 接口相同，
+// 只是不计时；不依赖服务端的工具（bench_storage）用它
+class PlainStmts {
+  public:
+    class Stmt {
+      public:
+        explicit Stmt(sqlite3_stmt *st) : st_(st) {}
+        Stmt(Stmt const &) = delete;
+        ~Stmt() {
+            sqlite3_reset(st_);
+            sqlite3_clear_bindings(st_);
+        }
+        operator sqlite3_stmt *() const { return st_; }
+        int step() { return st_ ? sqlite3_step(st_) : SQLITE_MISUSE; }
+
+      private:
+        sqlite3_stmt *st_;
+    };
+
+    explicit PlainStmts(sqlite3 *db) : db_(db) {}
+    PlainStmts(PlainStmts const &) = delete;
+    ~PlainStmts() {
+        for (auto &kv : cache_)
+            sqlite3_finalize(kv.second);
+    }
+    sqlite3 *db() const { return db_; }
+    Stmt get(char const *sql) {
+        auto &st = cache_[sql];
+        if (!st)
+            sqlite3_prepare_v2(db_, sql, -1, &st, nullptr);
+        return Stmt(st);
+    }
+
+  private:
+    sqlite3 *db_;
+    std::map<std::string, sqlite3_stmt *> cache_;
+};
+
+// chat_messages 表。Stmts 是连接上的语句缓存（服务端为 StmtCache，语句随其余查询一起计时、进统计）。
+// append 用 writer 的缓存，事务由调用方（写线程的批量提交）管理；
+// page 用调用线程自己的读缓存：每个读线程先 attach_reader，清空缓存前 detach_reader，
+// 没有登记过的线程读不到任何消息
+template <class Stmts>
+class SqliteStore : public MessageStore {
+  public:
+    explicit SqliteStore(Stmts &writer) : writer_(writer) {}
+    SqliteStore(SqliteStore const &) = delete;
+
+    static void attach_reader(Stmts *stmts) { reader() = stmts; }
+    static void detach_reader() { reader() = nullptr; }
+
+    long long append(long long conv, long long sender_id, std::string const &, std::string const &body,
+                     std::time_t t) override {
+        auto st = writer_.get("INSERT INTO chat_messages(conversation_id,sender_id,body,created_at) VALUES(?,?,?,?);");
+        sqlite3_bind_int64(st, 1, conv);
+        sqlite3_bind_int64(st, 2, sender_id);
+        sqlite3_bind_text(st, 3, body.c_str(), int(body.size()), SQLITE_STATIC);
+        sqlite3_bind_int64(st, 4, (long long)t);
+        return st.step() == SQLITE_DONE ? sqlite3_last_insert_rowid(writer_.db()) : 0;
+    }
+    void page(long long conv, long long before, size_t limit, std::vector<StoredMsg> &out) override {
+        Stmts *r = reader();
+        if (!r)
+            return;
+        auto st = r->get("SELECT m.id, u.username, m.body, m.created_at FROM chat_messages m "
+                         "JOIN users u ON u.id = m.sender_id "
+                         "WHERE m.conversation_id = ?1 AND m.id < ?2 ORDER BY m.id DESC LIMIT ?3;");
+        sqlite3_bind_int64(st, 1, conv);
+        sqlite3_bind_int64(st, 2, before);
+        sqlite3_bind_int64(st, 3, (long long)limit);
+        auto col = [&st](int i) { return std::string(reinterpret_cast<const char *>(sqlite3_column_text(st, i))); };
+        while (st.step() == SQLITE_ROW)
+            out.push_back({sqlite3_column_int64(st, 0), col(1), col(2), std::time_t(sqlite3_column_int64(st, 3))});
+    }
+    bool searchable() const override { return true; }
+
+  private:
+    static Stmts *&reader() {
+        thread_local Stmts *r = nullptr;
+        return r;
+    }
+
+    Stmts &writer_;
+};
@@ -0,0 +1,139 @@
+// timer_wheel.hpp – 所有会话共用的分层时间轮
+// 4 层 × 64 槽，tick 粒度由 start() 指定（服务端用 100ms，可覆盖约 19 天）：
+//   - 定时节点侵入式地嵌在调用方对象里，arm / cancel 都是 O(1) 的链表操作，不分配内存
+//   - 第 0 层每 tick 走一个槽；低层转满一圈时把上一层对应槽的节点重新分配（cascade）
+//   - 只有一个 steady_timer 驱动整张轮；回调在锁外调用
+// 生命周期：节点只持有 owner 的 weak_ptr，到期时先 lock() 成功才回调；
+// owner 析构前必须 cancel()，之后轮子不会再碰这个节点。
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+class TimerWheel {
+  public:
+    using Callback = void (*)(std::shared_ptr<void> const &owner);
+
+    struct Node {
+        Node *prev = nullptr, *next = nullptr; // 挂在某个槽的环形链表上；prev 为空表示未挂
+        uint64_t due = 0;                       // 到期 tick
+        std::weak_ptr<void> owner;
+        Callback fire = nullptr;
+    };
+
+    static constexpr int BITS = 6, SLOTS = 1 << BITS, LEVELS = 4;
+    static constexpr uint64_t MAX_DELAY = (uint64_t(1) << (BITS * LEVELS)) - 1;
+
+    TimerWheel() {
+        for (auto &level : wheel_)
+            for (auto &head : level)
+                head.prev = head.next = &head;
+    }
+
+    void start(boost::asio::io_context &ioc, std::chrono::milliseconds tick) {
+        tick_ = tick;
+        origin_ = std::chrono::steady_clock::now();
+        timer_ = std::make_unique<boost::asio::steady_timer>(ioc);
+        schedule();
+    }
+    // 定时器绑在 ioc 上，须在 ioc 析构前调用；节点仍可 cancel
+    void stop() { timer_.reset(); }
+
+    uint64_t now() const { return now_.load(std::memory_order_relaxed); }
+    uint64_t ticks(std::chrono::milliseconds d) const { return (d + tick_ - std::chrono::milliseconds(1)) / tick_; }
+    size_t pending() const { return pending_.load(std::memory_order_relaxed); }
+
+    // 节点在 delay 个 tick 后到期（至少 1 个）；已挂着的先摘下
+    void arm(Node &n, uint64_t delay) {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (n.prev)
+            unlink(n);
+        n.due = now_.load(std::memory_order_relaxed) + std::clamp<uint64_t>(delay, 1, MAX_DELAY);
+        insert(n);
+    }
+    void cancel(Node &n) {
+        std::lock_guard<std::mutex> lk(mu_);
+        if (n.prev)
+            unlink(n);
+    }
+
+  private:
+    static void link(Node &head, Node &n) {
+        n.prev = head.prev;
+        n.next = &head;
+        head.prev->next = &n;
+        head.prev = &n;
+    }
+    void unlink(Node &n) {
+        n.prev->next = n.next;
+        n.next->prev = n.prev;
+        n.prev = n.next = nullptr;
+        pending_.fetch_sub(1, std::memory_order_relaxed);
+    }
+    // 按剩余 tick 数选层：第 L 层放 [64^L, 64^(L+1)) 之内到期的节点，槽号取 due 的第 L 段
+    void insert(Node &n) {
+        uint64_t delta = n.due - now_.load(std::memory_order_relaxed);
+        int level = 0;
+        while (level + 1 < LEVELS && delta >= uint64_t(1) << (BITS * (level + 1)))
+            ++level;
+        link(wheel_[level][(n.due >> (BITS * level)) & (SLOTS - 1)], n);
+        pending_.fetch_add(1, std::memory_order_relaxed);
+    }
+    // 把第 level 层当前槽里的节点按新的剩余时间重新分配到更低层
+    void cascade(int level) {
+        Node &head = wheel_[level][(now_.load(std::memory_order_relaxed) >> (BITS * level)) & (SLOTS - 1)];
+        Node *n = head.next;
+        head.prev = head.next = &head;
+        while (n != &head) {
+            Node *next = n->next;
+            pending_.fetch_sub(1, std::memory_order_relaxed);
+            insert(*n);
+            n = next;
+        }
+    }
+    // 前进一个 tick，把到期节点的 owner 收进 out
+    void advance(std::vector<std::pair<Callback, std::shared_ptr<void>>> &out) {
+        uint64_t t = now_.fetch_add(1, std::memory_order_relaxed) + 1;
+        for (int level = 1; level < LEVELS && (t & ((uint64_t(1) << (BITS * level)) - 1)) == 0; ++level)
+            cascade(level);
+        Node &head = wheel_[0][t & (SLOTS - 1)];
+        while (head.next != &head) {
+            Node &n = *head.next;
+            unlink(n);
+            if (auto owner = n.owner.lock())
+                out.emplace_back(n.fire, std::move(owner));
+        }
+    }
+    void schedule() {
+        timer_->expires_at(origin_ + tick_ * (now() + 1));
+        timer_->async_wait([this](boost::system::error_code ec) {
+            if (ec)
+                return;
+            // 按真实时间补齐落下的 tick，处理器繁忙时也不会越走越慢
+            auto target = uint64_t((std::chrono::steady_clock::now() - origin_) / tick_);
+            std::vector<std::pair<Callback, std::shared_ptr<void>>> fired;
+            {
+                std::lock_guard<std::mutex> lk(mu_);
+                while (now() < target)
+                    advance(fired);
+            }
+            for (auto &[cb, owner] : fired)
+                cb(owner);
+            schedule();
+        });
+    }
+
+    std::mutex mu_;
+    Node wheel_[LEVELS][SLOTS]; // 每个槽一个哨兵头
+    std::atomic<uint64_t> now_{0};
+    std::atomic<size_t> pending_{0};
+    std::chrono::milliseconds tick_{100};
+    std::chrono::steady_clock::time_point origin_;
+    std::unique_ptr<boost::asio::steady_timer> timer_;
+};
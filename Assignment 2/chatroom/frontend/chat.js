@@ -5,7 +5,13 @@
 // =============================================================
 
 /* ---------------- DOM & State ---------------- */
-const ws = new WebSocket('ws://localhost:9002');
+// batch=1：服务端可把多条事件打包成一条 batch 消息
+// resume=1：断线后凭 token 重连，服务端只补发没收到的事件（各流序号在 batch 信封的 seq 里）
+// 页面地址带 ?proto=msgpack 时改用二进制 MessagePack 下行；上行仍发文本，服务端两种都收
+const PROTO = new URLSearchParams(location.search).get('proto') === 'msgpack' ? 'msgpack' : 'json';
+const WS_URL = 'ws://localhost:9002/?batch=1&resume=1' + (PROTO === 'msgpack' ? '&proto=msgpack' : '');
+let ws; // 每次重连换新对象，发送处都取当前的
+const resume = { token: null, seq: [0, 0, 0], retry: 0 }; // seq：control / presence / chat
 const userList = document.getElementById('user-list');
 const groupList = document.getElementById('group-list');
 const messageContainer = document.getElementById('message-container');
@@ -61,6 +67,10 @@ function isSelfMessage(raw) {
 
 /* ======== 消息渲染（头像 + 气泡） ======== */
 function appendMessage(raw, type = 'user-msg') {
+    messageContainer.appendChild(buildMessageRow(raw, type));
+    messageContainer.scrollTop = messageContainer.scrollHeight;
+}
+function buildMessageRow(raw, type) {
     const outgoing = (type === 'self-msg' || isSelfMessage(raw));
     const row = document.createElement('div');
     row.className = 'msg-row ' + (outgoing ? 'outgoing' : 'incoming');
@@ -93,14 +103,49 @@ function appendMessage(raw, type = 'user-msg') {
         row.appendChild(avatar);
         row.appendChild(bubble);
     }
+    return row;
+}
 
-    messageContainer.appendChild(row);
-    messageContainer.scrollTop = messageContainer.scrollHeight;
+/* ======== 向上翻页 ======== */
+// 服务器按 id 倒序返回一页；cursor 为当前已显示的最小 id，滚到顶部时带 before_id 取更早的一页
+const roomPager = { cursor: null, loading: false, done: false };  // 大厅 + 私聊
+const groupPager = { cursor: null, loading: false, done: false }; // 当前群
+function resetPager(p) { Object.assign(p, { cursor: null, loading: false, done: false }); }
+function notePage(p, arr) {
+    p.loading = false;
+    if (!arr.length) { p.done = true; return; }
+    const min = Math.min(...arr.map(m => m.id));
+    if (p.cursor === null || min < p.cursor) p.cursor = min;
+}
+/* 在顶部插入更早的消息（arr 为新 → 旧），保持当前可视位置不跳动 */
+function prependMessages(rows) {
+    const h = messageContainer.scrollHeight;
+    const frag = document.createDocumentFragment();
+    rows.forEach(r => frag.appendChild(r));
+    messageContainer.insertBefore(frag, messageContainer.firstChild);
+    messageContainer.scrollTop = messageContainer.scrollHeight - h;
 }
+function loadOlder() {
+    const group = currentState.targetType === 'group' && currentState.selectedGroup;
+    const p = group ? groupPager : roomPager;
+    if (p.loading || p.done || p.cursor === null) return;
+    p.loading = true;
+    if (group) ws.send(JSON.stringify({ type: 'get_group_messages', group_id: currentState.selectedGroup.id, before_id: p.cursor }));
+    else ws.send(JSON.stringify({ type: 'get_history', before_id: p.cursor }));
+}
+messageContainer.addEventListener('scroll', () => { if (messageContainer.scrollTop === 0) loadOlder(); });
 
 /* ======== 历史记录渲染 ======== */
-function displayHistory(arr) {
-    if (!arr || !arr.length) return;
+function displayHistory(arr, beforeId) {
+    if (!arr) return;
+    notePage(roomPager, arr);
+    if (beforeId !== undefined) {
+        const rows = [];
+        for (let i = arr.length - 1; i >= 0; i--) rows.push(buildMessageRow(arr[i].raw, isSelfMessage(arr[i].raw) ? 'self-msg' : 'user-msg'));
+        prependMessages(rows);
+        return;
+    }
+    if (!arr.length) return;
     const title = document.createElement('div');
     title.className = 'history-title';
     title.textContent = '=== 最近消息历史 ===';
@@ -156,58 +201,162 @@ function initModals() {
 }
 
 /* ======== WebSocket ======== */
-ws.addEventListener('open', () => { updateConnectionStatus('已连接'); appendMessage('系统：已连接到服务器', 'system-msg'); });
-ws.addEventListener('close', () => { updateConnectionStatus('已断开'); appendMessage('系统：连接已关闭', 'system-msg'); });
-ws.addEventListener('error', () => { updateConnectionStatus('连接错误'); appendMessage('系统：连接发生错误', 'system-msg'); });
+function connect() {
+    ws = new WebSocket(WS_URL);
+    ws.binaryType = 'arraybuffer';
+    ws.addEventListener('open', () => {
+        resume.retry = 0;
+        updateConnectionStatus('已连接');
+        // 登录过就直接续传，不再走用户名密码
+        if (resume.token) ws.send(JSON.stringify({ type: 'resume', token: resume.token, seq: resume.seq }));
+        else appendMessage('系统：已连接到服务器', 'system-msg');
+    });
+    ws.addEventListener('close', () => {
+        updateConnectionStatus('已断开');
+        if (!resume.token) return appendMessage('系统：连接已关闭', 'system-msg');
+        // 指数退避 + 随机抖动：服务端重启时客户端不会在同一时刻一起涌回
+        const delay = Math.min(30000, 500 * 2 ** resume.retry++) * (0.5 + Math.random());
+        appendMessage(`系统：连接断开，${(delay / 1000).toFixed(1)} 秒后重连`, 'system-msg');
+        setTimeout(connect, delay);
+    });
+    ws.addEventListener('error', () => { updateConnectionStatus('连接错误'); });
 
-ws.addEventListener('message', event => {
-    const msg = event.data;
+    ws.addEventListener('message', event => {
+        if (typeof event.data === 'string') return handleFrame(event.data);
+        const v = decodeMsgpack(event.data);
+        typeof v === 'string' ? handleFrame(v) : handleEvent(v);
+    });
+}
+
+/* ======== MessagePack 解码 ======== */
+// 只实现服务端会发的类型：nil/bool/整数/浮点/str/bin/array/map
+const utf8 = new TextDecoder();
+function decodeMsgpack(buf) {
+    const view = new DataView(buf), bytes = new Uint8Array(buf);
+    let pos = 0;
+    const str = n => { const s = utf8.decode(bytes.subarray(pos, pos + n)); pos += n; return s; };
+    const arr = n => { const a = []; while (n--) a.push(read()); return a; };
+    const map = n => { const o = {}; while (n--) { const k = read(); o[k] = read(); } return o; };
+    const u8 = () => view.getUint8(pos++);
+    const u16 = () => { const v = view.getUint16(pos); pos += 2; return v; };
+    const u32 = () => { const v = view.getUint32(pos); pos += 4; return v; };
+    function read() {
+        const t = u8();
+        if (t < 0x80) return t;
+        if (t < 0x90) return map(t & 0x0f);
+        if (t < 0xa0) return arr(t & 0x0f);
+        if (t < 0xc0) return str(t & 0x1f);
+        if (t >= 0xe0) return t - 0x100;
+        let v;
+        switch (t) {
+            case 0xc0: return null;
+            case 0xc2: return false;
+            case 0xc3: return true;
+            case 0xc4: return bytes.slice(pos, pos += u8());
+            case 0xc5: return bytes.slice(pos, pos += u16());
+            case 0xc6: return bytes.slice(pos, pos += u32());
+            case 0xca: v = view.getFloat32(pos); pos += 4; return v;
+            case 0xcb: v = view.getFloat64(pos); pos += 8; return v;
+            case 0xcc: return u8();
+            case 0xcd: return u16();
+            case 0xce: return u32();
+            case 0xcf: v = Number(view.getBigUint64(pos)); pos += 8; return v;
+            case 0xd0: return view.getInt8(pos++);
+            case 0xd1: v = view.getInt16(pos); pos += 2; return v;
+            case 0xd2: v = view.getInt32(pos); pos += 4; return v;
+            case 0xd3: v = Number(view.getBigInt64(pos)); pos += 8; return v;
+            case 0xd9: return str(u8());
+            case 0xda: return str(u16());
+            case 0xdb: return str(u32());
+            case 0xdc: return arr(u16());
+            case 0xdd: return arr(u32());
+            case 0xde: return map(u16());
+            case 0xdf: return map(u32());
+        }
+        throw new Error('msgpack: 不支持的类型 0x' + t.toString(16));
+    }
+    return read();
+}
 
+function handleFrame(msg) {
     if (typeof msg === 'string' && msg.startsWith('系统: 登录成功，欢迎 ')) myUsername = msg.split('欢迎 ')[1].trim();
 
-    try {
-        const j = JSON.parse(msg);
-        switch (j.type) {
-            case 'users_list': updateUsersList(j.users); break;
-            case 'groups_list': updateGroupsList(j.groups); break;
-            case 'history': displayHistory(j.messages); break;
-            case 'create_group_response':
-            case 'add_member_response':
-            case 'remove_member_response':
-            case 'notification':
-                appendMessage('系统: ' + j.message, 'system-msg'); break;
-            case 'group_members': updateGroupMembers(j.group_id, j.members); break;
-            case 'group_messages': displayGroupMessages(j.group_id, j.messages); break;
-            case 'group_message': handleGroupMessage(j); break;
-        }
-        return;
-    } catch { }
+    let j;
+    try { j = JSON.parse(msg); } catch { }
+    if (j && typeof j === 'object') handleEvent(j);
+    else appendMessage(msg, isSelfMessage(msg) ? 'self-msg' : 'user-msg');
+}
 
-    appendMessage(msg, isSelfMessage(msg) ? 'self-msg' : 'user-msg');
-});
+// batch.items 里：对象是 JSON 事件，字符串是原样的文本消息
+function handleEvent(j) {
+    switch (j.type) {
+        case 'batch':
+            if (j.seq) resume.seq = j.seq;
+            j.items.forEach(it => typeof it === 'string' ? handleFrame(it) : handleEvent(it)); break;
+        case 'session': resume.token = j.token; break;
+        case 'resumed': appendMessage(`系统：已恢复会话，补发 ${j.replayed} 条`, 'system-msg'); break;
+        case 'resume_failed':
+            Object.assign(resume, { token: null, seq: [0, 0, 0] });
+            appendMessage('系统：会话已过期，请重新登录', 'system-msg'); break;
+        case 'users_list': updateUsersList(j.users); break;
+        case 'user_joined': applyPresence(j.users, []); break;
+        case 'user_left': applyPresence([], j.users); break;
+        case 'groups_list': updateGroupsList(j.groups); break;
+        case 'history': displayHistory(j.messages, j.before_id); break;
+        case 'create_group_response':
+        case 'add_member_response':
+        case 'remove_member_response':
+        case 'notification':
+            appendMessage('系统: ' + j.message, 'system-msg'); break;
+        case 'group_members': updateGroupMembers(j.group_id, j.members); break;
+        case 'group_messages': displayGroupMessages(j.group_id, j.messages, j.before_id); break;
+        case 'group_message': handleGroupMessage(j); break;
+    }
+}
 
 /* ======== 用户列表 ======== */
+// 登录时收到一次完整快照，之后只按 user_joined / user_left 增量增删节点
+const userNodes = new Map(); // username -> div
+function renderUserCount() {
+    const cnt = userList.querySelector('.user-count');
+    if (cnt) cnt.textContent = `当前共 ${userNodes.size} 人在线`; // 快照到达前可能还没有
+}
+function addUserNode(u) {
+    if (userNodes.has(u)) return;
+    const d = document.createElement('div');
+    d.className = 'user'; d.textContent = u;
+    d.addEventListener('click', () => {
+        userList.querySelectorAll('.user.selected').forEach(el => el.classList.remove('selected'));
+        d.classList.add('selected');
+        Object.assign(currentState, { targetType: 'private', targetName: u, selectedUser: u, selectedGroup: null });
+        chatTarget.textContent = u + ' (私聊)'; input.placeholder = `给 ${u} 发送私信...`;
+        groupList.querySelectorAll('.group.selected').forEach(el => el.classList.remove('selected'));
+    });
+    userList.appendChild(d);
+    userNodes.set(u, d);
+}
 function updateUsersList(users) {
-    currentState.onlineUsers = users;
     const title = userList.querySelector('h3');
     userList.innerHTML = ''; userList.appendChild(title);
+    userNodes.clear();
 
     const cnt = document.createElement('div');
-    cnt.className = 'user-count'; cnt.textContent = `当前共 ${users.length} 人在线`;
+    cnt.className = 'user-count';
     userList.appendChild(cnt);
 
-    users.forEach(u => {
-        const d = document.createElement('div');
-        d.className = 'user'; d.textContent = u;
-        d.addEventListener('click', () => {
-            userList.querySelectorAll('.user.selected').forEach(el => el.classList.remove('selected'));
-            d.classList.add('selected');
-            Object.assign(currentState, { targetType: 'private', targetName: u, selectedUser: u, selectedGroup: null });
-            chatTarget.textContent = u + ' (私聊)'; input.placeholder = `给 ${u} 发送私信...`;
-            groupList.querySelectorAll('.group.selected').forEach(el => el.classList.remove('selected'));
-        });
-        userList.appendChild(d);
+    users.forEach(addUserNode);
+    currentState.onlineUsers = [...userNodes.keys()];
+    renderUserCount();
+}
+function applyPresence(joined, left) {
+    joined.forEach(addUserNode);
+    left.forEach(u => {
+        const d = userNodes.get(u);
+        if (!d) return;
+        d.remove(); userNodes.delete(u);
     });
+    currentState.onlineUsers = [...userNodes.keys()];
+    renderUserCount();
 }
 
 /* ======== 群组列表 ======== */
@@ -236,6 +385,7 @@ function updateGroupsList(groups) {
             chatTarget.textContent = g.name + ' (群聊)';
             input.placeholder = `在群组 ${g.name} 中发言...`;
             userList.querySelectorAll('.user.selected').forEach(el => el.classList.remove('selected'));
+            resetPager(groupPager);
             ws.send(JSON.stringify({ type: 'get_group_messages', group_id: g.id }));
         });
 
@@ -287,8 +437,17 @@ function updateGroupMembers(gid, members) {
 }
 
 /* ======== 群组历史 / 新消息 ======== */
-function displayGroupMessages(gid, msgs) {
+const groupRow = m => {
+    const raw = `[${m.timestamp}] ${m.sender}: ${m.message}`;
+    return buildMessageRow(raw, m.sender === myUsername ? 'self-msg' : 'group-msg');
+};
+function displayGroupMessages(gid, msgs, beforeId) {
     if (currentState.selectedGroup && currentState.selectedGroup.id !== gid) return;
+    notePage(groupPager, msgs);
+    if (beforeId !== undefined) {
+        prependMessages(msgs.slice().reverse().map(groupRow));
+        return;
+    }
     messageContainer.innerHTML = '';
     const title = document.createElement('div');
     title.className = 'history-title';
@@ -296,10 +455,8 @@ function displayGroupMessages(gid, msgs) {
     messageContainer.appendChild(title);
 
     if (!msgs.length) appendMessage('暂无消息历史', 'system-msg');
-    else msgs.forEach(m => {
-        const raw = `[${m.timestamp}] ${m.sender}: ${m.message}`;
-        appendMessage(raw, m.sender === myUsername ? 'self-msg' : 'group-msg');
-    });
+    else msgs.slice().reverse().forEach(m => messageContainer.appendChild(groupRow(m))); // 旧 → 新
+    messageContainer.scrollTop = messageContainer.scrollHeight;
     const sep = document.createElement('div'); sep.className = 'separator'; sep.textContent = '=== 以上是历史消息 ===';
     messageContainer.appendChild(sep);
 }
@@ -334,3 +491,4 @@ chatTarget.addEventListener('click', () => {
 
 /* ======== 初始化 ======== */
 initModals();
+connect();